@@ -1,8 +1,19 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
 /* this reads a .csv file of SQM data and calculates a new attribute that
  * measures the roughness of the SQM data  */
@@ -63,42 +74,613 @@
  * minute (sample rate) */
 /* changing dimension from 300 (5-minute data) to 1500 (1-minute data) */
 
-int yisleap(int year) {
-  return (year % 4 == 0 && year % 100 != 0) || (year % 400 == 0);
+/* October 18, 2026
+ * the Residual Standard Error is now calculated with running sums which are
+ * updated as the regression window slides along the day, so the cost per
+ * sample no longer grows with half_range (see calc_rse_night) */
+/* the fixed 1500 sample arrays are replaced by a night buffer (struct
+ * night_buffer) which grows as needed, so there is no longer a limit on the
+ * number of samples per day - 10 and 30 second cadences are fine */
+/* the input file is memory-mapped (or read in large blocks from a pipe) and
+ * the records are split and converted in place instead of by fscanf; bad
+ * records are reported with their line number (see struct sqm_reader) */
+/* the raw UDM .dat files ("Light Pollution Monitoring Data Format 1.0") are
+ * read directly, taking the location, position and cover offset from their
+ * header, so the lat and long may be left off the command line */
+/* the MoonPhase, MoonElev, MoonIllum and SunElev columns, which the .dat files
+ * do not have, are calculated by a built-in ephemeris (calc_sun_moon_night),
+ * which --golden checks against the UDM values of the sample output file */
+/* added a batch mode (--batch manifest.txt) which processes many files at
+ * once on a pool of threads and prints a summary of records per second,
+ * nights and failures; the work for one file is now done by process_file.
+ * Build with: gcc -O2 -o addSQMattributes addSQMattributes_UDM_v6.c -lm
+ * -pthread */
+/* the work on one day/segment is now done by process_night, and a single
+ * long file may be spread over several threads (--threads), which parse it,
+ * find its days/segments and process them at the same time, writing them out
+ * in order (see process_file_parallel) */
+/* the right ascension, Galactic Coordinates and J2000 day are calculated
+ * for a whole night at a time by calc_coordinates_night, instead of calling
+ * get_right_ascension and get_J2000 for every record */
+/* the messages on the screen now have levels (--log quiet|info|debug|trace);
+ * the values of every sample, which used to be printed several times over
+ * for every record, are only printed at the trace level, and at the info
+ * level each night gets a summary line instead */
+/* the output records are written by put_record instead of fprintf, with the
+ * same text but in a fraction of the time */
+/* with --binary the output is also written to a _SQM_Attr3.sqmb file of
+ * typed columns, one block per night and an index of the nights, which can be
+ * memory-mapped and read a column or a night at a time (see
+ * struct binary_header) */
+/* with --incremental a checkpoint is kept next to the output file, and the
+ * next run only processes the last day/segment of the last run and the
+ * samples added to the input since, appending them to the output (see
+ * struct checkpoint) */
+/* the input may be read from stdin (an input file name of -) and the output
+ * written to stdout or any named file (--output), a day at a time, holding no
+ * more than a day of samples in memory */
+/* with --classify the samples are flagged clear or cloudy by their RSE, and
+ * each record gets the flag and a clean-sky Msas_Avg of just the clear
+ * samples (see classify_night) */
+/* with --nights a _SQM_Nights.csv table is written as well, with one row of
+ * statistics per night - the darkest hour, the Msas median and maximum, the
+ * spread of the RSE and so on - for those who don't need every sample (see
+ * night_table_row) */
+/* with --robust each RSE window is fitted by a Huber M-estimator, and the RSE
+ * is its median absolute residual scale, so a satellite or headlight spike no
+ * longer shows up as roughness (see calc_rse_night_robust); it refits every
+ * window, so it costs 10 to 45 times as much as the least squares RSE, more
+ * the wider the window, which --bench-rse measures */
+/* with --window the RSE window of each sample is a number of minutes either
+ * side of it instead of a number of samples, found with two pointers over
+ * minutes_since_3pm, so it spans the same time whatever the cadence of the
+ * station or the drift of its logger (see time_windows) */
+/* with --tz, local standard time (for MinSince3pmStdTime) and the night
+ * number are worked out from UTC by a time zone - a zoneinfo file, a POSIX
+ * TZ string or the Local timezone of a .dat file - whose changes of UTC
+ * offset are tabulated once, instead of by the longitude and a guess at
+ * daylight saving time (see struct time_zone) */
+/* with --bench the program times itself, stage by stage, on years of
+ * synthetic data from any number of stations at any cadence from 10 seconds
+ * to 15 minutes, with twilight, moonlight, clouds, gaps and daylight saving
+ * time in it (see struct synthetic_spec), and --bench-history keeps the
+ * results in a file; --golden checks that the results are still those of the
+ * sample output file that comes with the program (see golden_check) */
+/* with --scales the RSE is worked out at several half_ranges (or window
+ * lengths) at once, each in a column of its own, from one set of prefix sums
+ * of the night, so a sweep of the scales for tuning a station takes one run
+ * instead of one per scale (see calc_rse_prefix) */
+/* with --report the counts of a run - records read, rejected and written,
+ * nights, gaps, RSE nodata values, bytes in and out - and the time of each
+ * stage, for each file and in all, are written to a JSON file (see
+ * write_report), and --progress reports on a long file as it goes */
+/* with --registry the zero point offsets and temperature coefficients of the
+ * stations, kept with their positions and the dates they apply to in a
+ * registry file, are applied as the data is read, in an Msas_Corr column,
+ * instead of in a separate pass over the output (see struct
+ * station_registry) */
+/* input and output files whose names end in .gz or .zst are read and written
+ * through gzip or zstd, running alongside the program, so a compressed
+ * archive no longer has to be unpacked to the disk first, nor the output
+ * packed afterwards (see struct compression) */
+/* with --index a _SQM_Attr3.sqmi index is written with the output, giving
+ * where each night is in the .csv file and the range of its Msas, SunElev and
+ * MoonElev, and --query uses it to read a night or a range of nights, or
+ * just their dark samples, with a seek per night instead of reading the
+ * whole file (see run_query) */
+
+/* Messages go to stdout at one of four levels, chosen on the command line
+ * with --log quiet|info|debug|trace: quiet only reports errors, info (the
+ * default) adds what is being done to which file and a summary line for every
+ * night, debug adds the details of the set up and of each night, and trace
+ * adds the values worked out for every sample. A message below the chosen
+ * level costs a comparison; its arguments are not even evaluated */
+enum log_levels { LOG_QUIET, LOG_INFO, LOG_DEBUG, LOG_TRACE };
+
+int log_level = LOG_INFO;
+
+/* set when the output records go to stdout, so that the messages go to
+ * stderr instead */
+int log_to_stderr = 0;
+
+void log_message(const char *format, ...) {
+  va_list args;
+
+  va_start(args, format);
+  vfprintf(log_to_stderr ? stderr : stdout, format, args);
+  va_end(args);
+}
+
+#define log_at(level, ...)                                                     \
+  do {                                                                         \
+    if (log_level >= (level)) {                                                \
+      log_message(__VA_ARGS__);                                                \
+    }                                                                          \
+  } while (0)
+#define log_error(...) log_at(LOG_QUIET, __VA_ARGS__)
+#define log_info(...) log_at(LOG_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+#define log_trace(...) log_at(LOG_TRACE, __VA_ARGS__)
+
+/* the level named by text, or -1 */
+int parse_log_level(const char *text) {
+  static const char *names[] = {"quiet", "info", "debug", "trace"};
+  int level;
+
+  for (level = LOG_QUIET; level <= LOG_TRACE; level++) {
+    if (strcmp(text, names[level]) == 0) {
+      return level;
+    }
+  }
+  return -1;
+}
+
+/* the number of days from Jan 1, 1970 to the given date of the proleptic
+ * Gregorian calendar, negative before it, in constant time: the year is
+ * taken to start on March 1, so that the leap day falls at its end, and
+ * split into 400-year eras of 146097 days (after Howard Hinnant's
+ * days_from_civil) */
+int days_from_civil(int year, int month, int day) {
+  int era, year_of_era, day_of_year, day_of_era;
+
+  year = year - (month <= 2);
+  era = (year >= 0 ? year : year - 399) / 400;
+  year_of_era = year - era * 400;
+  day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 +
+               day_of_year;
+  return era * 146097 + day_of_era - 719468;
+}
+
+/* the date days after Jan 1, 1970, the inverse of days_from_civil (after
+ * Howard Hinnant's civil_from_days) */
+void civil_from_days(int days, int *year, int *month, int *day) {
+  int era, day_of_era, year_of_era, day_of_year, mp;
+
+  days = days + 719468;
+  era = (days >= 0 ? days : days - 146096) / 146097;
+  day_of_era = days - era * 146097;
+  year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 -
+                 day_of_era / 146096) /
+                365;
+  day_of_year = day_of_era -
+                (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+  mp = (5 * day_of_year + 2) / 153;
+  *day = day_of_year - (153 * mp + 2) / 5 + 1;
+  *month = mp < 10 ? mp + 3 : mp - 9;
+  *year = year_of_era + era * 400 + (*month <= 2);
 }
 
+/* the number of days since Jan 1, 2018, counting that day as 1; the earlier
+ * version summed the days of every year back to 2018 and did not work for
+ * dates before it, which now count down through 0 (Dec 31, 2017) to negative
+ * values */
 int get_yday(int mon, int day, int year) {
-  static const int days[2][13] = {
-      {0, 0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334},
-      {0, 0, 31, 60, 91, 121, 152, 182, 213, 244, 274, 305, 335}};
-  int days_this_year;
-  int n, days_since_Jan1_2018;
-  int sum = 0;
-
-  int leap = yisleap(year);
-  days_this_year = days[leap][mon] + day;
-
-  /* count the number of days in complete previous years */
-  /* note, this algorithm does not work for any dates prior to 1-1-2018 */
-  for (n = year - 1; n > 2017; n = n - 1) {
-    int leap = yisleap(n);
-    if (leap == 0) {
-      sum = sum + 365;
-    } else {
-      sum = sum + 366;
+  /* days_from_civil(2017, 12, 31) */
+  return days_from_civil(year, mon, day) - 17531;
+}
+
+/* Time zones (--tz). By default the local standard time, from which
+ * minutes_since_3pm and the night number are worked out, is estimated from
+ * the longitude of the SQM, and daylight saving time is guessed at by
+ * comparing the local hour of the file with it, which goes wrong near the
+ * edges of a time zone. With --tz the time zone is given instead, by a
+ * zoneinfo name (America/Chicago) or a POSIX TZ string (CST6CDT, or
+ * CST6CDT,M3.2.0,M11.1.0); --tz header takes the "Local timezone" of a .dat
+ * file. Its transitions are worked out once, into a table of the UTC times
+ * at which the UTC offset changes, and each sample looks its offset up in
+ * the table, starting from where the sample before it was found, so it
+ * costs the same however many transitions there are */
+struct time_zone {
+  int count;     /* entries in the table */
+  int capacity;
+  long long *at; /* the UTC seconds at which each entry starts, ascending;
+                    the first one starts at LLONG_MIN */
+  int *offset;   /* the UTC offset in seconds from then on */
+  int *standard; /* and that of standard time */
+};
+
+/* the first and last years for which the rules of a POSIX TZ string are
+ * turned into transitions */
+#define TZ_FIRST_YEAR 1970
+#define TZ_LAST_YEAR 2100
+
+void time_zone_free(struct time_zone *tz) {
+  free(tz->at);
+  free(tz->offset);
+  free(tz->standard);
+  memset(tz, 0, sizeof(*tz));
+}
+
+/* append an entry to the table; returns 0 if we run out of memory */
+int time_zone_add(struct time_zone *tz, long long at, int offset,
+                  int standard) {
+  long long *at_grown;
+  int *offset_grown, *standard_grown, capacity;
+
+  if (tz->count == tz->capacity) {
+    capacity = tz->capacity > 0 ? tz->capacity * 2 : 256;
+    at_grown = realloc(tz->at, sizeof(long long) * (size_t)capacity);
+    if (at_grown != NULL) {
+      tz->at = at_grown;
+    }
+    offset_grown = realloc(tz->offset, sizeof(int) * (size_t)capacity);
+    if (offset_grown != NULL) {
+      tz->offset = offset_grown;
+    }
+    standard_grown = realloc(tz->standard, sizeof(int) * (size_t)capacity);
+    if (standard_grown != NULL) {
+      tz->standard = standard_grown;
+    }
+    if (at_grown == NULL || offset_grown == NULL || standard_grown == NULL) {
+      return 0;
+    }
+    tz->capacity = capacity;
+  }
+  tz->at[tz->count] = at;
+  tz->offset[tz->count] = offset;
+  tz->standard[tz->count] = standard;
+  tz->count = tz->count + 1;
+  return 1;
+}
+
+/* the parts of a POSIX TZ string, such as CST6CDT,M3.2.0/2,M11.1.0/2 */
+struct tz_rule {
+  int standard, daylight; /* UTC offsets in seconds */
+  int has_daylight;
+  char kind[2];         /* 'M', 'J' or 'D' (day of the year from 0) */
+  int month[2], week[2], weekday[2], day[2];
+  int time[2];          /* seconds after local midnight */
+};
+
+/* read a TZ name (letters, or anything between < and >) at *p */
+int tz_parse_name(const char **p) {
+  const char *start = *p;
+
+  if (**p == '<') {
+    while (**p != '\0' && **p != '>') {
+      *p = *p + 1;
+    }
+    if (**p != '>') {
+      return 0;
+    }
+    *p = *p + 1;
+    return *p - start > 2;
+  }
+  while ((**p >= 'A' && **p <= 'Z') || (**p >= 'a' && **p <= 'z')) {
+    *p = *p + 1;
+  }
+  return *p - start >= 3;
+}
+
+/* read [+-]hh[:mm[:ss]] at *p into seconds */
+int tz_parse_time(const char **p, int *seconds) {
+  int sign = 1, part[3] = {0, 0, 0}, n = 0;
+
+  if (**p == '+' || **p == '-') {
+    sign = **p == '-' ? -1 : 1;
+    *p = *p + 1;
+  }
+  if (**p < '0' || **p > '9') {
+    return 0;
+  }
+  for (;;) {
+    while (**p >= '0' && **p <= '9') {
+      part[n] = part[n] * 10 + (**p - '0');
+      *p = *p + 1;
+    }
+    if (**p != ':' || n == 2) {
+      break;
+    }
+    *p = *p + 1;
+    n = n + 1;
+  }
+  *seconds = sign * (part[0] * 3600 + part[1] * 60 + part[2]);
+  return 1;
+}
+
+/* read the date[/time] of a rule at *p into the n-th change of rule */
+int tz_parse_change(const char **p, struct tz_rule *rule, int n) {
+  char *end;
+
+  rule->time[n] = 2 * 3600;
+  if (**p == 'M') {
+    rule->kind[n] = 'M';
+    rule->month[n] = (int)strtol(*p + 1, &end, 10);
+    if (*end != '.') {
+      return 0;
+    }
+    rule->week[n] = (int)strtol(end + 1, &end, 10);
+    if (*end != '.') {
+      return 0;
+    }
+    rule->weekday[n] = (int)strtol(end + 1, &end, 10);
+    if (rule->month[n] < 1 || rule->month[n] > 12 || rule->week[n] < 1 ||
+        rule->week[n] > 5 || rule->weekday[n] < 0 || rule->weekday[n] > 6) {
+      return 0;
+    }
+  } else {
+    rule->kind[n] = **p == 'J' ? 'J' : 'D';
+    rule->day[n] = (int)strtol(**p == 'J' ? *p + 1 : *p, &end, 10);
+    if (end == *p) {
+      return 0;
+    }
+  }
+  *p = end;
+  if (**p == '/') {
+    *p = *p + 1;
+    return tz_parse_time(p, &rule->time[n]);
+  }
+  return 1;
+}
+
+/* read a POSIX TZ string; returns 0 if it isn't one */
+int tz_parse_rule(const char *text, struct tz_rule *rule) {
+  const char *p = text, *rules = ",M3.2.0,M11.1.0";
+
+  memset(rule, 0, sizeof(*rule));
+  if (!tz_parse_name(&p) || !tz_parse_time(&p, &rule->standard)) {
+    return 0;
+  }
+  /* POSIX counts the hours west of Greenwich */
+  rule->standard = -rule->standard;
+  if (*p == '\0') {
+    return 1;
+  }
+  if (!tz_parse_name(&p)) {
+    return 0;
+  }
+  rule->has_daylight = 1;
+  rule->daylight = rule->standard + 3600;
+  if (*p != ',' && *p != '\0') {
+    if (!tz_parse_time(&p, &rule->daylight)) {
+      return 0;
+    }
+    rule->daylight = -rule->daylight;
+  }
+  /* with no rules, those of the United States since 2007 */
+  if (*p == '\0') {
+    p = rules;
+  }
+  if (*p != ',') {
+    return 0;
+  }
+  p = p + 1;
+  if (!tz_parse_change(&p, rule, 0) || *p != ',') {
+    return 0;
+  }
+  p = p + 1;
+  return tz_parse_change(&p, rule, 1) && *p == '\0';
+}
+
+/* the UTC seconds at which the n-th change of rule happens in year */
+long long tz_change_at(const struct tz_rule *rule, int n, int year) {
+  int day, first, last, leap;
+
+  leap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+  if (rule->kind[n] == 'M') {
+    first = days_from_civil(year, rule->month[n], 1);
+    last = rule->month[n] == 12 ? days_from_civil(year + 1, 1, 1) - 1
+                                : days_from_civil(year, rule->month[n] + 1,
+                                                  1) -
+                                      1;
+    /* Jan 1, 1970 was a Thursday (4) */
+    day = first + ((rule->weekday[n] - (first + 4) % 7 + 14) % 7) +
+          (rule->week[n] - 1) * 7;
+    while (day > last) {
+      day = day - 7;
+    }
+  } else if (rule->kind[n] == 'J') {
+    day = days_from_civil(year, 1, 1) + rule->day[n] - 1 +
+          (leap && rule->day[n] >= 60);
+  } else {
+    day = days_from_civil(year, 1, 1) + rule->day[n];
+  }
+  /* the time of the change is local time before it */
+  return (long long)day * 86400 + rule->time[n] -
+         (n == 0 ? rule->standard : rule->daylight);
+}
+
+/* append the transitions of rule from year first to TZ_LAST_YEAR which come
+ * after after; returns 0 if we run out of memory */
+int tz_add_rule(struct time_zone *tz, const struct tz_rule *rule, int first,
+                long long after) {
+  long long at[2];
+  int year, k, n;
+
+  if (!rule->has_daylight) {
+    return 1;
+  }
+  for (year = first; year <= TZ_LAST_YEAR; year++) {
+    /* the change to daylight time, and back; south of the equator the one
+     * back comes first */
+    at[0] = tz_change_at(rule, 0, year);
+    at[1] = tz_change_at(rule, 1, year);
+    for (k = 0; k < 2; k++) {
+      n = at[0] < at[1] ? k : 1 - k;
+      if (at[n] > after &&
+          !time_zone_add(tz, at[n], n == 0 ? rule->daylight : rule->standard,
+                         rule->standard)) {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+/* the big-endian number of size bytes at p */
+long long tz_number(const unsigned char *p, int size) {
+  unsigned long long u = 0;
+  int k;
+
+  for (k = 0; k < size; k++) {
+    u = (u << 8) | p[k];
+  }
+  if (size == 4) {
+    return (int32_t)(uint32_t)u;
+  }
+  return (long long)u;
+}
+
+/* load the zoneinfo (TZif) file of name - from $TZDIR or
+ * /usr/share/zoneinfo unless it is a path - into tz, using the 64-bit data
+ * of a version 2 or later file, and the TZ string at its end for the times
+ * after its last transition; returns 0 if there is no such file */
+int tz_load_zoneinfo(struct time_zone *tz, const char *name) {
+  char path[4096];
+  const char *dir = getenv("TZDIR");
+  unsigned char *data = NULL;
+  const unsigned char *p, *times, *indices, *types, *end;
+  long size;
+  int count[6], size_time = 4, ok = 0, version, k, type, last, standard;
+  struct tz_rule rule;
+  char footer[256];
+  FILE *file;
+
+  snprintf(path, sizeof(path), "%s/%s",
+           dir != NULL && dir[0] != '\0' ? dir : "/usr/share/zoneinfo", name);
+  file = fopen(name[0] == '/' ? name : path, "rb");
+  if (file == NULL) {
+    return 0;
+  }
+  if (fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) > 44 &&
+      size < (1L << 20) && fseek(file, 0, SEEK_SET) == 0 &&
+      (data = malloc((size_t)size)) != NULL &&
+      fread(data, 1, (size_t)size, file) == (size_t)size &&
+      memcmp(data, "TZif", 4) == 0) {
+    ok = 1;
+  }
+  fclose(file);
+  if (!ok) {
+    free(data);
+    return 0;
+  }
+
+  /* the counts of UT/local indicators, standard/wall indicators, leap
+   * seconds, transitions, local time types and abbreviation characters */
+  version = data[4];
+  p = data;
+  end = data + size;
+  for (;;) {
+    for (k = 0; k < 6; k++) {
+      count[k] = (int)tz_number(p + 20 + 4 * k, 4);
+    }
+    times = p + 44;
+    indices = times + (size_t)count[3] * size_time;
+    types = indices + count[3];
+    p = types + (size_t)count[4] * 6 + count[5] +
+        (size_t)count[2] * (size_time + 4) + count[1] + count[0];
+    if (count[4] < 1 || p > end) {
+      free(data);
+      return 0;
+    }
+    if (size_time == 8 || version < '2' || p + 44 > end ||
+        memcmp(p, "TZif", 4) != 0) {
+      break;
+    }
+    /* skip the 32-bit data of a version 2 or later file */
+    size_time = 8;
+  }
+
+  /* the local time type before the first transition is the first one; the
+   * standard offset carries on through any daylight time which follows */
+  last = (int)tz_number(types, 4);
+  standard = types[4] ? last - 3600 : last;
+  ok = time_zone_add(tz, LLONG_MIN, last, standard);
+  for (k = 0; ok && k < count[3]; k++) {
+    type = indices[k] < count[4] ? indices[k] : 0;
+    last = (int)tz_number(types + 6 * type, 4);
+    if (!types[6 * type + 4]) {
+      standard = last;
+    }
+    ok = time_zone_add(tz, tz_number(times + (size_t)k * size_time, size_time),
+                       last, standard);
+  }
+
+  /* the footer: a TZ string between newlines */
+  if (ok && size_time == 8 && p < end && *p == '\n') {
+    for (k = 0; p + 1 + k < end && p[1 + k] != '\n' &&
+                k < (int)sizeof(footer) - 1;
+         k++) {
+      footer[k] = (char)p[1 + k];
     }
+    footer[k] = '\0';
+    if (k > 0 && tz_parse_rule(footer, &rule)) {
+      ok = tz_add_rule(tz, &rule,
+                       count[3] > 0 ? 1970 + (int)(tz->at[tz->count - 1] /
+                                                   31556952) -
+                                          1
+                                    : TZ_FIRST_YEAR,
+                       tz->at[tz->count - 1]);
+    }
+  }
+  free(data);
+  return ok;
+}
+
+/* set up tz for name, a zoneinfo name or else a POSIX TZ string; returns 0
+ * if it is neither, or we run out of memory */
+int time_zone_load(struct time_zone *tz, const char *name) {
+  struct tz_rule rule;
+
+  memset(tz, 0, sizeof(*tz));
+  if (tz_load_zoneinfo(tz, name)) {
+    return 1;
+  }
+  time_zone_free(tz);
+  if (!tz_parse_rule(name, &rule)) {
+    return 0;
+  }
+
+  /* south of the equator, the year starts in daylight time */
+  if (!time_zone_add(tz, LLONG_MIN,
+                     rule.has_daylight &&
+                             tz_change_at(&rule, 1, TZ_FIRST_YEAR) <
+                                 tz_change_at(&rule, 0, TZ_FIRST_YEAR)
+                         ? rule.daylight
+                         : rule.standard,
+                     rule.standard) ||
+      !tz_add_rule(tz, &rule, TZ_FIRST_YEAR, LLONG_MIN)) {
+    time_zone_free(tz);
+    return 0;
   }
+  return 1;
+}
+
+/* the entry of tz in effect at t, in UTC seconds; *cursor is where the last
+ * sample was found, and as the samples are in time order this one is nearly
+ * always there or in the next entry, and otherwise is found by bisection */
+int time_zone_find(const struct time_zone *tz, long long t, int *cursor) {
+  int low, high, middle, n = *cursor;
 
-  days_since_Jan1_2018 = sum + days_this_year;
-  printf(" Year=%d  Days in previous year(s)=%d\n", year, sum);
-  printf(" Month=%d  Date=%d  Days this year %d\n", mon, day, days_this_year);
-  return days_since_Jan1_2018;
+  if (n >= 0 && n < tz->count && tz->at[n] <= t) {
+    if (n + 1 == tz->count || t < tz->at[n + 1]) {
+      return n;
+    }
+    if (n + 2 == tz->count || t < tz->at[n + 2]) {
+      *cursor = n + 1;
+      return n + 1;
+    }
+  }
+  /* the first entry starts at LLONG_MIN */
+  low = 0;
+  high = tz->count - 1;
+  while (low < high) {
+    middle = (low + high + 1) / 2;
+    if (tz->at[middle] <= t) {
+      low = middle;
+    } else {
+      high = middle - 1;
+    }
+  }
+  *cursor = low;
+  return low;
 }
 
 double get_UT(int UTC_Hour, int UTC_Min, int UTC_Sec) {
   double UT;
   UT = UTC_Hour + (float)UTC_Min / 60. + (float)UTC_Sec / 3600.;
-  printf(" in_get_UT  UT=%lf\n", UT);
+  log_trace(" in_get_UT  UT=%lf\n", UT);
   return UT;
 }
 
@@ -111,7 +693,7 @@ double get_J2000(int year, int UTC_Month, int UTC_Day, int UTC_Hour,
       ((double)UTC_Hour + ((double)UTC_Min) / 60. + ((double)UTC_Sec) / 3600.) /
       24.;
   J2000_days = dwhole + dfrac;
-  printf(" in get_J2000  J2000_days=%lf\n", J2000_days);
+  log_trace(" in get_J2000  J2000_days=%lf\n", J2000_days);
   return J2000_days;
 }
 
@@ -131,18 +713,19 @@ double get_right_ascension(int year, int UTC_Month, int UTC_Day, int UTC_Hour,
       UTC_Sec = 0;
       SQM_Long = -1.9166667;
   */
-  printf(" in get_right_ascension -- SQM_Long=%g\n", SQM_Long);
+  log_trace(" in get_right_ascension -- SQM_Long=%g\n", SQM_Long);
 
   /* get the J2000 day value */
   J2000_days = get_J2000(year, UTC_Month, UTC_Day, UTC_Hour, UTC_Min, UTC_Sec);
-  printf(" J2000_days=%g\n", J2000_days);
+  log_trace(" J2000_days=%g\n", J2000_days);
 
   /*  get the Universal time as a fraction of a day */
   UT = get_UT(UTC_Hour, UTC_Min, UTC_Sec);
-  printf(" UT=%g\n", UT);
+  log_trace(" UT=%g\n", UT);
 
   right_ascension = 100.46 + 0.985647 * J2000_days + SQM_Long + 15. * UT;
-  printf(" right_ascension before 0-360 check(degrees) =%g\n", right_ascension);
+  log_trace(" right_ascension before 0-360 check(degrees) =%g\n",
+            right_ascension);
 
   /* make sure that the value is within the range of 0 to 360 degrees */
   /* how many multiples of 360 do we have?  Subtract or add out that number */
@@ -158,681 +741,6462 @@ double get_right_ascension(int year, int UTC_Month, int UTC_Day, int UTC_Hour,
   if (right_ascension < 0) {
     right_ascension = right_ascension + 360.;
   }
-  printf(" right_ascension after 0-360 check(degrees) =%g\n", right_ascension);
+  log_trace(" right_ascension after 0-360 check(degrees) =%g\n",
+            right_ascension);
 
   /* convert right_ascension from degrees to hours */
   right_ascension = right_ascension / 15.;
 
-  printf(" right_ascension (hours) =%g\n", right_ascension);
+  log_trace(" right_ascension (hours) =%g\n", right_ascension);
   return right_ascension;
 }
 
-int main(int argc, char *argv[]) {
-  int i = 0, j = 0, k = 0, m = 0;
-  int minutes_since_3pm[1500];
-  int dUYear[1500], dUMonth[1500], dUDay[1500], dUHour[1500], dUMinute[1500];
-  float dUSeconds[1500];
-  int dYear[1500], dMonth[1500], dDay[1500], dHour[1500], dMinute[1500];
-  float dSeconds[1500];
-  float dMsas[1500], dMsas_Corr[1500];
-  float dVolts[1500], dCelsius[1500];
-  float dMoonPhase[1500], dMoonElev[1500], dMoonIllum[1500], dSunElev[1500];
-  float msas_Avg[1500], msas_Sum, msas_Count;
-  int dStatus[1500];
-  char NameIn[120];
-  char NameOut[120];
-  char SQM_Location[30];
-  char blank[200];
-  int nfile, length, ret, Start, Last, len2;
-  double right_ascension, SQM_Lat, SQM_Long, SQM_Dec, SQM_RA, J2000_days;
-  int timediff, num_minutesA, num_minutesB;
-  float remainder;
-  double Galactic_Lat, Galactic_Long;
-  double pi;
-  double XX, YY;
+/* Sum of squared residuals (SS) about the regression line for the window of
+ * samples first..last, calculated directly: fit the line, evaluate it at every
+ * point of the window to get the expected values, and sum (observed -
+ * expected)**2. This is the original calculation; calc_rse_night falls back to
+ * it whenever the closed form would lose too many digits */
+long double get_SS_direct(const int *minutes_since_3pm, const float *dMsas,
+                          int first, int last) {
+  long double sum_x, sum_y, sum_xy, sum_x2, N, mean_x, mean_y, mean_xy, mean_x2;
+  long double slope, yintercept, Observed, Expected, SS;
+  int k;
 
-  /* NGP is North Galactic Pole, NCP is North Celestial Pole */
-  double RightAscension_NGP, Dec_NGP, Galactic_Long_NCP;
-  long double sum_x, sum_y, sum_xy, sum_x2, sum_y2, N, mean_x, mean_y, mean_xy,
-      mean_x2;
-  long double slope, yintercept, rcorr, rsqrd;
-  int half_range, kk, timediff_max;
-  long double Observed[1500], Expected[1500], nodata1, nodata2;
-  long double DOF, RSE[1500], SS[1500], RSE_mult;
+  sum_x = 0.0;
+  sum_y = 0.0;
+  sum_xy = 0.0;
+  sum_x2 = 0.0;
+  for (k = first; k < last + 1; k++) {
+    sum_x = sum_x + (long double)minutes_since_3pm[k];
+    sum_y = sum_y + (long double)dMsas[k];
+    sum_xy = sum_xy + (long double)minutes_since_3pm[k] * (long double)dMsas[k];
+    sum_x2 = sum_x2 + (long double)minutes_since_3pm[k] *
+                          (long double)minutes_since_3pm[k];
+  }
+  N = (long double)(last - first + 1);
+  mean_x = sum_x / N;
+  mean_y = sum_y / N;
+  mean_xy = sum_xy / N;
+  mean_x2 = sum_x2 / N;
+  slope = (mean_xy - (mean_x * mean_y)) / (mean_x2 - (mean_x * mean_x));
+  yintercept =
+      ((mean_x2 * mean_y) - (mean_xy * mean_x)) / (mean_x2 - (mean_x * mean_x));
 
-  /* added to handle the daylight savings time fix to "minutes since 3pm" */
-  int dPosNeg, dHour_Delta, dShift_Hour;
+  SS = 0.0;
+  for (k = first; k < last + 1; k++) {
+    Expected = slope * (long double)minutes_since_3pm[k] + yintercept;
+    Observed = (long double)dMsas[k];
+    SS = SS + ((Observed - Expected) * (Observed - Expected));
+  }
+  return SS;
+}
 
-  /* set up a multiplier for the RSE values and no-data output values */
-  /* we output the RSE values multiplied by this constant to give more
-   * manageable values */
-  RSE_mult = 1000.;
-  nodata1 = 999. * RSE_mult;
-  nodata2 = 888. * RSE_mult;
+/* The regression window of each sample of a day/segment is the samples
+ * window_first[kk]..window_last[kk], or window_first[kk] is -1 if the sample
+ * has none. By default (sample_windows) the window about sample kk runs from
+ * kk - half_range to kk + half_range, so how long it lasts depends on the
+ * cadence of the station and on any drift of its logger. With --window
+ * (time_windows) it holds instead the samples within window_minutes either
+ * side of sample kk, however many there are, so it lasts as long for every
+ * station and every night */
 
-  /* specify the maxiumum number of minutes allowed between SQM samples, prior
-   * to marking a data gap */
-  timediff_max = 16.;
+/* the windows of half_range samples either side: the samples within
+ * half_range of either end of the segment, and all samples of a segment with
+ * fewer than 2*half_range+1 samples, have none */
+void sample_windows(int count, int half_range, int *window_first,
+                    int *window_last) {
+  int kk;
 
-  /* Run this program by specifying the program name, followed by three
-   * parameters: 1) A file of SQM data which has already been processed as a csv
-   * with sun and moon data */
-  /*                      2) The latitude of the SQM location in fractions and
-   *                      3) The longitude of the SQM location in fractions and
-   * so the command line should look like this:
-   *                             ./addSQMattributes inputfilename.csv 43.7916667
-   * -120.23422 */
+  for (kk = 0; kk < count; kk++) {
+    window_first[kk] = -1;
+    if (kk >= half_range && kk < count - half_range) {
+      window_first[kk] = kk - half_range;
+      window_last[kk] = kk + half_range;
+    }
+  }
+  /* first check to see if we have enough points in the current day to
+   * calculate a valid standard error statistic */
+  if (count < 2 * half_range + 1) {
+    log_debug("We only have %d data points for this day/segment and can't "
+              "calculate a valid standard error. \n",
+              count);
+  }
+}
 
-  printf("We are running Program %s\n", argv[0]);
+/* the windows of window_minutes either side, by minutes_since_3pm; as sample
+ * kk moves along, the first and last samples of its window only ever move
+ * along too, so this is one pass with two pointers. A sample has no window if
+ * the window runs off either end of the segment, or holds fewer than
+ * window_samples samples (and never fewer than 3, leaving a residual).
+ *
+ * A segment which runs on past 15:00 (when the 15:00 sample is missing)
+ * starts minutes_since_3pm again from 0, so the time of a sample is its
+ * minutes_since_3pm plus a day for each time that has happened before it,
+ * which is kept up separately for kk and for each end of its window */
+void time_windows(int count, const int *minutes_since_3pm, int window_minutes,
+                  int window_samples, int *window_first, int *window_last) {
+  const int *m = minutes_since_3pm;
+  int kk, first = 0, last = 0, missing = 0, time, end;
+  int kk_day = 0, first_day = 0, last_day = 0, step;
 
-  if (argc != 5) {
-    printf(" You need to supply four parameters, the name of an input .csv "
-           "file, the lat and long of the SQM and the Half Range for "
-           "Chi-Squared Calc \n");
-    printf(" The command line should look something like this: "
-           "./addSQMattributes inputfilename.csv 43.7916667 -120.23422 9\n");
-    goto Termination;
+  if (count <= 0) {
+    return;
+  }
+  if (window_samples < 3) {
+    window_samples = 3;
+  }
+  end = m[count - 1];
+  for (kk = 1; kk < count; kk++) {
+    if (m[kk] < m[kk - 1] - 720) {
+      end = end + 1440;
+    }
+  }
+  for (kk = 0; kk < count; kk++) {
+    if (kk > 0 && m[kk] < m[kk - 1] - 720) {
+      kk_day = kk_day + 1440;
+    }
+    time = m[kk] + kk_day;
+    while (first < kk && m[first] + first_day < time - window_minutes) {
+      if (m[first + 1] < m[first] - 720) {
+        first_day = first_day + 1440;
+      }
+      first = first + 1;
+    }
+    while (last + 1 < count) {
+      step = m[last + 1] < m[last] - 720 ? 1440 : 0;
+      if (m[last + 1] + last_day + step > time + window_minutes) {
+        break;
+      }
+      last_day = last_day + step;
+      last = last + 1;
+    }
+    window_first[kk] = -1;
+    if (time - m[0] >= window_minutes && end - time >= window_minutes &&
+        last - first + 1 >= window_samples) {
+      window_first[kk] = first;
+      window_last[kk] = last;
+    } else {
+      missing = missing + 1;
+    }
   }
+  log_debug("%d of the %d samples of this day/segment have no full window of "
+            "at least %d samples\n",
+            missing, count, window_samples);
+}
 
-  len2 = strlen(argv[1]);
-  /* printf(" The input csv filename on reading is: -%s- which has %d
-   * characters. \n", argv[1], len2-1);*/
-  strcpy(NameIn, argv[1]);
-  printf(" The input csv filename is: %s\n", NameIn);
+/* the RSE of the window first..last from the sums of its samples, by the
+ * closed form of calc_rse_night, or directly when that can't be trusted */
+long double rse_from_sums(long double sum_x, long double sum_y,
+                          long double sum_xy, long double sum_x2,
+                          long double sum_y2, const int *minutes_since_3pm,
+                          const float *dMsas, int first, int last,
+                          long double RSE_mult, long double nodata2) {
+  long double N, DOF, mean_x, mean_y, mean_xy, mean_x2, slope;
+  long double Sxx, Sxy, Syy, SS, RSE;
 
-  /* printf(" The latitude of the SQM on reading is: %s\n", argv[2]); */
-  sscanf(argv[2], "%lf", &SQM_Lat);
-  printf(" The latitude of the SQM is: %lf\n", SQM_Lat);
+  N = (long double)(last - first + 1);
 
-  /* printf(" The longitude of the SQM on reading is: %s\n", argv[3]); */
-  sscanf(argv[3], "%lf", &SQM_Long);
-  printf(" The longitude of the SQM is: %lf\n", SQM_Long);
+  /* set up the degrees of freedom; we estimate two parameters, the linear
+   * regression slope and y-intercept */
+  DOF = N - 2;
 
-  /* printf(" The Half Range value on reading is: %d\n", argv[4]); */
-  sscanf(argv[4], "%d", &half_range);
-  printf(" The Half Range is: %d\n", half_range);
+  /* calculate means and the slope of the regression line, exactly as the
+   * direct calculation does */
+  mean_x = sum_x / N;
+  mean_y = sum_y / N;
+  mean_xy = sum_xy / N;
+  mean_x2 = sum_x2 / N;
+  slope = (mean_xy - (mean_x * mean_y)) / (mean_x2 - (mean_x * mean_x));
 
-  /* Open the input file */
+  /* centred moments and the closed form sum of squared residuals */
+  Sxx = sum_x2 - (sum_x * sum_x) / N;
+  Sxy = sum_xy - (sum_x * sum_y) / N;
+  Syy = sum_y2 - (sum_y * sum_y) / N;
+  SS = Syy - slope * Sxy;
 
-  /* printf("\n About to open the Input Data File");       */
+  /* stability guard - note that the comparisons are written so that a NaN
+   * also takes the direct route */
+  if (!(Sxx > 0.0) || !(SS > sum_y2 * 1.0e-12L)) {
+    SS = get_SS_direct(minutes_since_3pm, dMsas, first, last);
+  }
 
-  FILE *fdata = fopen(NameIn, "r");
-  if (fdata == NULL) {
-    printf("\n Failed to open the Data File \n");
-    return -1;
+  /* note that we use sqrtl here, which takes a long double argument */
+  RSE = (sqrtl(SS / DOF)) * RSE_mult;
+
+  /* fix up for any negative values because Expected is negative */
+  if (RSE < 0.0) {
+    RSE = RSE * -1.0;
   }
-  /* printf("\n Opened the Input Data File \n");       */
 
-  /* Open an output file to hold the output data */
-  /* tack on "SQM_attr" before the .csv */
+  /* fix up for any "not a number" for the case of divide by zero above */
+  if (isnan(RSE)) {
+    RSE = nodata2;
+  }
+  return RSE;
+}
 
-  strcpy(NameOut, NameIn);
-  strncat(NameOut, "_SQM_Attr3.csv", 15);
+/* Calculate the Residual Standard Error for every sample of one day/segment of
+ * count samples, over the windows above. Rather than re-tabulating the sums
+ * for every window, we keep running values of sum_x, sum_y, sum_xy, sum_x2
+ * and sum_y2 and update them as the window slides along, dropping the samples
+ * which leave it and adding those which join it, then get SS in closed form
+ * from the centred moments, N being the number of samples in the window:
+ *     Sxx = sum_x2 - sum_x**2/N,  Sxy = sum_xy - sum_x*sum_y/N,
+ *     Syy = sum_y2 - sum_y**2/N,  SS = Syy - slope*Sxy
+ * so each sample costs the same no matter how large the window is.
+ *
+ * Numerical stability: minutes_since_3pm values are integers and dMsas values
+ * are floats, so all the products are exact in long double and the running
+ * sums normally are too; even so, we re-tabulate the sums from scratch once
+ * N samples have been added so that rounding can never build up. The closed
+ * form subtracts two nearly equal numbers when the data sit almost exactly on
+ * the regression line, so when SS is not well above the rounding level of
+ * sum_y2 (or the fit is degenerate) we calculate SS for that window directly
+ * instead.
+ *
+ * Samples without a window get nodata1; a "not a number" RSE (divide by zero)
+ * gets nodata2 */
+void calc_rse_night(int count, const int *window_first, const int *window_last,
+                    const int *minutes_since_3pm, const float *dMsas,
+                    long double *RSE, long double RSE_mult,
+                    long double nodata1, long double nodata2) {
+  long double sum_x, sum_y, sum_xy, sum_x2, sum_y2, N, xx, yy;
+  int k, kk, first, last, added;
 
-  printf("\n The Output Data Filename is %s \n", NameOut);
+  sum_x = sum_y = sum_xy = sum_x2 = sum_y2 = 0.0;
 
-  FILE *fdataout = fopen(NameOut, "w");
-  if (fdataout == NULL) {
-    printf("\n Failed to open the Output Data File \n");
-    return -1;
-  }
+  /* the window the sums are over; none yet */
+  first = 0;
+  last = -1;
+  added = 0;
+  for (kk = 0; kk < count; kk++) {
+    if (window_first[kk] < 0) {
+      RSE[kk] = nodata1;
+      continue;
+    }
+    N = (long double)(window_last[kk] - window_first[kk] + 1);
 
-  /* printf("\n Opened the Output Data File \n");       */
+    if (last < first || window_first[kk] > last || added >= N) {
+      /* (re)tabulate the sums over the whole window */
+      sum_x = 0.0;
+      sum_y = 0.0;
+      sum_xy = 0.0;
+      sum_x2 = 0.0;
+      sum_y2 = 0.0;
+      for (k = window_first[kk]; k < window_last[kk] + 1; k++) {
+        xx = (long double)minutes_since_3pm[k];
+        yy = (long double)dMsas[k];
+        sum_x = sum_x + xx;
+        sum_y = sum_y + yy;
+        sum_xy = sum_xy + xx * yy;
+        sum_x2 = sum_x2 + xx * xx;
+        sum_y2 = sum_y2 + yy * yy;
+      }
+      added = 0;
+    } else {
+      /* slide the window along: drop the oldest samples and add the new
+       * ones */
+      for (k = first; k < window_first[kk]; k++) {
+        xx = (long double)minutes_since_3pm[k];
+        yy = (long double)dMsas[k];
+        sum_x = sum_x - xx;
+        sum_y = sum_y - yy;
+        sum_xy = sum_xy - xx * yy;
+        sum_x2 = sum_x2 - xx * xx;
+        sum_y2 = sum_y2 - yy * yy;
+      }
+      for (k = last + 1; k < window_last[kk] + 1; k++) {
+        xx = (long double)minutes_since_3pm[k];
+        yy = (long double)dMsas[k];
+        sum_x = sum_x + xx;
+        sum_y = sum_y + yy;
+        sum_xy = sum_xy + xx * yy;
+        sum_x2 = sum_x2 + xx * xx;
+        sum_y2 = sum_y2 + yy * yy;
+        added = added + 1;
+      }
+    }
+    first = window_first[kk];
+    last = window_last[kk];
+    RSE[kk] = rse_from_sums(sum_x, sum_y, sum_xy, sum_x2, sum_y2,
+                            minutes_since_3pm, dMsas, first, last, RSE_mult,
+                            nodata2);
 
-  /* half_range is the number of samples (usually 5 minutes apart) to include
-   * before and after the current point at which the Residual Standard Error of
-   * regression calculation is performed; the full width of the interval in
-   * terms of number of points to consider in the calculation is (2*half_range +
-   * 1) so that a half_range of 6 incorporates a total range of 60 minutes; note
-   * that we don't increment by one in the minutes calculation for the middle
-   * point in the time range because it is already taken into account half_range
-   * of 9 evaluates to a 90 minute range
-   */
-  N = (long double)((2 * half_range) + 1.);
+    log_trace("kk = %d  RSE=%Lf\n", kk, RSE[kk]);
+  }
+}
 
-  printf(" \n");
-  printf(" The half_range parameter is set to: %d\n", half_range);
-  printf(" This means that the Residual Error calculation operates over %d "
-         "samples\n",
-         (int)N);
-  printf(" In other words, if the sample spacing is 1 minute, then the range "
-         "is %d minutes.\n",
-         (int)half_range * 2 * 1);
-  printf("                 if the sample spacing is 5 minutes, then the range "
-         "is %d minutes.\n",
-         (int)half_range * 2 * 5);
-  printf(" Or              if the sample spacing is 15 minutes, then the range "
-         "is %d minutes.\n",
-         (int)half_range * 2 * 15);
-  printf(" \n");
-  printf(" \n");
-  printf(" Residual Standard Error values that we output are multiplied by %d "
-         "to achieve larger values.\n",
-         (int)RSE_mult);
-  printf(" \n");
-  printf(" We allow gaps of %d minutes between SQM samples prior to marking a "
-         "data gap.\n",
-         timediff_max);
-  printf(" \n");
+/* Multi-scale RSE (--scales 3,6,9). Tuning the clear sky threshold of a
+ * station means comparing its roughness over windows of several lengths, so
+ * rather than running the program once per half_range, every record gets an
+ * RSE column for each scale. The windows of every scale take their sums from
+ * one set of prefix sums of the day/segment, sums[k] being the sum over the
+ * samples before sample k, so a window costs two subtractions whatever its
+ * size and an extra scale costs next to nothing. The prefix sums of a long
+ * segment grow far larger than the sums of one window, and would lose the
+ * digits of the window to rounding, so each is kept as a pair of long
+ * doubles, hi and the rounding error of hi in lo (Knuth's TwoSum); the
+ * difference of two of them is then as good as the running sums of
+ * calc_rse_night */
+#define MAX_RSE_SCALES 8
 
-  /* Write a header record to the output file */
+struct prefix_sum {
+  long double hi, lo;
+};
 
-  fprintf(fdataout,
-          "Location,Lat,Long,UTC_Date,UTC_Time,Local_Date,Local_Time,Celsius,"
-          "Volts,Msas,Status,MoonPhase,MoonElev,MoonIllum,SunElev,"
-          "MinSince3pmStdTime,Msas_Avg,NightsSince_1118,RightAscensionHr,"
-          "Galactic_Lat,Galactic_Long,J2000days,ResidStdErr\n");
+/* *to = *from + value */
+void prefix_add(struct prefix_sum *to, const struct prefix_sum *from,
+                long double value) {
+  long double hi = from->hi + value, part = hi - from->hi;
 
-  /* set up some constant values used later to calculate the Galactic
-   * Coordinates of the normal at the SQM location */
-  /* These are from the Wikipedia Celestial coordinate system  */
-  pi = 3.14159265359;
+  to->lo = from->lo + ((from->hi - (hi - part)) + (value - part));
+  to->hi = hi;
+}
 
-  /* convert these constants from degrees to radians */
+/* the sum over the samples first..last */
+long double prefix_window(const struct prefix_sum *sums, int first, int last) {
+  return (sums[last + 1].hi - sums[first].hi) +
+         (sums[last + 1].lo - sums[first].lo);
+}
 
-  RightAscension_NGP = 192.85948 * (pi) / 180.;
-  printf("RightAscension_NGP=%lf \n", RightAscension_NGP);
+/* tabulate the prefix sums of x, y, xy, x2 and y2 of the count samples, one
+ * after the other in sums, which holds 5 * (count + 1) */
+void rse_prefix_sums(int count, const int *minutes_since_3pm,
+                     const float *dMsas, struct prefix_sum *sums) {
+  struct prefix_sum *x = sums, *y = x + count + 1, *xy = y + count + 1,
+                    *x2 = xy + count + 1, *y2 = x2 + count + 1;
+  long double xx, yy;
+  int k;
 
-  Dec_NGP = 27.12825 * (pi) / 180.;
-  printf("Dec_NGP=%lf \n", Dec_NGP);
+  memset(sums, 0, sizeof(struct prefix_sum) * 5 * (size_t)(count + 1));
+  for (k = 0; k < count; k++) {
+    xx = (long double)minutes_since_3pm[k];
+    yy = (long double)dMsas[k];
+    prefix_add(&x[k + 1], &x[k], xx);
+    prefix_add(&y[k + 1], &y[k], yy);
+    prefix_add(&xy[k + 1], &xy[k], xx * yy);
+    prefix_add(&x2[k + 1], &x2[k], xx * xx);
+    prefix_add(&y2[k + 1], &y2[k], yy * yy);
+  }
+}
 
-  Galactic_Long_NCP = 122.93192 * (pi) / 180.;
-  printf("Galactic_Long_NCP=%lf \n", Galactic_Long_NCP);
+/* the RSE of every sample over the windows window_first..window_last, as
+ * calc_rse_night gives it, from the prefix sums of rse_prefix_sums */
+void calc_rse_prefix(int count, const int *window_first,
+                     const int *window_last, const int *minutes_since_3pm,
+                     const float *dMsas, const struct prefix_sum *sums,
+                     long double *RSE, long double RSE_mult,
+                     long double nodata1, long double nodata2) {
+  const struct prefix_sum *x = sums, *y = x + count + 1, *xy = y + count + 1,
+                          *x2 = xy + count + 1, *y2 = x2 + count + 1;
+  int kk, first, last;
 
-  /* Read the data file */
-  /* Read the first header record and throw it away */
-  /* Note that the string read format statement, reads up to the first carriage
-   * return in the input file, then reads the carriage return itself */
+  for (kk = 0; kk < count; kk++) {
+    if (window_first[kk] < 0) {
+      RSE[kk] = nodata1;
+      continue;
+    }
+    first = window_first[kk];
+    last = window_last[kk];
+    RSE[kk] = rse_from_sums(
+        prefix_window(x, first, last), prefix_window(y, first, last),
+        prefix_window(xy, first, last), prefix_window(x2, first, last),
+        prefix_window(y2, first, last), minutes_since_3pm, dMsas, first, last,
+        RSE_mult, nodata2);
+  }
+}
 
-  fscanf(fdata, "%[^\n]\n", blank);
+/* read the comma separated scales of --scales into scales; returns how many
+ * there are, or -1 if they aren't all positive numbers or there are more than
+ * MAX_RSE_SCALES */
+int parse_scales(const char *text, int *scales) {
+  int count = 0, length;
 
-  /* initiate the record counter */
-  m = -1;
+  while (*text != '\0') {
+    if (count == MAX_RSE_SCALES ||
+        sscanf(text, "%d%n", &scales[count], &length) != 1 ||
+        scales[count] < 1 || (text[length] != ',' && text[length] != '\0')) {
+      return -1;
+    }
+    count = count + 1;
+    text = text + length + (text[length] == ',');
+  }
+  return count;
+}
 
-  /* initiate the flag on 15 hundred hour */
-  Start = 0;
+/* the scales as they are kept in a checkpoint: 3,6,9, or - for none */
+void scales_text(char *text, size_t size, int count, const int *scales) {
+  size_t length = 0;
+  int n;
 
-/* increment the counter */
-ReadAnother:
-  m = m + 1;
-  /* printf("m=%d \n", m); */
-  if (m > 1499) {
-
-    printf("We have more than 1500 samples for this day.\n");
-    printf("If this is good data, sorry but this option does not handle a data "
-           "cadence smaller than 1 minute. \n");
-    printf("Alternately, does the input file have bad data? \n");
-    printf("  Was the SQM battery dying and taking a sample too frequently or "
-           "off schedule?\n");
-    printf("  The input data are therefore suspect.\n");
-    printf("Premature end of processing! \n");
-    goto Termination;
+  snprintf(text, size, "-");
+  for (n = 0; n < count && length < size; n++) {
+    length = length + (size_t)snprintf(text + length, size - length, "%s%d",
+                                       n > 0 ? "," : "", scales[n]);
   }
+}
 
-  /* Note that the string read format statement listed first, reads up to the
-   * first comma in the input file */
-  ret = fscanf(
-      fdata,
-      "%[^,],%d,%d,%d,%d,%d,%f,%d,%d,%d,%d,%d,%f,%f,%f,%f,%d,%f,%f,%f,%f\n",
-      SQM_Location, &dUYear[m], &dUMonth[m], &dUDay[m], &dUHour[m],
-      &dUMinute[m], &dUSeconds[m], &dYear[m], &dMonth[m], &dDay[m], &dHour[m],
-      &dMinute[m], &dSeconds[m], &dCelsius[m], &dVolts[m], &dMsas[m],
-      &dStatus[m], &dMoonPhase[m], &dMoonElev[m], &dMoonIllum[m], &dSunElev[m]);
+/* the k-th smallest (counting from 0) of the n values at v, which are
+ * reordered (Hoare's selection, O(n) on average) */
+double select_kth(double *v, int n, int k) {
+  int left = 0, right = n - 1, i, j;
+  double pivot, swap;
 
-  /* if we reach the end of the input file, proceed to write out the data of the
-   * last day before terminating */
-  if (ret == EOF) {
-    goto LastDay;
+  while (left < right) {
+    pivot = v[left + (right - left) / 2];
+    i = left;
+    j = right;
+    while (i <= j) {
+      while (v[i] < pivot) {
+        i++;
+      }
+      while (v[j] > pivot) {
+        j--;
+      }
+      if (i <= j) {
+        swap = v[i];
+        v[i] = v[j];
+        v[j] = swap;
+        i++;
+        j--;
+      }
+    }
+    if (k <= j) {
+      right = j;
+    } else if (k >= i) {
+      left = i;
+    } else {
+      break;
+    }
   }
+  return v[k];
+}
 
-  printf("fscanf returned %d  m=%d \n", ret, m);
-  if (ret < 21) {
-    /* if here, the data record was short of values and therefore considered
-     * bad. Skip this point and read another; first decrement m */
-    m = m - 1;
-    goto ReadAnother;
+/* 1.4826 times the median absolute residual of the window of samples
+ * first..first+N-1 about the line intercept + slope * (x - x0), which is the
+ * standard deviation for Gaussian noise but is hardly moved by a few
+ * outliers; scratch needs room for N values */
+double mad_scale(const int *minutes_since_3pm, const float *dMsas, int first,
+                 int N, int x0, double intercept, double slope,
+                 double *scratch) {
+  int k;
+
+  for (k = 0; k < N; k++) {
+    scratch[k] = fabs(dMsas[first + k] - intercept -
+                      slope * (minutes_since_3pm[first + k] - x0));
   }
+  return 1.4826 * select_kth(scratch, N, N / 2);
+}
 
-  /* How long is the string in SQM_Location */
-  length = strlen(SQM_Location);
-  /* printf(" string -%s- length = %d\n", SQM_Location, length); */
+/* Robust Residual Standard Error (--robust). A satellite, aircraft or
+ * headlight spike inflates the least squares RSE of every window it falls in.
+ * Instead, each window is fitted by Huber's
+ * M-estimator, found by iteratively reweighted least squares: the samples
+ * within HUBER_K scale units of the line keep their full weight and those
+ * further off are weighted down in proportion, the scale being the MAD scale
+ * (see mad_scale) of the line we start from. The RSE is the MAD scale of the
+ * final line times RSE_mult, which for Gaussian noise estimates the same
+ * thing as the least squares RSE.
+ *
+ * Neighbouring windows share nearly all their samples, so the line fitted to
+ * one window is where the iterations start for the next (the first window of
+ * a segment, or after a sample without one, starts from least squares). That
+ * saves passes, not the refit: every window still takes its passes over all
+ * of its N samples (about 6 on average on 1-minute data, at most
+ * HUBER_PASSES) and two O(N) selections for the MAD scale, as the residuals
+ * are about a different line in each window and can't be kept in order as
+ * it slides. So unlike calc_rse_night the cost per sample grows with the
+ * window: --bench-rse measures it at about 10 times that of least squares
+ * for a half_range of 5, 17 times for 9 and 45 times for 30. The no-data
+ * rules are those of calc_rse_night; scratch needs room for the largest
+ * window */
+#define HUBER_K 1.345
+#define HUBER_SCALE_MIN 0.005 /* half the 0.01 magnitude steps of Msas */
+#define HUBER_PASSES 50
 
-  /*  Calculate the number of minutes since Local time 3PM for the time
-   * associated with this SQM record, */
-  /*  implement a bug fix to eliminate a problem with daylight savings time. Use
-   * the UTC time values and correct the UTC via the longitude of the sample.
-   * Previously the Local Time was used, which jumped an hour at the Daylight
-   * Savings Time change */
-  /*  This is the old code, commented out:
-          if(dHour[m] > 14){
-             minutes_since_3pm[m] = (dHour[m] -15) *60 + dMinute[m] +
-     (int)(dSeconds[m]/60.+0.5);
-          }
-          else
-          {
-             minutes_since_3pm[m] = 540 + dHour[m] *60 + dMinute[m] +
-     (int)(dSeconds[m]/60.+0.5);
-          }
+void calc_rse_night_robust(int count, const int *window_first,
+                           const int *window_last,
+                           const int *minutes_since_3pm, const float *dMsas,
+                           long double *RSE, long double RSE_mult,
+                           long double nodata1, long double nodata2,
+                           double *scratch) {
+  int N, first, last, k, kk, x0, pass, fitted = 0;
+  double intercept = 0.0, slope = 0.0, limit, xx, rr, weight, reach;
+  double sum_w, sum_wx, sum_wy, sum_wxx, sum_wxy, denominator;
+  double new_intercept, new_slope;
 
-  */
-  /* printf(" m=%d dHour=%d Minute=%d Seconds=%f minutes_since_3pm=%d \n", m,
+  for (kk = 0; kk < count; kk++) {
+    if (window_first[kk] < 0) {
+      RSE[kk] = nodata1;
+      fitted = 0;
+      continue;
+    }
+    first = window_first[kk];
+    last = window_last[kk];
+    N = last - first + 1;
+
+    /* the line is y = intercept + slope * (x - x0), x0 being the x of sample
+     * kk; move the last window's line to this window's centre */
+    x0 = minutes_since_3pm[kk];
+    if (fitted) {
+      intercept = intercept + slope * (x0 - minutes_since_3pm[kk - 1]);
+      limit = HUBER_K * fmax(mad_scale(minutes_since_3pm, dMsas, first, N, x0,
+                                       intercept, slope, scratch),
+                             HUBER_SCALE_MIN);
+    } else {
+      limit = HUGE_VAL;
+    }
+    reach = fmax(x0 - minutes_since_3pm[first], minutes_since_3pm[last] - x0);
+
+    denominator = 0.0;
+    for (pass = 0; pass < HUBER_PASSES; pass++) {
+      /* weighted least squares, with the weights of the current line */
+      sum_w = sum_wx = sum_wy = sum_wxx = sum_wxy = 0.0;
+      for (k = first; k < last + 1; k++) {
+        xx = minutes_since_3pm[k] - x0;
+        rr = fabs(dMsas[k] - (intercept + slope * xx));
+        weight = rr <= limit ? 1.0 : limit / rr;
+        sum_w = sum_w + weight;
+        sum_wx = sum_wx + weight * xx;
+        sum_wy = sum_wy + weight * dMsas[k];
+        sum_wxx = sum_wxx + weight * xx * xx;
+        sum_wxy = sum_wxy + weight * xx * dMsas[k];
+      }
+      denominator = sum_w * sum_wxx - sum_wx * sum_wx;
+      if (!(denominator > 0.0)) {
+        break;
+      }
+      new_slope = (sum_w * sum_wxy - sum_wx * sum_wy) / denominator;
+      new_intercept = (sum_wy - new_slope * sum_wx) / sum_w;
+
+      /* stop once the line moves by less than a ten thousandth of the Msas
+       * steps anywhere in the window */
+      rr = fabs(new_intercept - intercept) + fabs(new_slope - slope) * reach;
+      intercept = new_intercept;
+      slope = new_slope;
+      if (!fitted) {
+        /* the least squares line of the first window; now we have a scale */
+        fitted = 1;
+        limit = HUBER_K * fmax(mad_scale(minutes_since_3pm, dMsas, first, N,
+                                         x0, intercept, slope, scratch),
+                               HUBER_SCALE_MIN);
+      } else if (rr < 1.0e-6) {
+        break;
+      }
+    }
+    if (!(denominator > 0.0)) {
+      /* all the samples of the window at the same time, where least squares
+       * would divide by zero */
+      RSE[kk] = nodata2;
+      fitted = 0;
+      continue;
+    }
+
+    RSE[kk] = mad_scale(minutes_since_3pm, dMsas, first, N, x0, intercept,
+                        slope, scratch) *
+              RSE_mult;
+    log_trace("kk = %d  RSE=%Lf after %d passes\n", kk, RSE[kk], pass + 1);
+  }
+}
+
+/* The samples of one day/segment are held in a night buffer, one column
+ * (array) per attribute. All the columns are carved out of a single block of
+ * memory (the arena), which is allocated once and reused for every day of the
+ * file; it only grows, by doubling, when a day has more samples than it can
+ * hold, so there is no limit on the number of samples per day and no
+ * allocation at all once the buffer is big enough for the densest day */
+
+/* the columns of the night buffer: type and name */
+#define NIGHT_COLUMNS                                                          \
+  NIGHT_COLUMN(long double, RSE)                                               \
+  NIGHT_COLUMN(int, minutes_since_3pm)                                         \
+  NIGHT_COLUMN(int, dUYear)                                                    \
+  NIGHT_COLUMN(int, dUMonth)                                                   \
+  NIGHT_COLUMN(int, dUDay)                                                     \
+  NIGHT_COLUMN(int, dUHour)                                                    \
+  NIGHT_COLUMN(int, dUMinute)                                                  \
+  NIGHT_COLUMN(float, dUSeconds)                                               \
+  NIGHT_COLUMN(int, dYear)                                                     \
+  NIGHT_COLUMN(int, dMonth)                                                    \
+  NIGHT_COLUMN(int, dDay)                                                      \
+  NIGHT_COLUMN(int, dHour)                                                     \
+  NIGHT_COLUMN(int, dMinute)                                                   \
+  NIGHT_COLUMN(float, dSeconds)                                                \
+  NIGHT_COLUMN(float, dMsas)                                                   \
+  NIGHT_COLUMN(float, dMsas_Corr)                                              \
+  NIGHT_COLUMN(float, dVolts)                                                  \
+  NIGHT_COLUMN(float, dCelsius)                                                \
+  NIGHT_COLUMN(float, dMoonPhase)                                              \
+  NIGHT_COLUMN(float, dMoonElev)                                               \
+  NIGHT_COLUMN(float, dMoonIllum)                                              \
+  NIGHT_COLUMN(float, dSunElev)                                                \
+  NIGHT_COLUMN(float, msas_Avg)                                                \
+  NIGHT_COLUMN(double, right_ascension)                                        \
+  NIGHT_COLUMN(double, Galactic_Lat)                                           \
+  NIGHT_COLUMN(double, Galactic_Long)                                          \
+  NIGHT_COLUMN(double, J2000_days)                                             \
+  NIGHT_COLUMN(int, days)                                                      \
+  NIGHT_COLUMN(int, clear)                                                     \
+  NIGHT_COLUMN(float, msas_Avg_clear)                                          \
+  NIGHT_COLUMN(double, scratch)                                                \
+  NIGHT_COLUMN(int, window_first)                                              \
+  NIGHT_COLUMN(int, window_last)                                               \
+  NIGHT_COLUMN(int, standard_offset)                                           \
+  NIGHT_COLUMN(int, dStatus)
+
+/* each column starts on a 64 byte (cache line) boundary */
+#define NIGHT_ALIGN 64
+
+struct night_buffer {
+  int capacity; /* number of samples each column can hold */
+  char *arena;
+#define NIGHT_COLUMN(type, name) type *name;
+  NIGHT_COLUMNS
+#undef NIGHT_COLUMN
+};
+
+/* bytes needed by one column of capacity samples, rounded up to NIGHT_ALIGN */
+size_t night_column_size(size_t element_size, int capacity) {
+  return (element_size * (size_t)capacity + NIGHT_ALIGN - 1) /
+         NIGHT_ALIGN * NIGHT_ALIGN;
+}
+
+/* make sure that the night buffer can hold at least count samples, keeping
+ * the first keep samples of every column; returns 0 if we run out of memory,
+ * in which case the buffer is left as it was */
+int night_buffer_reserve(struct night_buffer *night, int count, int keep) {
+  int capacity;
+  size_t arena_size, offset;
+  char *arena;
+
+  if (count <= night->capacity) {
+    return 1;
+  }
+
+  /* grow geometrically so that a long file only reallocates a few times */
+  capacity = night->capacity > 0 ? night->capacity : 1500;
+  while (capacity < count) {
+    capacity = capacity * 2;
+  }
+
+  arena_size = 0;
+#define NIGHT_COLUMN(type, name)                                               \
+  arena_size = arena_size + night_column_size(sizeof(type), capacity);
+  NIGHT_COLUMNS
+#undef NIGHT_COLUMN
+
+  arena = aligned_alloc(NIGHT_ALIGN, arena_size);
+  if (arena == NULL) {
+    return 0;
+  }
+
+  /* carve the columns out of the new arena and copy over the samples we were
+   * asked to keep */
+  offset = 0;
+#define NIGHT_COLUMN(type, name)                                               \
+  if (keep > 0) {                                                              \
+    memcpy(arena + offset, night->name, sizeof(type) * (size_t)keep);          \
+  }                                                                            \
+  night->name = (type *)(arena + offset);                                      \
+  offset = offset + night_column_size(sizeof(type), capacity);
+  NIGHT_COLUMNS
+#undef NIGHT_COLUMN
+
+  free(night->arena);
+  night->arena = arena;
+  night->capacity = capacity;
+  return 1;
+}
+
+/* copy sample from into slot to of every column */
+void night_buffer_copy(struct night_buffer *night, int to, int from) {
+#define NIGHT_COLUMN(type, name) night->name[to] = night->name[from];
+  NIGHT_COLUMNS
+#undef NIGHT_COLUMN
+}
+
+void night_buffer_free(struct night_buffer *night) {
+  free(night->arena);
+  night->arena = NULL;
+  night->capacity = 0;
+}
+
+/* Positions of the Sun and the Moon. The raw .dat files do not have the
+ * MoonPhase, MoonElev, MoonIllum and SunElev columns that the "add moon and
+ * sun" option of UDM puts in the .csv files, so we calculate them ourselves
+ * with the low precision formulas of Meeus, "Astronomical Algorithms" (2nd
+ * ed.): chapter 25 for the Sun and the larger terms of chapter 47 for the
+ * Moon. Like UDM, the elevations are geocentric, without refraction or
+ * parallax. Over the sample file 20240306_131818__sun-moon-mw-clouds.csv the
+ * values agree with UDM to within 0.006 degrees for the Sun, 0.022 degrees for
+ * the Moon and 0.1 for the phase and illumination */
+
+/* periodic terms of the Moon's longitude and distance (Meeus table 47.A):
+ * multiples of D, M, M' and F, then the sine coefficient of the longitude in
+ * 0.000001 degrees and the cosine coefficient of the distance in meters */
+static const int moon_lr_terms[][6] = {
+    {0, 0, 1, 0, 6288774, -20905355}, {2, 0, -1, 0, 1274027, -3699111},
+    {2, 0, 0, 0, 658314, -2955968},   {0, 0, 2, 0, 213618, -569925},
+    {0, 1, 0, 0, -185116, 48888},     {0, 0, 0, 2, -114332, -3149},
+    {2, 0, -2, 0, 58793, 246158},     {2, -1, -1, 0, 57066, -152138},
+    {2, 0, 1, 0, 53322, -170733},     {2, -1, 0, 0, 45758, -204586},
+    {0, 1, -1, 0, -40923, -129620},   {1, 0, 0, 0, -34720, 108743},
+    {0, 1, 1, 0, -30383, 104755},     {2, 0, 0, -2, 15327, 10321},
+    {0, 0, 1, 2, -12528, 0},          {0, 0, 1, -2, 10980, 79661},
+    {4, 0, -1, 0, 10675, -34782},     {0, 0, 3, 0, 10034, -23210},
+    {4, 0, -2, 0, 8548, -21636},      {2, 1, -1, 0, -7888, 24208},
+    {2, 1, 0, 0, -6766, 30824},       {1, 0, -1, 0, -5163, -8379},
+    {1, 1, 0, 0, 4987, -16675},       {2, -1, 1, 0, 4036, -12831},
+    {2, 0, 2, 0, 3994, -10445},       {4, 0, 0, 0, 3861, -11650},
+    {2, 0, -3, 0, 3665, 14403},       {0, 1, -2, 0, -2689, -7003},
+    {2, 0, -1, 2, -2602, 0},          {2, -1, -2, 0, 2390, 10056},
+    {1, 0, 1, 0, -2348, 6322},        {2, -2, 0, 0, 2236, -9884}};
+
+/* periodic terms of the Moon's latitude (Meeus table 47.B): multiples of D,
+ * M, M' and F, then the sine coefficient in 0.000001 degrees */
+static const int moon_b_terms[][5] = {
+    {0, 0, 0, 1, 5128122}, {0, 0, 1, 1, 280602}, {0, 0, 1, -1, 277693},
+    {2, 0, 0, -1, 173237}, {2, 0, -1, 1, 55413}, {2, 0, -1, -1, 46271},
+    {2, 0, 0, 1, 32573},   {0, 0, 2, 1, 17198},  {2, 0, 1, -1, 9266},
+    {0, 0, 2, -1, 8822},   {2, -1, 0, -1, 8216}, {2, 0, -2, -1, 4324},
+    {2, 0, 1, 1, 4200},    {2, 1, 0, -1, -3359}};
+
+/* a fundamental argument of the ephemeris: its value in degrees at the first
+ * sample of the night and its rate in degrees per day */
+struct ephemeris_angle {
+  double at_start;
+  double rate;
+};
+
+/* set up an angle given by the polynomial c0 + c1*T + c2*T*T (degrees, T in
+ * Julian centuries) for a night starting T0 centuries after J2000 */
+struct ephemeris_angle ephemeris_angle(double c0, double c1, double c2,
+                                       double T0) {
+  struct ephemeris_angle angle;
+
+  angle.at_start = fmod(c0 + c1 * T0 + c2 * T0 * T0, 360.);
+  angle.rate = (c1 + 2. * c2 * T0) / 36525.;
+  return angle;
+}
+
+/* the angle in radians, days_since_start after the first sample */
+double ephemeris_radians(const struct ephemeris_angle *angle,
+                         double days_since_start) {
+  return fmod(angle->at_start + angle->rate * days_since_start, 360.) *
+         (3.14159265358979 / 180.);
+}
+
+/* multiply the unit vector (cosine, sine) of a sum of multiples of D, M, M'
+ * and F out of the tables of multiples of each argument; negative multiples
+ * are the complex conjugates */
+void ephemeris_multiple(double *c, double *s, const double (*table)[2],
+                        int multiple) {
+  double tc, ts, cc;
+
+  tc = table[abs(multiple)][0];
+  ts = multiple < 0 ? -table[-multiple][1] : table[multiple][1];
+  cc = *c * tc - *s * ts;
+  *s = *c * ts + *s * tc;
+  *c = cc;
+}
+
+/* fill table[0..count-1] with the cosine and sine of 0, x, 2x, ... */
+void ephemeris_harmonics(double (*table)[2], int count, double x) {
+  int k;
+
+  table[0][0] = 1.0;
+  table[0][1] = 0.0;
+  table[1][0] = cos(x);
+  table[1][1] = sin(x);
+  for (k = 2; k < count; k++) {
+    table[k][0] = table[k - 1][0] * table[1][0] - table[k - 1][1] * table[1][1];
+    table[k][1] = table[k - 1][1] * table[1][0] + table[k - 1][0] * table[1][1];
+  }
+}
+
+/* Calculate MoonPhase, MoonElev, MoonIllum and SunElev for samples
+ * 0..count-1 of the night. Everything that only changes slowly (the
+ * polynomial parts of the arguments, the eccentricities, the obliquity and
+ * the station's latitude) is worked out once for the night; each sample then
+ * only advances the arguments linearly from the first sample. The periodic
+ * terms of the Moon are built by multiplying out harmonics of the four
+ * arguments, so they need no trigonometric calls of their own.
+ * The phase is the Sun-Moon angle seen from the Moon in degrees, 0 at full
+ * moon, positive while waxing and negative while waning, and the
+ * illumination is the illuminated percentage of the disk */
+void calc_sun_moon_night(struct night_buffer *night, int count, double SQM_Lat,
+                         double SQM_Long) {
+  double n0, T0, E_power[3], ecc, eq_c1, eq_c2, eps;
+  double sin_lat, cos_lat, sun_cos_eps, sun_sin_eps, moon_cos_eps,
+      moon_sin_eps, d2r;
+  struct ephemeris_angle sun_L0, sun_M, omega, moon_Lp, moon_D, moon_M,
+      moon_Mp, moon_F, moon_A1, moon_A2, moon_A3, gmst;
+  int k, j;
+
+  if (count < 1) {
+    return;
+  }
+  d2r = 3.14159265358979 / 180.;
+
+  /* days since J2000.0 of the first sample of the night */
+  n0 = 367 * night->dUYear[0] -
+       (7 * (night->dUYear[0] + (night->dUMonth[0] + 9) / 12) / 4) +
+       (275 * night->dUMonth[0] / 9) + night->dUDay[0] - 730531.5 +
+       (night->dUHour[0] + night->dUMinute[0] / 60. +
+        night->dUSeconds[0] / 3600.) /
+           24.;
+  T0 = n0 / 36525.;
+
+  /* the Sun */
+  sun_L0 = ephemeris_angle(280.46646, 36000.76983, 0.0003032, T0);
+  sun_M = ephemeris_angle(357.52911, 35999.05029, -0.0001537, T0);
+  omega = ephemeris_angle(125.04, -1934.136, 0.0, T0);
+  ecc = 0.016708634 - 0.000042037 * T0;
+  eq_c1 = 1.914602 - 0.004817 * T0 - 0.000014 * T0 * T0;
+  eq_c2 = 0.019993 - 0.000101 * T0;
+
+  /* mean obliquity of the ecliptic, and the apparent obliquity used for the
+   * Sun */
+  eps = 23.439291 - 0.0130042 * T0;
+  moon_cos_eps = cos(eps * d2r);
+  moon_sin_eps = sin(eps * d2r);
+  eps = eps + 0.00256 * cos(omega.at_start * d2r);
+  sun_cos_eps = cos(eps * d2r);
+  sun_sin_eps = sin(eps * d2r);
+
+  /* the Moon */
+  moon_Lp = ephemeris_angle(218.3164477, 481267.88123421, 0.0, T0);
+  moon_D = ephemeris_angle(297.8501921, 445267.1114034, 0.0, T0);
+  moon_M = ephemeris_angle(357.5291092, 35999.0502909, 0.0, T0);
+  moon_Mp = ephemeris_angle(134.9633964, 477198.8675055, 0.0, T0);
+  moon_F = ephemeris_angle(93.2720950, 483202.0175233, 0.0, T0);
+  moon_A1 = ephemeris_angle(119.75, 131.849, 0.0, T0);
+  moon_A2 = ephemeris_angle(53.09, 479264.290, 0.0, T0);
+  moon_A3 = ephemeris_angle(313.45, 481266.484, 0.0, T0);
+  /* the terms with M are multiplied by E for each multiple of M */
+  E_power[0] = 1.0;
+  E_power[1] = 1.0 - 0.002516 * T0 - 0.0000074 * T0 * T0;
+  E_power[2] = E_power[1] * E_power[1];
+
+  /* Greenwich mean sidereal time; the station's longitude is added to it */
+  gmst.at_start = fmod(280.46061837 + 360.98564736629 * n0 +
+                           0.000387933 * T0 * T0 + SQM_Long,
+                       360.);
+  gmst.rate = 360.98564736629;
+
+  sin_lat = sin(SQM_Lat * d2r);
+  cos_lat = cos(SQM_Lat * d2r);
+
+  for (k = 0; k < count; k++) {
+    double days, M, C, sun_lambda, sun_dist;
+    double harm_sun[4][2], harm_D[5][2], harm_M[3][2], harm_Mp[4][2],
+        harm_F[3][2];
+    double sum_l, sum_r, sum_b, c, s, e, Lp, A1, F, Mp;
+    double moon_lambda, moon_beta, moon_dist, elong, cos_psi, sin_psi, i;
+    double theta, cos_theta, sin_theta, cos_l, sin_l, cos_b, sin_b;
+    double x, y, z;
+
+    /* days since the first sample of the night */
+    days = (night->dUDay[k] - night->dUDay[0]) +
+           ((night->dUHour[k] - night->dUHour[0]) +
+            (night->dUMinute[k] - night->dUMinute[0]) / 60. +
+            (night->dUSeconds[k] - night->dUSeconds[0]) / 3600.) /
+               24.;
+    if (night->dUMonth[k] != night->dUMonth[0] ||
+        night->dUYear[k] != night->dUYear[0]) {
+      days = 367 * night->dUYear[k] -
+             (7 * (night->dUYear[k] + (night->dUMonth[k] + 9) / 12) / 4) +
+             (275 * night->dUMonth[k] / 9) + night->dUDay[k] - 730531.5 +
+             (night->dUHour[k] + night->dUMinute[k] / 60. +
+              night->dUSeconds[k] / 3600.) /
+                 24. -
+             n0;
+    }
+
+    /* apparent longitude and distance (km) of the Sun */
+    M = ephemeris_radians(&sun_M, days);
+    ephemeris_harmonics(harm_sun, 4, M);
+    C = eq_c1 * harm_sun[1][1] + eq_c2 * harm_sun[2][1] +
+        0.000289 * harm_sun[3][1];
+    sun_lambda = (sun_L0.at_start + sun_L0.rate * days + C - 0.00569 -
+                  0.00478 * sin(ephemeris_radians(&omega, days))) *
+                 d2r;
+    sun_dist = 1.000001018 * (1. - ecc * ecc) / (1. + ecc * cos(M + C * d2r)) *
+               149597870.7;
+
+    /* longitude, latitude and distance (km) of the Moon */
+    ephemeris_harmonics(harm_D, 5, ephemeris_radians(&moon_D, days));
+    ephemeris_harmonics(harm_M, 3, ephemeris_radians(&moon_M, days));
+    Mp = ephemeris_radians(&moon_Mp, days);
+    ephemeris_harmonics(harm_Mp, 4, Mp);
+    F = ephemeris_radians(&moon_F, days);
+    ephemeris_harmonics(harm_F, 3, F);
+    Lp = ephemeris_radians(&moon_Lp, days);
+    A1 = ephemeris_radians(&moon_A1, days);
+
+    sum_l = 0.0;
+    sum_r = 0.0;
+    for (j = 0; j < (int)(sizeof(moon_lr_terms) / sizeof(moon_lr_terms[0]));
+         j++) {
+      c = harm_D[moon_lr_terms[j][0]][0];
+      s = harm_D[moon_lr_terms[j][0]][1];
+      ephemeris_multiple(&c, &s, harm_M, moon_lr_terms[j][1]);
+      ephemeris_multiple(&c, &s, harm_Mp, moon_lr_terms[j][2]);
+      ephemeris_multiple(&c, &s, harm_F, moon_lr_terms[j][3]);
+      e = E_power[abs(moon_lr_terms[j][1])];
+      sum_l = sum_l + e * moon_lr_terms[j][4] * s;
+      sum_r = sum_r + e * moon_lr_terms[j][5] * c;
+    }
+    sum_b = 0.0;
+    for (j = 0; j < (int)(sizeof(moon_b_terms) / sizeof(moon_b_terms[0]));
+         j++) {
+      c = harm_D[moon_b_terms[j][0]][0];
+      s = harm_D[moon_b_terms[j][0]][1];
+      ephemeris_multiple(&c, &s, harm_M, moon_b_terms[j][1]);
+      ephemeris_multiple(&c, &s, harm_Mp, moon_b_terms[j][2]);
+      ephemeris_multiple(&c, &s, harm_F, moon_b_terms[j][3]);
+      e = E_power[abs(moon_b_terms[j][1])];
+      sum_b = sum_b + e * moon_b_terms[j][4] * s;
+    }
+    /* the additive terms for the action of Venus and Jupiter and the
+     * flattening of the Earth */
+    sum_l = sum_l + 3958. * sin(A1) + 1962. * sin(Lp - F) +
+            318. * sin(ephemeris_radians(&moon_A2, days));
+    sum_b = sum_b - 2235. * sin(Lp) +
+            382. * sin(ephemeris_radians(&moon_A3, days)) +
+            175. * sin(A1 - F) + 175. * sin(A1 + F) + 127. * sin(Lp - Mp) -
+            115. * sin(Lp + Mp);
+    moon_lambda = Lp + sum_l / 1000000. * d2r;
+    moon_beta = sum_b / 1000000. * d2r;
+    moon_dist = 385000.56 + sum_r / 1000.;
+
+    /* phase angle and illuminated fraction */
+    elong = moon_lambda - sun_lambda;
+    cos_psi = cos(moon_beta) * cos(elong);
+    sin_psi = sqrt(1. - cos_psi * cos_psi);
+    i = atan2(sun_dist * sin_psi, moon_dist - sun_dist * cos_psi);
+    night->dMoonIllum[k] = (1. + cos(i)) / 2. * 100.;
+    night->dMoonPhase[k] = sin(elong) < 0.0 ? -i / d2r : i / d2r;
+
+    /* elevations, from the equatorial unit vectors and the local sidereal
+     * time */
+    theta = ephemeris_radians(&gmst, days);
+    cos_theta = cos(theta);
+    sin_theta = sin(theta);
+
+    cos_l = cos(sun_lambda);
+    sin_l = sin(sun_lambda);
+    x = cos_l;
+    y = sun_cos_eps * sin_l;
+    z = sun_sin_eps * sin_l;
+    night->dSunElev[k] =
+        asin(sin_lat * z + cos_lat * (cos_theta * x + sin_theta * y)) / d2r;
+
+    cos_l = cos(moon_lambda);
+    sin_l = sin(moon_lambda);
+    cos_b = cos(moon_beta);
+    sin_b = sin(moon_beta);
+    x = cos_b * cos_l;
+    y = moon_cos_eps * cos_b * sin_l - moon_sin_eps * sin_b;
+    z = moon_sin_eps * cos_b * sin_l + moon_cos_eps * sin_b;
+    night->dMoonElev[k] =
+        asin(sin_lat * z + cos_lat * (cos_theta * x + sin_theta * y)) / d2r;
+  }
+}
+
+/* Compressed files. An input or output file whose name ends in .gz or .zst
+ * is passed through gzip or zstd, which runs as a process of its own
+ * alongside this one, joined to it by a pipe - so the decompression of the
+ * input goes on while its records are parsed and worked on, and the
+ * compression of the output while the next night is, with no uncompressed
+ * copy of either on the disk. The pipe is made as big as the system allows,
+ * so that the decompressor can keep well ahead of the parsing. gzip
+ * compresses at its fastest level, as at its default one it can't keep up
+ * with the program */
+struct compression {
+  const char *suffix;
+  const char *decompress; /* the commands, from stdin to stdout */
+  const char *compress;
+};
+
+static const struct compression compressions[] = {
+    {".gz", "gzip -dc", "gzip -1c"},
+    {".zst", "zstd -dcq", "zstd -cq"},
+};
+
+/* the compression of the file name going by its suffix, or NULL if it is not
+ * compressed */
+const struct compression *file_compression(const char *name) {
+  size_t length = strlen(name), n;
+  int k;
+
+  for (k = 0; k < (int)(sizeof(compressions) / sizeof(compressions[0]));
+       k++) {
+    n = strlen(compressions[k].suffix);
+    if (length > n && strcmp(name + length - n, compressions[k].suffix) == 0) {
+      return &compressions[k];
+    }
+  }
+  return NULL;
+}
+
+/* start command reading the file name (mode "r") or writing it (mode "w"),
+ * with the other end of its pipe returned as a FILE to be closed with pclose;
+ * returns NULL if it could not be started */
+FILE *compression_open(const char *command, const char *name,
+                       const char *mode) {
+  char line[4096 + 64], *p = line, *end = line + sizeof(line) - 2;
+  FILE *file;
+  int n;
+
+  /* command < 'name' or command > 'name', with any ' in the name quoted for
+   * the shell as '\'' */
+  n = snprintf(line, sizeof(line), "%s %s '", command,
+               mode[0] == 'r' ? "<" : ">");
+  p = line + n;
+  for (; *name != '\0' && p + 4 < end; name++) {
+    if (*name == '\'') {
+      memcpy(p, "'\\''", 4);
+      p = p + 4;
+    } else {
+      *p++ = *name;
+    }
+  }
+  if (*name != '\0') {
+    return NULL;
+  }
+  *p++ = '\'';
+  *p = '\0';
+
+  /* a compressor which gives up (the disk is full) shows as a failed write,
+   * rather than killing the program */
+  if (mode[0] == 'w') {
+    signal(SIGPIPE, SIG_IGN);
+  }
+  /* "e": the pipe is not handed on to the compressors of other threads, or
+   * one would never see the end of its input */
+  file = popen(line, mode[0] == 'r' ? "re" : "we");
+#ifdef F_SETPIPE_SZ
+  if (file != NULL) {
+    fcntl(fileno(file), F_SETPIPE_SZ, 1 << 20);
+  }
+#endif
+  return file;
+}
+
+/* The input file is read through an sqm_reader, which hands back one line at
+ * a time as a pointer into its own memory - nothing is copied. A regular file
+ * is memory-mapped whole; anything that can't be mapped (a pipe, a terminal,
+ * a compressed file) is read with read() into a buffer which grows to hold
+ * the longest line */
+
+/* size of the read() buffer, and of each read() */
+#define READ_CHUNK (1 << 20)
+
+struct sqm_reader {
+  int fd;
+  int mapped;      /* 1 if data is the mmap of the whole file */
+  int at_eof;      /* read() has returned 0, or failed */
+  int failed;      /* read() failed, or the buffer couldn't grow */
+  char *data;      /* the mapped file or the read() buffer */
+  size_t size;     /* number of valid bytes in data */
+  size_t capacity; /* allocated size of the read() buffer */
+  size_t pos;      /* start of the next line in data */
+  long line;       /* line number of the line last returned */
+  long long total; /* bytes read so far, when not mapped */
+  FILE *pipe;      /* from the decompressor of a compressed file, or NULL */
+};
+
+/* open the named file, or stdin if name is "-", for reading, through its
+ * decompressor if it is compressed; returns 0 if it can't be opened */
+int reader_open(struct sqm_reader *reader, const char *name) {
+  const struct compression *compression;
+  struct stat st;
+  void *map;
+
+  memset(reader, 0, sizeof(*reader));
+  compression = strcmp(name, "-") != 0 ? file_compression(name) : NULL;
+  if (compression != NULL) {
+    if (access(name, R_OK) != 0) {
+      return 0;
+    }
+    reader->pipe = compression_open(compression->decompress, name, "r");
+    reader->fd = reader->pipe != NULL ? fileno(reader->pipe) : -1;
+  } else {
+    reader->fd =
+        strcmp(name, "-") == 0 ? dup(STDIN_FILENO) : open(name, O_RDONLY);
+  }
+  if (reader->fd < 0) {
+    return 0;
+  }
+
+  if (fstat(reader->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+    if (map != MAP_FAILED) {
+      madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+      reader->data = map;
+      reader->size = (size_t)st.st_size;
+      reader->mapped = 1;
+      reader->at_eof = 1;
+      return 1;
+    }
+  }
+
+  /* if here, fall back to read() */
+  reader->capacity = READ_CHUNK;
+  reader->data = malloc(reader->capacity);
+  if (reader->data == NULL) {
+    if (reader->pipe != NULL) {
+      pclose(reader->pipe);
+    } else {
+      close(reader->fd);
+    }
+    return 0;
+  }
+  return 1;
+}
+
+/* read() more data into the buffer, first moving the unread part of the buffer
+ * to the front; returns the number of bytes added (0 at end of file). A read
+ * error ends the input just as the end of the file does, so it is noted in
+ * failed for reader_close, or a file cut short would pass for a whole one */
+size_t reader_fill(struct sqm_reader *reader) {
+  ssize_t got;
+  char *grown;
+
+  if (reader->pos > 0) {
+    memmove(reader->data, reader->data + reader->pos,
+            reader->size - reader->pos);
+    reader->size = reader->size - reader->pos;
+    reader->pos = 0;
+  }
+  if (reader->capacity - reader->size < READ_CHUNK / 2) {
+    /* the buffer is mostly one incomplete line, so make it bigger */
+    grown = realloc(reader->data, reader->capacity * 2);
+    if (grown == NULL) {
+      reader->at_eof = 1;
+      reader->failed = 1;
+      return 0;
+    }
+    reader->data = grown;
+    reader->capacity = reader->capacity * 2;
+  }
+
+  do {
+    got = read(reader->fd, reader->data + reader->size,
+               reader->capacity - reader->size);
+  } while (got < 0 && errno == EINTR);
+  if (got <= 0) {
+    reader->at_eof = 1;
+    reader->failed = got < 0;
+    return 0;
+  }
+  reader->size = reader->size + (size_t)got;
+  reader->total = reader->total + got;
+  return (size_t)got;
+}
+
+/* return the next line of the input (without its line ending) and set *length
+ * to its length; returns NULL at the end of the file. The line stays valid
+ * until the next call */
+const char *reader_next_line(struct sqm_reader *reader, size_t *length) {
+  const char *line, *newline;
+  size_t scanned;
+
+  scanned = 0;
+  for (;;) {
+    line = reader->data + reader->pos;
+    newline =
+        memchr(line + scanned, '\n', reader->size - reader->pos - scanned);
+    if (newline != NULL) {
+      reader->pos = (size_t)(newline - reader->data) + 1;
+      break;
+    }
+    if (reader->at_eof) {
+      if (reader->pos == reader->size) {
+        return NULL;
+      }
+      /* the last line of the file has no line ending */
+      newline = reader->data + reader->size;
+      reader->pos = reader->size;
+      break;
+    }
+    /* no line ending yet; read some more, remembering how far we looked */
+    scanned = reader->size - reader->pos;
+    reader_fill(reader);
+  }
+
+  reader->line = reader->line + 1;
+  *length = (size_t)(newline - line);
+  if (*length > 0 && line[*length - 1] == '\r') {
+    *length = *length - 1;
+  }
+  return line;
+}
+
+/* close the reader; returns 0 if the input could not be read to its end, or
+ * the whole of a compressed file was read but its decompressor failed (the
+ * file is damaged or cut short) */
+int reader_close(struct sqm_reader *reader) {
+  int ok = !reader->failed;
+
+  if (reader->mapped) {
+    munmap(reader->data, reader->size);
+  } else {
+    free(reader->data);
+  }
+  if (reader->pipe != NULL) {
+    ok = (pclose(reader->pipe) == 0 || !reader->at_eof) && ok;
+  } else {
+    close(reader->fd);
+  }
+  reader->data = NULL;
+  return ok;
+}
+
+/* push the line last returned by reader_next_line back, so that the next call
+ * returns it again */
+void reader_push_back(struct sqm_reader *reader, const char *line) {
+  reader->pos = (size_t)(line - reader->data);
+  reader->line = reader->line - 1;
+}
+
+/* Field converters. Each one converts the text s..s+n of one field, ignoring
+ * blanks around the value, and returns 1 on success. Plain decimal numbers,
+ * which is all that the SQM files contain, are converted here; anything else
+ * (an exponent, "nan", ...) is handed to strtof so that we accept what fscanf
+ * used to accept */
+
+/* the powers of ten which are exact in a float */
+static const float float_pow10[] = {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f,
+                                    1e6f, 1e7f, 1e8f, 1e9f, 1e10f};
+
+void trim_blanks(const char **s, size_t *n) {
+  while (*n > 0 && (**s == ' ' || **s == '\t')) {
+    *s = *s + 1;
+    *n = *n - 1;
+  }
+  while (*n > 0 && ((*s)[*n - 1] == ' ' || (*s)[*n - 1] == '\t')) {
+    *n = *n - 1;
+  }
+}
+
+/* convert plain decimal text (sign, digits, point, digits) to a scaled
+ * integer, the value being +/- mantissa / 10**decimals; returns 0 if the text
+ * is not of that form or has more than 18 digits */
+int convert_decimal(const char *s, size_t n, unsigned long long *mantissa,
+                    int *decimals, int *negative) {
+  const char *end;
+  int digits = 0;
+
+  trim_blanks(&s, &n);
+  end = s + n;
+  *mantissa = 0;
+  *decimals = 0;
+  *negative = 0;
+  if (s < end && (*s == '-' || *s == '+')) {
+    *negative = *s == '-';
+    s++;
+  }
+  while (s < end && *s >= '0' && *s <= '9') {
+    *mantissa = *mantissa * 10 + (unsigned long long)(*s - '0');
+    digits++;
+    s++;
+  }
+  if (s < end && *s == '.') {
+    s++;
+    while (s < end && *s >= '0' && *s <= '9') {
+      *mantissa = *mantissa * 10 + (unsigned long long)(*s - '0');
+      digits++;
+      *decimals = *decimals + 1;
+      s++;
+    }
+  }
+  return digits > 0 && digits <= 18 && s == end;
+}
+
+/* convert a scaled decimal to the nearest float; when the mantissa and the
+ * power of ten are both exact in a float, one float division gives the
+ * correctly rounded value, the same as strtof */
+int decimal_to_float(unsigned long long mantissa, int decimals, int negative,
+                     float *value) {
+  if (mantissa > (1ULL << 24) || decimals > 10) {
+    return 0;
+  }
+  *value = (float)mantissa / float_pow10[decimals];
+  if (negative) {
+    *value = -*value;
+  }
+  return 1;
+}
+
+int convert_float(const char *s, size_t n, float *value) {
+  unsigned long long mantissa;
+  int decimals, negative;
+  char text[64];
+  char *stop;
+
+  if (convert_decimal(s, n, &mantissa, &decimals, &negative) &&
+      decimal_to_float(mantissa, decimals, negative, value)) {
+    return 1;
+  }
+
+  /* the slow path */
+  trim_blanks(&s, &n);
+  if (n == 0 || n >= sizeof(text)) {
+    return 0;
+  }
+  memcpy(text, s, n);
+  text[n] = '\0';
+  *value = strtof(text, &stop);
+  return stop == text + n;
+}
+
+/* the lat and long are read as doubles, which only happens once per file, so
+ * there is no fast path */
+int convert_double(const char *s, size_t n, double *value) {
+  char text[64];
+  char *stop;
+
+  trim_blanks(&s, &n);
+  if (n == 0 || n >= sizeof(text)) {
+    return 0;
+  }
+  memcpy(text, s, n);
+  text[n] = '\0';
+  *value = strtod(text, &stop);
+  return stop == text + n;
+}
+
+int convert_int(const char *s, size_t n, int *value) {
+  unsigned long long mantissa;
+  int decimals, negative;
+
+  if (!convert_decimal(s, n, &mantissa, &decimals, &negative) ||
+      decimals > 0 || mantissa > 2147483647ULL) {
+    return 0;
+  }
+  *value = negative ? -(int)mantissa : (int)mantissa;
+  return 1;
+}
+
+/* the numeric fields of a record of the edited UDM .csv file, in order, and
+ * the night buffer column each one goes into */
+struct csv_field {
+  int is_float;
+  size_t column; /* offset of the column pointer in struct night_buffer */
+};
+
+static const struct csv_field csv_fields[] = {
+    {0, offsetof(struct night_buffer, dUYear)},
+    {0, offsetof(struct night_buffer, dUMonth)},
+    {0, offsetof(struct night_buffer, dUDay)},
+    {0, offsetof(struct night_buffer, dUHour)},
+    {0, offsetof(struct night_buffer, dUMinute)},
+    {1, offsetof(struct night_buffer, dUSeconds)},
+    {0, offsetof(struct night_buffer, dYear)},
+    {0, offsetof(struct night_buffer, dMonth)},
+    {0, offsetof(struct night_buffer, dDay)},
+    {0, offsetof(struct night_buffer, dHour)},
+    {0, offsetof(struct night_buffer, dMinute)},
+    {1, offsetof(struct night_buffer, dSeconds)},
+    {1, offsetof(struct night_buffer, dCelsius)},
+    {1, offsetof(struct night_buffer, dVolts)},
+    {1, offsetof(struct night_buffer, dMsas)},
+    {0, offsetof(struct night_buffer, dStatus)},
+    {1, offsetof(struct night_buffer, dMoonPhase)},
+    {1, offsetof(struct night_buffer, dMoonElev)},
+    {1, offsetof(struct night_buffer, dMoonIllum)},
+    {1, offsetof(struct night_buffer, dSunElev)}};
+
+/* Parse one record of the edited UDM .csv file into sample m of the night
+ * buffer. The location label is not copied: *location is pointed at it in the
+ * line. Returns the number of fields successfully read, which is 21 for a good
+ * record */
+int parse_csv_record(const char *line, size_t length,
+                     struct night_buffer *night, int m, const char **location,
+                     size_t *location_length) {
+  const char *p = line, *end = line + length, *comma;
+  char *column;
+  int fields, ok;
+
+  /* the location label runs up to the first comma */
+  while (p < end && (*p == ' ' || *p == '\t')) {
+    p++;
+  }
+  comma = memchr(p, ',', (size_t)(end - p));
+  if (comma == NULL || comma == p) {
+    return 0;
+  }
+  *location = p;
+  *location_length = (size_t)(comma - p);
+  p = comma + 1;
+
+  for (fields = 0; fields < 20; fields++) {
+    if (p > end) {
+      break;
+    }
+    comma = memchr(p, ',', (size_t)(end - p));
+    if (comma == NULL) {
+      comma = end;
+    }
+    column = *(char **)((char *)night + csv_fields[fields].column);
+    if (csv_fields[fields].is_float) {
+      ok = convert_float(p, (size_t)(comma - p), (float *)column + m);
+    } else {
+      ok = convert_int(p, (size_t)(comma - p), (int *)column + m);
+    }
+    if (!ok) {
+      break;
+    }
+    p = comma + 1;
+  }
+  return fields + 1;
+}
+
+/* The raw files written by the Unihedron UDM software are in the "Light
+ * Pollution Monitoring Data Format 1.0": a header of lines beginning with "#",
+ * which gives among other things the location, position and cover offset of
+ * the SQM, followed by one record per line:
+ *   2023-07-05T12:30:39.000 2023-07-05T07:30:39.000  23.2 5.09 15.11 0
+ * that is UTC date & time, local date & time, temperature, voltage, MSAS and
+ * record type, separated by semicolons or (in newer UDM versions) blanks */
+
+#define DAT_SIGNATURE "# Light Pollution Monitoring Data Format"
+
+struct dat_header {
+  char location[256];    /* location name, blanks changed to underscores */
+  char timezone[64];     /* e.g. CST6CDT */
+  int has_position;      /* 1 if the position line was found */
+  double lat, lon, elev; /* degrees, degrees, metres */
+  int has_cover_offset;  /* 1 if the cover offset line was found */
+  char cover_offset[32];   /* the offset as text, e.g. -0.11 */
+  unsigned long long cover_offset_mantissa; /* and as a scaled decimal */
+  int cover_offset_decimals, cover_offset_negative;
+};
+
+/* copy the value of a header line into text, dropping surrounding blanks */
+void copy_header_value(char *text, size_t size, const char *s, size_t n) {
+  trim_blanks(&s, &n);
+  if (n > size - 1) {
+    n = size - 1;
+  }
+  memcpy(text, s, n);
+  text[n] = '\0';
+}
+
+/* Read the header of a .dat file, whose first line has already been read,
+ * up to and including the "# END OF HEADER" line */
+void read_dat_header(struct sqm_reader *reader, struct dat_header *header) {
+  const char *line, *value;
+  size_t length, n;
+  char text[256];
+  int i;
+
+  memset(header, 0, sizeof(*header));
+  while ((line = reader_next_line(reader, &length)) != NULL) {
+    if (length == 0 || line[0] != '#') {
+      /* no END OF HEADER line; this is the first record */
+      reader_push_back(reader, line);
+      return;
+    }
+    if (length >= 15 && memcmp(line, "# END OF HEADER", 15) == 0) {
+      return;
+    }
+    value = memchr(line, ':', length);
+    if (value == NULL) {
+      continue;
+    }
+    value = value + 1;
+    n = length - (size_t)(value - line);
+
+    if (length >= 16 && memcmp(line, "# Location name:", 16) == 0) {
+      copy_header_value(header->location, sizeof(header->location), value, n);
+      for (i = 0; header->location[i] != '\0'; i++) {
+        if (header->location[i] == ' ' || header->location[i] == ',') {
+          header->location[i] = '_';
+        }
+      }
+    } else if (length >= 10 && memcmp(line, "# Position", 10) == 0) {
+      copy_header_value(text, sizeof(text), value, n);
+      header->has_position = sscanf(text, "%lf , %lf , %lf", &header->lat,
+                                    &header->lon, &header->elev) >= 2;
+    } else if (length >= 17 && memcmp(line, "# Local timezone:", 17) == 0) {
+      copy_header_value(header->timezone, sizeof(header->timezone), value, n);
+    } else if (length >= 25 &&
+               memcmp(line, "# SQM cover offset value:", 25) == 0) {
+      copy_header_value(header->cover_offset, sizeof(header->cover_offset),
+                        value, n);
+      header->has_cover_offset = convert_decimal(
+          value, n, &header->cover_offset_mantissa,
+          &header->cover_offset_decimals, &header->cover_offset_negative);
+    }
+  }
+}
+
+/* split off the next field of a .dat record, which ends at a semicolon or a
+ * blank; returns 0 if there are no more fields */
+int next_dat_field(const char **p, const char *end, const char **field,
+                   size_t *n) {
+  const char *s = *p;
+
+  while (s < end && (*s == ' ' || *s == '\t')) {
+    s++;
+  }
+  if (s == end) {
+    return 0;
+  }
+  *field = s;
+  while (s < end && *s != ';' && *s != ' ' && *s != '\t') {
+    s++;
+  }
+  *n = (size_t)(s - *field);
+  while (s < end && (*s == ' ' || *s == '\t')) {
+    s++;
+  }
+  if (s < end && *s == ';') {
+    s++;
+  }
+  *p = s;
+  return 1;
+}
+
+/* convert a YYYY-MM-DDTHH:mm:ss.fff date & time */
+int convert_timestamp(const char *s, size_t n, int *year, int *month, int *day,
+                      int *hour, int *minute, float *seconds) {
+  if (n < 19 || s[4] != '-' || s[7] != '-' || s[10] != 'T' || s[13] != ':' ||
+      s[16] != ':') {
+    return 0;
+  }
+  return convert_int(s, 4, year) && convert_int(s + 5, 2, month) &&
+         convert_int(s + 8, 2, day) && convert_int(s + 11, 2, hour) &&
+         convert_int(s + 14, 2, minute) &&
+         convert_float(s + 17, n - 17, seconds);
+}
+
+/* Parse one record of a .dat file into sample m of the night buffer, taking
+ * the cover offset out of the MSAS value the way that the UDM "add moon and
+ * sun" export does (a file with a cover offset of -0.11 and an MSAS of 15.11
+ * gives 15.22). The subtraction is done on the decimal text, so the result is
+ * the same float as reading "15.22" from the .csv file. The .dat format has
+ * no sun and moon data; those columns are set to 0. Returns the number of
+ * fields successfully read, which is 6 for a good record */
+int parse_dat_record(const char *line, size_t length,
+                     struct night_buffer *night, int m,
+                     const struct dat_header *header) {
+  const char *p = line, *end = line + length, *field;
+  size_t n;
+  unsigned long long mantissa, offset;
+  long long msas;
+  int decimals, negative, ok, i;
+
+  if (!next_dat_field(&p, end, &field, &n) ||
+      !convert_timestamp(field, n, &night->dUYear[m], &night->dUMonth[m],
+                         &night->dUDay[m], &night->dUHour[m],
+                         &night->dUMinute[m], &night->dUSeconds[m])) {
+    return 0;
+  }
+  if (!next_dat_field(&p, end, &field, &n) ||
+      !convert_timestamp(field, n, &night->dYear[m], &night->dMonth[m],
+                         &night->dDay[m], &night->dHour[m],
+                         &night->dMinute[m], &night->dSeconds[m])) {
+    return 1;
+  }
+  if (!next_dat_field(&p, end, &field, &n) ||
+      !convert_float(field, n, &night->dCelsius[m])) {
+    return 2;
+  }
+  if (!next_dat_field(&p, end, &field, &n) ||
+      !convert_float(field, n, &night->dVolts[m])) {
+    return 3;
+  }
+  if (!next_dat_field(&p, end, &field, &n)) {
+    return 4;
+  }
+  if (header->has_cover_offset &&
+      convert_decimal(field, n, &mantissa, &decimals, &negative) &&
+      decimals <= 9 && header->cover_offset_decimals <= 9) {
+    /* bring the two values to the same number of decimals and subtract */
+    offset = header->cover_offset_mantissa;
+    for (i = decimals; i < header->cover_offset_decimals; i++) {
+      mantissa = mantissa * 10;
+    }
+    for (i = header->cover_offset_decimals; i < decimals; i++) {
+      offset = offset * 10;
+    }
+    if (decimals < header->cover_offset_decimals) {
+      decimals = header->cover_offset_decimals;
+    }
+    msas = (negative ? -(long long)mantissa : (long long)mantissa) -
+           (header->cover_offset_negative ? -(long long)offset
+                                          : (long long)offset);
+    ok = decimal_to_float((unsigned long long)(msas < 0 ? -msas : msas),
+                          decimals, msas < 0, &night->dMsas[m]);
+    if (!ok) {
+      night->dMsas[m] = (float)((double)msas / pow(10., decimals));
+      ok = 1;
+    }
+  } else {
+    ok = convert_float(field, n, &night->dMsas[m]);
+  }
+  if (!ok) {
+    return 4;
+  }
+  if (!next_dat_field(&p, end, &field, &n) ||
+      !convert_int(field, n, &night->dStatus[m])) {
+    return 5;
+  }
+
+  /* the sun and moon columns are filled in for the whole night by
+   * calc_sun_moon_night */
+  return 6;
+}
+
+/* The output of a night is built up as text in a text_buffer, which grows as
+ * needed and is reused from night to night */
+struct text_buffer {
+  char *text;
+  size_t length;   /* not counting the terminating '\0' */
+  size_t capacity; /* allocated size of text */
+};
+
+/* make sure that at least n more characters, and a terminating '\0', fit in
+ * the buffer; returns 0 if we run out of memory */
+int text_reserve(struct text_buffer *out, size_t n) {
+  size_t capacity;
+  char *grown;
+
+  if (out->text != NULL && out->capacity - out->length > n) {
+    return 1;
+  }
+  capacity = out->capacity > 0 ? out->capacity : 65536;
+  while (capacity - out->length <= n) {
+    capacity = capacity * 2;
+  }
+  grown = realloc(out->text, capacity);
+  if (grown == NULL) {
+    return 0;
+  }
+  out->text = grown;
+  out->capacity = capacity;
+  return 1;
+}
+
+/* append printf-style output to the buffer; returns 0 if we run out of
+ * memory */
+int text_printf(struct text_buffer *out, const char *format, ...) {
+  va_list args;
+  int n;
+
+  for (;;) {
+    va_start(args, format);
+    n = vsnprintf(out->text + out->length,
+                  out->text != NULL ? out->capacity - out->length : 0, format,
+                  args);
+    va_end(args);
+    if (n < 0) {
+      return 0;
+    }
+    if (out->text != NULL && (size_t)n < out->capacity - out->length) {
+      out->length = out->length + (size_t)n;
+      return 1;
+    }
+    if (!text_reserve(out, (size_t)n)) {
+      return 0;
+    }
+  }
+}
+
+void text_buffer_free(struct text_buffer *out) {
+  free(out->text);
+  out->text = NULL;
+  out->length = 0;
+  out->capacity = 0;
+}
+
+/* The output records are written by hand instead of by fprintf, which spends
+ * most of its time interpreting the format and converting floating point
+ * numbers in full generality. put_int and put_fixed write exactly what %0*d
+ * and %*.*f would: the number is scaled to an integer of the wanted decimals,
+ * rounded as printf rounds (to the nearest, halves to even, on the exact
+ * binary value - fma gives the rounding error of the scaling) and the digits
+ * are written out, with the sign of a negative number (or a negative zero)
+ * even if it rounds to zero. Numbers which are too large for this, or not
+ * numbers, are left to snprintf: put_fixed returns NULL for them, and NULL
+ * is passed along by the calls which follow so that a whole record can be
+ * checked once at the end */
+
+static const double power_of_ten[] = {1e0, 1e1, 1e2, 1e3, 1e4,
+                                      1e5, 1e6, 1e7, 1e8, 1e9};
+
+/* write value as printf("%0*d", width, value) does, followed by the
+ * character end (the ',' or '\n' after the field) */
+char *put_int(char *p, int value, int width, char end) {
+  char digits[16];
+  unsigned int u;
+  int n = 0;
+
+  if (p == NULL) {
+    return NULL;
+  }
+  u = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+  do {
+    digits[n++] = (char)('0' + u % 10);
+    u = u / 10;
+  } while (u > 0);
+  if (value < 0) {
+    *p++ = '-';
+    width = width - 1;
+  }
+  for (; width > n; width--) {
+    *p++ = '0';
+  }
+  while (n > 0) {
+    *p++ = digits[--n];
+  }
+  *p++ = end;
+  return p;
+}
+
+/* write the digits of the rounded, scaled value u with decimals digits after
+ * the decimal point, a '-' if negative, padded with spaces on the left to
+ * width, as printf("%*.*f") does */
+char *put_scaled(char *p, unsigned long long u, int negative, int decimals,
+                 int width, char end) {
+  char digits[32];
+  int n = 0, k;
+
+  for (k = 0; k < decimals; k++) {
+    digits[n++] = (char)('0' + u % 10);
+    u = u / 10;
+  }
+  if (decimals > 0) {
+    digits[n++] = '.';
+  }
+  do {
+    digits[n++] = (char)('0' + u % 10);
+    u = u / 10;
+  } while (u > 0);
+  if (negative) {
+    digits[n++] = '-';
+  }
+  for (; width > n; width--) {
+    *p++ = ' ';
+  }
+  while (n > 0) {
+    *p++ = digits[--n];
+  }
+  *p++ = end;
+  return p;
+}
+
+/* write value as printf("%*.*f", width, decimals, value) does, decimals at
+ * most 9, followed by end; returns NULL if value is not finite or 1e15 or
+ * more once scaled */
+char *put_fixed(char *p, double value, int decimals, int width, char end) {
+  double scale = power_of_ten[decimals], scaled, whole, error, excess;
+  unsigned long long u;
+  int negative;
+
+  if (p == NULL || !(fabs(value) * scale < 1e15)) {
+    return NULL;
+  }
+  negative = signbit(value) != 0;
+  value = fabs(value);
+
+  /* scaled + error is exactly value * scale, and scaled - whole is exact, so
+   * excess has the sign of (value * scale - whole - 0.5) */
+  scaled = value * scale;
+  error = fma(value, scale, -scaled);
+  whole = floor(scaled);
+  excess = (scaled - whole - 0.5) + error;
+  u = (unsigned long long)whole;
+  if (excess > 0.0 || (excess == 0.0 && (u & 1) != 0)) {
+    u = u + 1;
+  }
+  return put_scaled(p, u, negative, decimals, width, end);
+}
+
+/* put_fixed for a long double, as printf("%*.*Lf") */
+char *put_fixed_long(char *p, long double value, int decimals, int width,
+                     char end) {
+  long double scale = power_of_ten[decimals], scaled, whole, error, excess;
+  unsigned long long u;
+  int negative;
+
+  if (p == NULL || !(fabsl(value) * scale < 1e15L)) {
+    return NULL;
+  }
+  negative = signbit(value) != 0;
+  value = fabsl(value);
+
+  scaled = value * scale;
+  error = fmal(value, scale, -scaled);
+  whole = floorl(scaled);
+  excess = (scaled - whole - 0.5L) + error;
+  u = (unsigned long long)whole;
+  if (excess > 0.0L || (excess == 0.0L && (u & 1) != 0)) {
+    u = u + 1;
+  }
+  return put_scaled(p, u, negative, decimals, width, end);
+}
+
+/* the format of an output record, by which a record is written when
+ * put_record cannot write it */
+#define RECORD_FORMAT                                                          \
+  "%s,%12.7lf,%12.7lf,%04d-%02d-%02d,%02d:%02d:%02d,%04d-%02d-%02d,"           \
+  "%02d:%02d:%02d,%.1f,%.2f,%.2f,%1d,%.1f,%.3f,%.1f,%.3f,%04d,%f,%04d,"        \
+  "%12.7lf,%12.7lf,%10.5lf,%lf,%Lf\n"
+
+/* the columns added to an output record by the cloud classification, which
+ * take the place of its '\n' */
+#define CLEAR_FORMAT ",%d,%f\n"
+
+/* room for what put_record writes: 30 fields of at most 18 characters (a
+ * sign, 15 digits, the decimal point and the separator) and a '\0' */
+#define RECORD_MAX 640
+
+/* write the output record of sample k after its location, lat and long -
+ * exactly what RECORD_FORMAT (followed by CLEAR_FORMAT if classified) would
+ * give, with days the number of nights since Jan 1, 2018; returns NULL if one
+ * of the numbers is out of reach of put_fixed */
+char *put_record(char *p, const struct night_buffer *night, int k, int days,
+                 int classified) {
+  p = put_int(p, night->dUYear[k], 4, '-');
+  p = put_int(p, night->dUMonth[k], 2, '-');
+  p = put_int(p, night->dUDay[k], 2, ',');
+  p = put_int(p, night->dUHour[k], 2, ':');
+  p = put_int(p, night->dUMinute[k], 2, ':');
+  p = put_int(p, (int)night->dUSeconds[k], 2, ',');
+  p = put_int(p, night->dYear[k], 4, '-');
+  p = put_int(p, night->dMonth[k], 2, '-');
+  p = put_int(p, night->dDay[k], 2, ',');
+  p = put_int(p, night->dHour[k], 2, ':');
+  p = put_int(p, night->dMinute[k], 2, ':');
+  p = put_int(p, (int)night->dSeconds[k], 2, ',');
+  p = put_fixed(p, night->dCelsius[k], 1, 0, ',');
+  p = put_fixed(p, night->dVolts[k], 2, 0, ',');
+  p = put_fixed(p, night->dMsas[k], 2, 0, ',');
+  p = put_int(p, night->dStatus[k], 1, ',');
+  p = put_fixed(p, night->dMoonPhase[k], 1, 0, ',');
+  p = put_fixed(p, night->dMoonElev[k], 3, 0, ',');
+  p = put_fixed(p, night->dMoonIllum[k], 1, 0, ',');
+  p = put_fixed(p, night->dSunElev[k], 3, 0, ',');
+  p = put_int(p, night->minutes_since_3pm[k], 4, ',');
+  p = put_fixed(p, night->msas_Avg[k], 6, 0, ',');
+  p = put_int(p, days, 4, ',');
+  p = put_fixed(p, night->right_ascension[k], 7, 12, ',');
+  p = put_fixed(p, night->Galactic_Lat[k], 7, 12, ',');
+  p = put_fixed(p, night->Galactic_Long[k], 5, 10, ',');
+  p = put_fixed(p, night->J2000_days[k], 6, 0, ',');
+  p = put_fixed_long(p, night->RSE[k], 6, 0, classified ? ',' : '\n');
+  if (classified) {
+    p = put_int(p, night->clear[k], 1, ',');
+    p = put_fixed(p, night->msas_Avg_clear[k], 6, 0, '\n');
+  }
+  return p;
+}
+
+/* split line into at most size fields at the commas, returning how many */
+int split_fields(const char *line, size_t length, const char **fields,
+                 size_t *lengths, int size) {
+  const char *end = line + length, *comma;
+  int n = 0;
+
+  while (n < size) {
+    comma = memchr(line, ',', (size_t)(end - line));
+    fields[n] = line;
+    lengths[n] = (size_t)((comma != NULL ? comma : end) - line);
+    n = n + 1;
+    if (comma == NULL) {
+      break;
+    }
+    line = comma + 1;
+  }
+  return n;
+}
+
+/* FNV-1a hash of the length bytes at data */
+unsigned long long hash_bytes(const char *data, size_t length) {
+  unsigned long long hash = 14695981039346656037ULL;
+  size_t k;
+
+  for (k = 0; k < length; k++) {
+    hash = (hash ^ (unsigned char)data[k]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+/* The station registry (--registry stations.csv): what is known about each
+ * station that the data files don't say, or say wrongly - its position, the
+ * zero point offset of its SQM (in the sense of the SQM cover offset of a
+ * .dat header: it is taken out of Msas), and how much its readings drift per
+ * degree Celsius away from a reference temperature - each over the local
+ * dates from and to (inclusive, either may be left open), since a station is
+ * now and then moved or its SQM changed. A line of the file is
+ *   Location,Lat,Long,Offset,Temp_Coeff,Ref_Celsius,From,To
+ * e.g. The Freeman Center,29.92559,-97.99284,0.05,0.002,20,2023-07-05,
+ * where the lat and long, the temperature columns and the dates may be left
+ * empty; blank lines, lines starting with # and a first line giving the
+ * column names are skipped. Blanks and commas in a location become
+ * underscores, as in a .dat header. Each night of the output then gets
+ * Msas_Corr = Msas - Offset - Temp_Coeff * (Celsius - Ref_Celsius) from the
+ * entry in force on its first date; the entry is looked up once per night
+ * (see station_lookup), and where a night has none Msas_Corr is just Msas.
+ * Of several entries in force the last one wins */
+struct station_entry {
+  char location[256];
+  int has_position; /* the lat and long were given */
+  double lat, lon;
+  double offset;      /* magnitudes taken out of Msas */
+  double temp_coeff;  /* magnitudes per degree Celsius */
+  double ref_celsius; /* where the temperature correction is nil */
+  int from, to;       /* the dates in force, as days since 1970-01-01 */
+};
+
+struct station_registry {
+  struct station_entry *entries;
+  int count;
+  unsigned long long hash; /* of the lines of the file, for the checkpoint */
+};
+
+/* read a YYYY-MM-DD date into days since 1970-01-01, or empty into
+ * empty_days; returns 0 if it is neither */
+int convert_registry_date(const char *s, size_t n, int empty_days,
+                          int *days) {
+  int year, month, day;
+
+  if (n == 0) {
+    *days = empty_days;
+    return 1;
+  }
+  if (n != 10 || s[4] != '-' || s[7] != '-' || !convert_int(s, 4, &year) ||
+      !convert_int(s + 5, 2, &month) || !convert_int(s + 8, 2, &day) ||
+      month < 1 || month > 12 || day < 1 || day > 31) {
+    return 0;
+  }
+  *days = days_from_civil(year, month, day);
+  return 1;
+}
+
+/* read the station registry file name; returns 0 if it can't be read or has
+ * a line which isn't an entry */
+int station_registry_load(struct station_registry *registry,
+                          const char *name) {
+  struct sqm_reader reader;
+  struct station_entry entry, *grown;
+  const char *line, *field[9];
+  size_t length, field_length[9];
+  int capacity = 0, nfields, ok = 1, i;
+
+  memset(registry, 0, sizeof(*registry));
+  registry->hash = 14695981039346656037ULL;
+  if (!reader_open(&reader, name)) {
+    log_error(" Failed to open the station registry %s\n", name);
+    return 0;
+  }
+  while (ok && (line = reader_next_line(&reader, &length)) != NULL) {
+    registry->hash =
+        (registry->hash ^ hash_bytes(line, length)) * 1099511628211ULL;
+    trim_blanks(&line, &length);
+    if (length == 0 || line[0] == '#' ||
+        (reader.line == 1 && length >= 9 &&
+         memcmp(line, "Location,", 9) == 0)) {
+      continue;
+    }
+
+    nfields = split_fields(line, length, field, field_length, 9);
+    for (i = 0; i < nfields; i++) {
+      trim_blanks(&field[i], &field_length[i]);
+    }
+    memset(&entry, 0, sizeof(entry));
+    entry.has_position = nfields == 8 && field_length[1] > 0;
+    ok = nfields == 8 && field_length[0] > 0 &&
+         (field_length[1] > 0) == (field_length[2] > 0) &&
+         (!entry.has_position ||
+          (convert_double(field[1], field_length[1], &entry.lat) &&
+           convert_double(field[2], field_length[2], &entry.lon))) &&
+         convert_double(field[3], field_length[3], &entry.offset) &&
+         (field_length[4] == 0 ||
+          convert_double(field[4], field_length[4], &entry.temp_coeff)) &&
+         (field_length[5] == 0 ||
+          convert_double(field[5], field_length[5], &entry.ref_celsius)) &&
+         convert_registry_date(field[6], field_length[6], INT_MIN,
+                               &entry.from) &&
+         convert_registry_date(field[7], field_length[7], INT_MAX, &entry.to);
+    if (!ok) {
+      log_error(" Line %ld of the station registry %s should be "
+                "Location,Lat,Long,Offset,Temp_Coeff,Ref_Celsius,From,To\n",
+                reader.line, name);
+      break;
+    }
+    copy_header_value(entry.location, sizeof(entry.location), field[0],
+                      field_length[0]);
+    for (i = 0; entry.location[i] != '\0'; i++) {
+      if (entry.location[i] == ' ' || entry.location[i] == ',') {
+        entry.location[i] = '_';
+      }
+    }
+
+    if (registry->count == capacity) {
+      capacity = capacity > 0 ? capacity * 2 : 16;
+      grown = realloc(registry->entries,
+                      sizeof(struct station_entry) * (size_t)capacity);
+      if (grown == NULL) {
+        log_error(" Ran out of memory reading the station registry %s\n",
+                  name);
+        ok = 0;
+        break;
+      }
+      registry->entries = grown;
+    }
+    registry->entries[registry->count] = entry;
+    registry->count = registry->count + 1;
+  }
+  if (!reader_close(&reader) && ok) {
+    log_error(" Failed to read the station registry %s\n", name);
+    ok = 0;
+  }
+  if (!ok) {
+    free(registry->entries);
+    registry->entries = NULL;
+    registry->count = 0;
+  }
+  return ok;
+}
+
+/* the entry of the registry for location in force on days (since
+ * 1970-01-01), or NULL if there is none */
+const struct station_entry *station_lookup(
+    const struct station_registry *registry, const char *location, int days) {
+  const struct station_entry *found = NULL;
+  int n;
+
+  for (n = 0; n < registry->count; n++) {
+    if (registry->entries[n].from <= days && days <= registry->entries[n].to &&
+        strcmp(registry->entries[n].location, location) == 0) {
+      found = &registry->entries[n];
+    }
+  }
+  return found;
+}
+
+/* the last entry of the registry for location which gives a position, or
+ * NULL if there is none */
+const struct station_entry *station_position(
+    const struct station_registry *registry, const char *location) {
+  const struct station_entry *found = NULL;
+  int n;
+
+  for (n = 0; n < registry->count; n++) {
+    if (registry->entries[n].has_position &&
+        strcmp(registry->entries[n].location, location) == 0) {
+      found = &registry->entries[n];
+    }
+  }
+  return found;
+}
+
+/* fill in the Msas_Corr column of the count samples of a night with the
+ * corrections of entry, or with Msas if entry is NULL */
+void correct_night(struct night_buffer *night, int count,
+                   const struct station_entry *entry) {
+  int k;
+
+  for (k = 0; k < count; k++) {
+    night->dMsas_Corr[k] = night->dMsas[k];
+    if (entry != NULL) {
+      night->dMsas_Corr[k] =
+          (float)(night->dMsas[k] - entry->offset -
+                  entry->temp_coeff *
+                      (night->dCelsius[k] - entry->ref_celsius));
+    }
+  }
+}
+
+/* Stage timing (--bench and --report). The time taken by a file is shared
+ * out between the stages it goes through - reading and converting the records
+ * (parse), finding the gaps and the days/segments (segment), the Msas_Avg
+ * loop (average), the RSE and classification (rse), the ephemeris and
+ * Galactic Coordinates (coords) and formatting and writing the output
+ * (write) - by marking the monotonic clock at the end of each stage, which
+ * charges the time since the last mark to it. Without a timer a mark costs a
+ * comparison. On several threads (--threads) the parsing and the finding of
+ * the days/segments are timed as a whole, and the other stages are added up
+ * over the threads, so they can come to more than the time the file took */
+enum stages {
+  STAGE_PARSE,
+  STAGE_SEGMENT,
+  STAGE_AVERAGE,
+  STAGE_RSE,
+  STAGE_COORDS,
+  STAGE_WRITE,
+  STAGE_COUNT
+};
+
+static const char *const stage_names[STAGE_COUNT] = {
+    "parse", "segment", "average", "rse", "coords", "write"};
+
+struct stage_timer {
+  struct timespec last; /* the last mark */
+  double seconds[STAGE_COUNT];
+};
+
+/* the seconds of the monotonic clock since started */
+double seconds_since(const struct timespec *started) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - started->tv_sec) +
+         (now.tv_nsec - started->tv_nsec) / 1.0e9;
+}
+
+/* start timing from now, leaving out the time since the last mark */
+void stage_start(struct stage_timer *timer) {
+  if (timer != NULL) {
+    clock_gettime(CLOCK_MONOTONIC, &timer->last);
+  }
+}
+
+/* add the seconds of timer to those of total */
+void stage_add(struct stage_timer *total, const struct stage_timer *timer) {
+  int k;
+
+  for (k = 0; k < STAGE_COUNT; k++) {
+    total->seconds[k] = total->seconds[k] + timer->seconds[k];
+  }
+}
+
+void stage_mark(struct stage_timer *timer, int stage) {
+  struct timespec now;
+
+  if (timer == NULL) {
+    return;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  timer->seconds[stage] = timer->seconds[stage] +
+                          (now.tv_sec - timer->last.tv_sec) +
+                          (now.tv_nsec - timer->last.tv_nsec) / 1.0e9;
+  timer->last = now;
+}
+
+/* what process_night needs to know about the file being processed */
+struct night_settings {
+  const char *SQM_Location;
+  double SQM_Lat, SQM_Long;
+  int half_range;
+  int is_dat; /* the sun and moon columns have to be calculated */
+  long double RSE_mult, nodata1, nodata2;
+  /* constants for the Galactic Coordinates, in radians */
+  double pi, RightAscension_NGP, Dec_NGP, Galactic_Long_NCP;
+  /* the clear/cloudy classification (see classify_night) */
+  int classify;
+  long double clear_RSE_max;
+  int clear_run;
+  int robust; /* the RSE is a robust one (see calc_rse_night_robust) */
+  /* with --window, the RSE windows are of window_minutes either side of each
+   * sample, with at least window_samples samples (see time_windows) */
+  int window_minutes, window_samples;
+  /* with --scales, the half_ranges (or with --window the minutes) of the
+   * extra RSE columns (see calc_rse_prefix) */
+  int scale_count, scales[MAX_RSE_SCALES];
+  int hour_delta; /* standard_hour_delta(SQM_Long) */
+  const struct time_zone *tz; /* NULL to go by hour_delta (see --tz) */
+  struct stage_timer *timer;  /* NULL unless timing the stages */
+  /* with --registry, the corrections of the stations (see
+   * struct station_registry), otherwise NULL */
+  const struct station_registry *registry;
+};
+
+/* the number of hours from UTC to local standard time, as the longitude of
+ * the SQM gives it; it is the same for every sample of a file, so it is
+ * worked out once, for calc_minutes_since_3pm and process_night */
+int standard_hour_delta(double SQM_Long) {
+  int dPosNeg;
+
+  dPosNeg = 1;
+  if (SQM_Long < 0.0) {
+    dPosNeg = -1;
+  }
+
+  /* assignment to an integer will cause truncation of the remainder in the
+   * following statement, as desired */
+  return abs(SQM_Long) / 15. * dPosNeg;
+}
+
+/* the UTC time of sample k in seconds since Jan 1, 1970 */
+long long sample_utc_seconds(const struct night_buffer *night, int k) {
+  return (long long)days_from_civil(night->dUYear[k], night->dUMonth[k],
+                                    night->dUDay[k]) *
+             86400 +
+         night->dUHour[k] * 3600 + night->dUMinute[k] * 60 +
+         (int)night->dUSeconds[k];
+}
+
+/* the local time of sample k, as so many seconds since Jan 1, 1970 */
+long long sample_local_seconds(const struct night_buffer *night, int k) {
+  return (long long)days_from_civil(night->dYear[k], night->dMonth[k],
+                                    night->dDay[k]) *
+             86400 +
+         night->dHour[k] * 3600 + night->dMinute[k] * 60 +
+         (int)night->dSeconds[k];
+}
+
+/* Calculate the number of minutes since Local time 3PM for sample m, given
+ * the standard_hour_delta of the SQM, or its time zone tz unless that is NULL,
+ * in which case the standard UTC offset of the sample is kept for
+ * process_night and *cursor is the time zone entry of the sample before */
+void calc_minutes_since_3pm(struct night_buffer *night, int m, int dHour_Delta,
+                            const struct time_zone *tz, int *cursor) {
+  /* added to handle the daylight savings time fix to "minutes since 3pm" */
+  int dShift_Hour, minutes;
+
+  /* with a time zone, local standard time is UTC plus its standard offset */
+  if (tz != NULL) {
+    night->standard_offset[m] =
+        tz->standard[time_zone_find(tz, sample_utc_seconds(night, m), cursor)];
+    minutes = night->dUHour[m] * 60 + night->dUMinute[m] +
+              night->standard_offset[m] / 60;
+    night->minutes_since_3pm[m] = ((minutes - 900) % 1440 + 1440) % 1440 +
+                                  (int)(night->dUSeconds[m] / 60. + 0.5);
+    return;
+  }
+
+  /*  implement a bug fix to eliminate a problem with daylight savings time. Use
+   * the UTC time values and correct the UTC via the longitude of the sample.
+   * Previously the Local Time was used, which jumped an hour at the Daylight
+   * Savings Time change */
+  /*  This is the old code, commented out:
+          if(dHour[m] > 14){
+             minutes_since_3pm[m] = (dHour[m] -15) *60 + dMinute[m] +
+     (int)(dSeconds[m]/60.+0.5);
+          }
+          else
+          {
+             minutes_since_3pm[m] = 540 + dHour[m] *60 + dMinute[m] +
+     (int)(dSeconds[m]/60.+0.5);
+          }
+
+  */
+  /* printf(" m=%d dHour=%d Minute=%d Seconds=%f minutes_since_3pm=%d \n", m,
    * dHour[m], dMinute[m], dSeconds[m], minutes_since_3pm[m]);*/
 
-  /* new code follows */
-  dPosNeg = 1;
-  if (SQM_Long < 0.0) {
-    dPosNeg = -1;
+  /* new code follows */
+  dShift_Hour = night->dUHour[m] + dHour_Delta;
+
+  log_trace(" dHour_Delta= %d\n", dHour_Delta);
+  log_trace(" dShift_Hour= %d\n", dShift_Hour);
+
+  if (dShift_Hour > 14) {
+    night->minutes_since_3pm[m] =
+        (dShift_Hour - 15) * 60 + night->dUMinute[m] +
+        (int)(night->dUSeconds[m] / 60. + 0.5);
+  } else {
+    night->minutes_since_3pm[m] =
+        540 + dShift_Hour * 60 + night->dUMinute[m] +
+        (int)(night->dUSeconds[m] / 60. + 0.5);
+  }
+}
+
+/* the number of minutes between sample m and the sample before it, which is
+ * compared with timediff_max to find the gaps in the data */
+int time_gap(const struct night_buffer *night, int m) {
+  int timediff, num_minutesA, num_minutesB;
+
+  /* calculate the number of minutes associated with the current data point
+   * time, and compare with the previous point */
+  /* handle the special case of crossing the midnight boundary */
+  if (night->dDay[m] == night->dDay[m - 1]) {
+
+    /* if here, this new point is on the same day */
+    num_minutesA = (int)(night->dHour[m] * 60. + night->dMinute[m]);
+  } else {
+
+    /* if here, we have crossed the midnight boundary */
+    num_minutesA = (int)(24. * 60. + night->dMinute[m]);
+  }
+
+  num_minutesB = (int)(night->dHour[m - 1] * 60. + night->dMinute[m - 1]);
+  timediff = num_minutesA - num_minutesB;
+  /* make sure timediff is positive */
+  if (timediff < 0) {
+    timediff = timediff * -1;
+  }
+
+  return timediff;
+}
+
+/* Calculate the Right Ascension of the SQM normal, the Galactic Coordinates
+ * it points to and the J2000 day for samples 0..count-1 of a night, a column
+ * at a time. The first loop does the work of get_J2000 and
+ * get_right_ascension, which is plain arithmetic that the compiler can
+ * vectorize; the second does the trigonometry, with everything that only
+ * depends on the latitude of the SQM worked out once for the night. The
+ * expressions are those of the original per-record code, evaluated in the
+ * same order, so the results are identical to it */
+void calc_coordinates_night(struct night_buffer *night, int count,
+                            const struct night_settings *settings) {
+  double pi = settings->pi, RightAscension_NGP = settings->RightAscension_NGP,
+         Galactic_Long_NCP = settings->Galactic_Long_NCP;
+  double SQM_Long = settings->SQM_Long;
+  double SQM_Dec, cos_Dec, sin_Dec_sin_NGP, cos_Dec_cos_NGP, sin_Dec_cos_NGP,
+      cos_Dec_sin_NGP;
+  int k;
+
+  for (k = 0; k < count; k++) {
+    int year = night->dUYear[k], UTC_Month = night->dUMonth[k];
+    int UTC_Hour = night->dUHour[k], UTC_Min = night->dUMinute[k];
+    int UTC_Sec = (int)night->dUSeconds[k];
+    double dwhole, dfrac, UT, right_ascension;
+    int multiples;
+
+    /* the J2000 day value */
+    dwhole = 367 * year - (7 * (year + (UTC_Month + 9) / 12) / 4) +
+             (275 * UTC_Month / 9) + night->dUDay[k] - 730531.5;
+    dfrac = ((double)UTC_Hour + ((double)UTC_Min) / 60. +
+             ((double)UTC_Sec) / 3600.) /
+            24.;
+    night->J2000_days[k] = dwhole + dfrac;
+
+    /* the Universal time, and the right ascension in the range of 0 to 360
+     * degrees; subtracting no multiples of 360 leaves it unchanged */
+    UT = UTC_Hour + (float)UTC_Min / 60. + (float)UTC_Sec / 3600.;
+    right_ascension =
+        100.46 + 0.985647 * night->J2000_days[k] + SQM_Long + 15. * UT;
+    multiples = right_ascension / 360.;
+    right_ascension = right_ascension - (float)multiples * 360.;
+    if (right_ascension < 0) {
+      right_ascension = right_ascension + 360.;
+    }
+
+    /* convert right_ascension from degrees to hours */
+    night->right_ascension[k] = right_ascension / 15.;
+  }
+
+  /* the Declination of the SQM is its Latitude, convert it from decimal
+   * degrees to radians */
+  SQM_Dec = settings->SQM_Lat * (pi / 180.);
+  cos_Dec = cos(SQM_Dec);
+  sin_Dec_sin_NGP = sin(SQM_Dec) * sin(settings->Dec_NGP);
+  cos_Dec_cos_NGP = cos(SQM_Dec) * cos(settings->Dec_NGP);
+  sin_Dec_cos_NGP = sin(SQM_Dec) * cos(settings->Dec_NGP);
+  cos_Dec_sin_NGP = cos(SQM_Dec) * sin(settings->Dec_NGP);
+
+  for (k = 0; k < count; k++) {
+    double SQM_RA, cos_RA, Galactic_Lat, Galactic_Long, XX, YY;
+
+    /* convert right_ascension (SQM_RA) from hours to radians */
+    SQM_RA = (night->right_ascension[k] * 15.) * (pi / 180.);
+
+    /* the following Equations are from Wikipedia on Celestial Coordinate
+     * Systems */
+    cos_RA = cos(SQM_RA - RightAscension_NGP);
+    Galactic_Lat = asin(sin_Dec_sin_NGP + cos_Dec_cos_NGP * cos_RA);
+    YY = cos_Dec * sin(SQM_RA - RightAscension_NGP);
+    XX = sin_Dec_cos_NGP - cos_Dec_sin_NGP * cos_RA;
+    Galactic_Long = Galactic_Long_NCP - atan2(YY, XX);
+
+    /* convert Galactic_Lat and Galactic_Long from radians to degrees */
+    Galactic_Lat = Galactic_Lat * (180. / pi);
+    Galactic_Long = Galactic_Long * (180. / pi);
+
+    /* Make sure that Galactic_Long is a positive number */
+    if (Galactic_Long < 0.0) {
+      Galactic_Long = 360. + Galactic_Long;
+    }
+    night->Galactic_Lat[k] = Galactic_Lat;
+    night->Galactic_Long[k] = Galactic_Long;
+  }
+}
+
+/* what became of a day/segment, for its summary line */
+struct night_summary {
+  int count;            /* number of samples */
+  int dark_count;       /* samples dark enough to go into Msas_Avg */
+  float msas_Avg;       /* -1 if there were none */
+  int rse_count;        /* samples with an RSE value */
+  int nodata1_count;    /* samples without a window (RSE nodata1) */
+  int nodata2_count;    /* samples whose RSE is not a number (nodata2) */
+  int gap;              /* the gap in minutes which ended the segment, or 0 */
+  int clear_count;      /* dark samples classified clear, -1 if not asked */
+  float msas_Avg_clear; /* their average Msas, -1 if there were none */
+};
+
+/* log the summary line of the day/segment whose samples start at night */
+void log_night_summary(const struct night_buffer *night,
+                       const struct night_summary *summary,
+                       const char *NameIn) {
+  int last = summary->count - 1;
+
+  log_info("Night of %04d-%02d-%02d in %s: %d samples from %02d:%02d:%02d to "
+           "%04d-%02d-%02d %02d:%02d:%02d, Msas_Avg %.2f from %d dark "
+           "samples, %d RSE values",
+           night->dYear[0], night->dMonth[0], night->dDay[0], NameIn,
+           summary->count, night->dHour[0], night->dMinute[0],
+           (int)night->dSeconds[0], night->dYear[last], night->dMonth[last],
+           night->dDay[last], night->dHour[last], night->dMinute[last],
+           (int)night->dSeconds[last], summary->msas_Avg, summary->dark_count,
+           summary->rse_count);
+  if (summary->clear_count >= 0) {
+    log_info(", %d dark samples clear (%.0f%%) with Msas_Avg %.2f",
+             summary->clear_count,
+             summary->dark_count > 0
+                 ? 100.0 * summary->clear_count / summary->dark_count
+                 : 0.0,
+             summary->msas_Avg_clear);
+  }
+  if (summary->gap > 0) {
+    log_info(", ended by a %d minute gap", summary->gap);
+  }
+  log_info("\n");
+}
+
+/* Cloud classification (--classify). The RSE measures how jaggy the Msas
+ * data are around each sample, and jaggy data means clouds, so a sample is
+ * taken to be clear if its RSE (as output, i.e. multiplied by RSE_mult) is at
+ * most clear_RSE_max, and cloudy if it is more; samples without an RSE value
+ * are neither (-1). Breaks in the clouds are not trusted unless they last:
+ * a run of fewer than clear_run clear samples is counted as cloudy. The
+ * clean-sky Msas_Avg is then the average Msas of the dark samples (those
+ * which go into Msas_Avg) which are clear, and like Msas_Avg it is given to
+ * just those samples, the others getting -1 */
+void classify_night(struct night_buffer *night, int count,
+                    const struct night_settings *settings,
+                    struct night_summary *summary) {
+  float msas_Sum = 0.0, msas_Count = 0.0;
+  int run, j, k;
+
+  for (k = 0; k < count; k++) {
+    if (night->RSE[k] == settings->nodata1 ||
+        night->RSE[k] == settings->nodata2) {
+      night->clear[k] = -1;
+    } else {
+      night->clear[k] = night->RSE[k] <= settings->clear_RSE_max;
+    }
+  }
+
+  /* run-length smoothing: too short a run of clear samples is cloudy */
+  run = 0;
+  for (k = 0; k <= count; k++) {
+    if (k < count && night->clear[k] == 1) {
+      run = run + 1;
+      continue;
+    }
+    if (run < settings->clear_run) {
+      for (j = k - run; j < k; j++) {
+        night->clear[j] = 0;
+      }
+    }
+    run = 0;
+  }
+
+  for (k = 0; k < count; k++) {
+    if (night->clear[k] == 1 && night->dSunElev[k] < -18.0 &&
+        night->dMoonElev[k] < -10.0) {
+      msas_Sum = msas_Sum + night->dMsas[k];
+      msas_Count = msas_Count + 1.0;
+    }
+  }
+  summary->clear_count = (int)msas_Count;
+  summary->msas_Avg_clear = msas_Count > 0.0 ? msas_Sum / msas_Count : -1.0;
+  for (k = 0; k < count; k++) {
+    night->msas_Avg_clear[k] = -1.0;
+    if (night->clear[k] == 1 && night->dSunElev[k] < -18.0 &&
+        night->dMoonElev[k] < -10.0) {
+      night->msas_Avg_clear[k] = summary->msas_Avg_clear;
+    }
+  }
+}
+
+/* The night table (--nights). Besides the records, a _SQM_Nights.csv file
+ * may be written with one row per day/segment, worked out from the night
+ * buffer once its attributes are known:
+ *   NightsSince_1118 (of the first sample), Location, the local date and
+ *   time of the first and last samples, Samples, Dark_Samples (those which
+ *   go into Msas_Avg), the Msas_Avg, median and maximum Msas of the dark
+ *   samples, the start and average Msas of the darkest hour (the hour,
+ *   while the sun is 18 degrees below the horizon, with the highest average
+ *   Msas), the 10th, 50th and 90th percentiles of the RSE, the lowest and
+ *   highest Celsius, Short_Gaps (intervals between samples more than twice
+ *   the median interval, but too short to end the segment) and Gap (the gap
+ *   in minutes which ended the segment, or 0); with --classify also the
+ *   number and fraction of the dark samples which are clear and their
+ *   Msas_Avg. Values which can't be worked out for a night are -1 */
+#define NIGHT_TABLE_HEADER                                                     \
+  "NightsSince_1118,Location,Start_Date,Start_Time,End_Date,End_Time,"        \
+  "Samples,Dark_Samples,Msas_Avg,Msas_Median,Msas_Max,Darkest_Hour_Start,"     \
+  "Darkest_Hour_Msas,RSE_P10,RSE_Median,RSE_P90,Celsius_Min,Celsius_Max,"      \
+  "Short_Gaps,Gap"
+
+int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+/* the p-th fraction percentile of the n sorted values, interpolating between
+ * neighbours; -1 if there are none */
+double percentile(const double *sorted, int n, double p) {
+  double position;
+  int below;
+
+  if (n <= 0) {
+    return -1.0;
+  }
+  position = p * (n - 1);
+  below = (int)position;
+  if (below >= n - 1) {
+    return sorted[n - 1];
+  }
+  return sorted[below] +
+         (position - below) * (sorted[below + 1] - sorted[below]);
+}
+
+/* append the night table row of the count samples of a night, whose summary
+ * is done, to table; the night's scratch column is used for sorting. Returns
+ * 0 if we run out of memory */
+int night_table_row(struct night_buffer *night, int count,
+                    const struct night_settings *settings,
+                    const struct night_summary *summary,
+                    struct text_buffer *table) {
+  double *sorted = night->scratch;
+  double msas_Median, msas_Max, rse[3], celsius_Min, celsius_Max, interval;
+  double hour_Sum, hour_Best, hour_Msas;
+  int n, k, j, last = count - 1, hour_Count, hour_Start, short_Gaps;
+
+  /* median and maximum Msas of the dark samples */
+  n = 0;
+  for (k = 0; k < count; k++) {
+    if (night->dSunElev[k] < -18.0 && night->dMoonElev[k] < -10.0) {
+      sorted[n++] = night->dMsas[k];
+    }
+  }
+  qsort(sorted, (size_t)n, sizeof(double), compare_doubles);
+  msas_Median = percentile(sorted, n, 0.5);
+  msas_Max = n > 0 ? sorted[n - 1] : -1.0;
+
+  /* percentiles of the RSE */
+  n = 0;
+  for (k = 0; k < count; k++) {
+    if (night->RSE[k] != settings->nodata1 &&
+        night->RSE[k] != settings->nodata2) {
+      sorted[n++] = (double)night->RSE[k];
+    }
+  }
+  qsort(sorted, (size_t)n, sizeof(double), compare_doubles);
+  rse[0] = percentile(sorted, n, 0.1);
+  rse[1] = percentile(sorted, n, 0.5);
+  rse[2] = percentile(sorted, n, 0.9);
+
+  /* the temperature range, and the intervals between samples in minutes */
+  celsius_Min = night->dCelsius[0];
+  celsius_Max = night->dCelsius[0];
+  for (k = 1; k < count; k++) {
+    celsius_Min = fmin(celsius_Min, night->dCelsius[k]);
+    celsius_Max = fmax(celsius_Max, night->dCelsius[k]);
+    sorted[k - 1] = (night->J2000_days[k] - night->J2000_days[k - 1]) * 1440.;
+  }
+  short_Gaps = 0;
+  if (count > 2) {
+    qsort(sorted, (size_t)(count - 1), sizeof(double), compare_doubles);
+    interval = 2.0 * percentile(sorted, count - 1, 0.5);
+    for (k = 1; k < count; k++) {
+      if ((night->J2000_days[k] - night->J2000_days[k - 1]) * 1440. >
+          interval) {
+        short_Gaps = short_Gaps + 1;
+      }
+    }
+  }
+
+  /* the darkest hour: the hour starting with sample n holds samples n..j-1,
+   * and as n moves on j only ever moves on too, so this is one pass; only
+   * the samples taken while the sun is 18 degrees below the horizon count,
+   * and the hour has to end before the last of them, k */
+  for (k = last; k >= 0 && night->dSunElev[k] >= -18.0; k--) {
+  }
+  hour_Start = -1;
+  hour_Best = -1.0;
+  hour_Sum = 0.0;
+  hour_Count = 0;
+  j = 0;
+  for (n = 0; n < count; n++) {
+    for (; j < count && night->J2000_days[j] < night->J2000_days[n] + 1. / 24.;
+         j++) {
+      if (night->dSunElev[j] < -18.0) {
+        hour_Sum = hour_Sum + night->dMsas[j];
+        hour_Count = hour_Count + 1;
+      }
+    }
+    if (night->dSunElev[n] < -18.0) {
+      if (night->J2000_days[n] + 1. / 24. <= night->J2000_days[k] &&
+          hour_Sum / hour_Count > hour_Best) {
+        hour_Best = hour_Sum / hour_Count;
+        hour_Start = n;
+      }
+      hour_Sum = hour_Sum - night->dMsas[n];
+      hour_Count = hour_Count - 1;
+    }
+  }
+  hour_Msas = hour_Start >= 0 ? hour_Best : -1.0;
+
+  if (!text_printf(table,
+                   "%04d,%s,%04d-%02d-%02d,%02d:%02d:%02d,%04d-%02d-%02d,"
+                   "%02d:%02d:%02d,%d,%d,%.2f,%.2f,%.2f,",
+                   night->days[0], settings->SQM_Location, night->dYear[0],
+                   night->dMonth[0], night->dDay[0], night->dHour[0],
+                   night->dMinute[0], (int)night->dSeconds[0],
+                   night->dYear[last], night->dMonth[last], night->dDay[last],
+                   night->dHour[last], night->dMinute[last],
+                   (int)night->dSeconds[last], count, summary->dark_count,
+                   summary->msas_Avg, msas_Median, msas_Max)) {
+    return 0;
+  }
+  if (hour_Start >= 0 ? !text_printf(table, "%02d:%02d:%02d,",
+                                     night->dHour[hour_Start],
+                                     night->dMinute[hour_Start],
+                                     (int)night->dSeconds[hour_Start])
+                      : !text_printf(table, "-1,")) {
+    return 0;
+  }
+  if (!text_printf(table, "%.2f,%.3f,%.3f,%.3f,%.1f,%.1f,%d,%d", hour_Msas,
+                   rse[0], rse[1], rse[2], celsius_Min, celsius_Max,
+                   short_Gaps, summary->gap)) {
+    return 0;
+  }
+  if (settings->classify &&
+      !text_printf(table, ",%d,%.3f,%.2f", summary->clear_count,
+                   summary->dark_count > 0 ? (double)summary->clear_count /
+                                                 summary->dark_count
+                                           : -1.0,
+                   summary->msas_Avg_clear)) {
+    return 0;
+  }
+  return text_printf(table, "\n");
+}
+
+/* The station (location) labels of a binary output or a night index, each
+ * ended by a '\0', in the order they were first seen */
+struct station_labels {
+  struct text_buffer text;
+  uint32_t count;
+  size_t last;          /* where the label looked up last starts */
+  uint32_t last_number; /* and its number */
+};
+
+/* the number of the station location in labels, which is added to them if it
+ * is new; returns -1 if we run out of memory */
+long long station_label(struct station_labels *labels, const char *location) {
+  size_t label = strlen(location) + 1, at;
+  uint32_t number;
+
+  /* the station is nearly always that of the last night, and there are only
+   * ever a few of them */
+  if (labels->count > 0 &&
+      strcmp(labels->text.text + labels->last, location) == 0) {
+    return labels->last_number;
+  }
+  number = 0;
+  for (at = 0; at < labels->text.length &&
+               strcmp(labels->text.text + at, location) != 0;
+       at = at + strlen(labels->text.text + at) + 1) {
+    number = number + 1;
+  }
+  if (at == labels->text.length) {
+    if (!text_reserve(&labels->text, label)) {
+      return -1;
+    }
+    memcpy(labels->text.text + at, location, label);
+    labels->text.length = labels->text.length + label;
+    labels->count = number + 1;
+  }
+  labels->last = at;
+  labels->last_number = number;
+  return number;
+}
+
+/* Binary output (--binary). Besides the .csv file, the output may be written
+ * to a _SQM_Attr3.sqmb file of typed columns which can be memory-mapped and
+ * read a column or a night at a time, without parsing any text. All numbers
+ * are in the byte order of the machine which wrote the file (byte_order
+ * reads 0x01020304 when it matches that of the reader). The file holds:
+ *   - a header (struct binary_header, 128 bytes) with the station metadata
+ *     and where to find everything else;
+ *   - the column table, column_count entries of struct binary_column;
+ *   - one block per day/segment, starting at a multiple of 8 bytes, which
+ *     holds each column of the day in turn (count values of the column's
+ *     type, padded to a multiple of 8 bytes) in the order of the column
+ *     table;
+ *   - the night index, night_count entries of struct binary_night, which
+ *     give the offset of each block, its number of samples, its station and
+ *     its summary;
+ *   - the station (location) labels, station_count of them, each ended by a
+ *     '\0'; the station of a night is the number of its label.
+ * So column c of night n starts at index[n].offset plus the padded sizes of
+ * columns 0..c-1 of index[n].count values. The lat and long, which are the
+ * same in every record, are only in the header. The UTC date and time of a
+ * sample are index[n].utc_start + utc seconds since Jan 1, 1970, and its
+ * local date and time as many seconds again plus local_offset; its J2000 day
+ * is (index[n].utc_start + utc - 946728000) / 86400. The other columns are
+ * those of the .csv file, the numbers with fractions as floats, which hold
+ * one or two figures fewer of the coordinates than the .csv file prints. On
+ * the sample data the file is about 3.3 times smaller than the .csv file */
+
+/* the columns of the binary output: name, type in the file, kind of number
+ * ('i' signed, 'u' unsigned integer, 'f' floating point) and its value for
+ * sample k of night, whose first sample is at utc_start */
+#define BINARY_COLUMNS                                                         \
+  BINARY_COLUMN(utc, int32_t, 'i', sample_utc_seconds(night, k) - utc_start)   \
+  BINARY_COLUMN(local_offset, int32_t, 'i',                                    \
+                sample_local_seconds(night, k) -                               \
+                    sample_utc_seconds(night, k))                              \
+  BINARY_COLUMN(dCelsius, float, 'f', night->dCelsius[k])                      \
+  BINARY_COLUMN(dVolts, float, 'f', night->dVolts[k])                          \
+  BINARY_COLUMN(dMsas, float, 'f', night->dMsas[k])                            \
+  BINARY_COLUMN(dStatus, int8_t, 'i', night->dStatus[k])                       \
+  BINARY_COLUMN(dMoonPhase, float, 'f', night->dMoonPhase[k])                  \
+  BINARY_COLUMN(dMoonElev, float, 'f', night->dMoonElev[k])                    \
+  BINARY_COLUMN(dMoonIllum, float, 'f', night->dMoonIllum[k])                  \
+  BINARY_COLUMN(dSunElev, float, 'f', night->dSunElev[k])                      \
+  BINARY_COLUMN(minutes_since_3pm, int16_t, 'i', night->minutes_since_3pm[k])  \
+  BINARY_COLUMN(msas_Avg, float, 'f', night->msas_Avg[k])                      \
+  BINARY_COLUMN(days, int16_t, 'i', night->days[k])                            \
+  BINARY_COLUMN(right_ascension, float, 'f', night->right_ascension[k])        \
+  BINARY_COLUMN(Galactic_Lat, float, 'f', night->Galactic_Lat[k])              \
+  BINARY_COLUMN(Galactic_Long, float, 'f', night->Galactic_Long[k])            \
+  BINARY_COLUMN(RSE, float, 'f', night->RSE[k])
+
+#define BINARY_MAGIC "SQMATTR2"
+#define BINARY_VERSION 2
+
+struct binary_header {
+  char magic[8]; /* BINARY_MAGIC */
+  uint32_t version;
+  uint32_t byte_order; /* 0x01020304 */
+  uint32_t column_count;
+  uint32_t night_count;
+  uint64_t record_count;
+  uint64_t columns_offset;  /* of the column table */
+  uint64_t index_offset;    /* of the night index */
+  uint64_t stations_offset; /* of the station labels */
+  uint32_t station_count;
+  int32_t half_range;
+  double lat, lon;
+  int32_t window_minutes; /* 0 if the RSE windows are half_range samples */
+  int32_t window_samples;
+  uint32_t stations_length; /* bytes of the station labels */
+  char reserved[36];        /* zeros */
+};
+
+struct binary_column {
+  char name[24]; /* '\0' terminated */
+  char kind;     /* 'i', 'u' or 'f' */
+  uint8_t size;  /* bytes per value */
+  char reserved[6];
+};
+
+struct binary_night {
+  uint64_t offset;       /* of the night's block */
+  uint64_t first_record; /* number of records in the nights before */
+  int64_t utc_start;     /* UTC of the first sample, seconds since 1970 */
+  uint32_t count;        /* samples */
+  int32_t days;          /* NightsSince_1118 of the first sample */
+  int16_t year;          /* local date of the first sample */
+  uint8_t month, day;
+  uint32_t station; /* number of its station label */
+  float msas_Avg;   /* the summary of the night */
+  int32_t dark_count, rse_count, gap;
+};
+
+/* bytes taken up by count values of size bytes in a block */
+size_t binary_column_size(size_t size, int count) {
+  return (size * (size_t)count + 7) / 8 * 8;
+}
+
+/* append the block of the count samples of a night to block; returns 0 if we
+ * run out of memory */
+int binary_block(const struct night_buffer *night, int count,
+                 struct text_buffer *block) {
+  long long utc_start = sample_utc_seconds(night, 0);
+  size_t size = 0;
+  char *p;
+  int k;
+
+#define BINARY_COLUMN(name, type, kind, value)                                 \
+  size = size + binary_column_size(sizeof(type), count);
+  BINARY_COLUMNS
+#undef BINARY_COLUMN
+
+  if (!text_reserve(block, size)) {
+    return 0;
+  }
+  p = block->text + block->length;
+  memset(p, 0, size);
+#define BINARY_COLUMN(name, type, kind, value)                                 \
+  for (k = 0; k < count; k++) {                                                \
+    ((type *)p)[k] = (type)(value);                                            \
+  }                                                                            \
+  p = p + binary_column_size(sizeof(type), count);
+  BINARY_COLUMNS
+#undef BINARY_COLUMN
+
+  block->length = block->length + size;
+  return 1;
+}
+
+/* a binary output file being written */
+struct binary_output {
+  FILE *file;
+  struct binary_header header;
+  struct binary_night *index;
+  int capacity; /* entries allocated for index */
+  uint64_t offset; /* where the next block goes */
+  struct station_labels stations;
+};
+
+/* open the binary output file and write its column table; the header is
+ * written when it is closed. Returns 0 if the file could not be written */
+int binary_open(struct binary_output *output, const char *name,
+                const struct night_settings *settings) {
+  struct binary_column column;
+  int ok;
+
+  memset(output, 0, sizeof(struct binary_output));
+  output->file = fopen(name, "wb");
+  if (output->file == NULL) {
+    return 0;
+  }
+  memcpy(output->header.magic, BINARY_MAGIC, sizeof(output->header.magic));
+  output->header.version = BINARY_VERSION;
+  output->header.byte_order = 0x01020304;
+  output->header.columns_offset = sizeof(struct binary_header);
+  output->header.half_range = settings->half_range;
+  output->header.window_minutes = settings->window_minutes;
+  output->header.window_samples = settings->window_samples;
+  output->header.lat = settings->SQM_Lat;
+  output->header.lon = settings->SQM_Long;
+
+  /* leave room for the header */
+  ok = fwrite(&output->header, sizeof(struct binary_header), 1,
+              output->file) == 1;
+#define BINARY_COLUMN(field, type, type_kind, value)                           \
+  memset(&column, 0, sizeof(column));                                          \
+  strcpy(column.name, #field);                                                 \
+  column.kind = type_kind;                                                     \
+  column.size = sizeof(type);                                                  \
+  ok = ok && fwrite(&column, sizeof(column), 1, output->file) == 1;            \
+  output->header.column_count = output->header.column_count + 1;
+  BINARY_COLUMNS
+#undef BINARY_COLUMN
+
+  if (!ok) {
+    fclose(output->file);
+    output->file = NULL;
+    return 0;
+  }
+  output->offset = sizeof(struct binary_header) +
+                   output->header.column_count * sizeof(struct binary_column);
+  return 1;
+}
+
+/* write the block of a night, made by binary_block, whose count samples
+ * start at night, for the station location; returns 0 if we run out of
+ * memory or the file could not be written */
+int binary_write_night(struct binary_output *output,
+                       const struct text_buffer *block,
+                       const struct night_buffer *night, int count,
+                       const struct night_summary *summary,
+                       const char *location) {
+  struct binary_night *entry, *grown;
+  int n = (int)output->header.night_count;
+  long long station;
+
+  if (count <= 0) {
+    return 1;
+  }
+  if (n == output->capacity) {
+    output->capacity = output->capacity > 0 ? output->capacity * 2 : 256;
+    grown = realloc(output->index,
+                    sizeof(struct binary_night) * (size_t)output->capacity);
+    if (grown == NULL) {
+      return 0;
+    }
+    output->index = grown;
+  }
+  station = station_label(&output->stations, location);
+  if (station < 0) {
+    return 0;
+  }
+  if (fwrite(block->text, 1, block->length, output->file) != block->length) {
+    return 0;
+  }
+
+  entry = &output->index[n];
+  memset(entry, 0, sizeof(struct binary_night));
+  entry->offset = output->offset;
+  entry->first_record = output->header.record_count;
+  entry->utc_start = sample_utc_seconds(night, 0);
+  entry->count = (uint32_t)count;
+  entry->station = (uint32_t)station;
+  entry->days = night->days[0];
+  entry->year = (int16_t)night->dYear[0];
+  entry->month = (uint8_t)night->dMonth[0];
+  entry->day = (uint8_t)night->dDay[0];
+  entry->msas_Avg = summary->msas_Avg;
+  entry->dark_count = summary->dark_count;
+  entry->rse_count = summary->rse_count;
+  entry->gap = summary->gap;
+
+  output->offset = output->offset + block->length;
+  output->header.record_count = output->header.record_count + (uint64_t)count;
+  output->header.night_count = (uint32_t)n + 1;
+  return 1;
+}
+
+/* write the night index, the station labels and the header, and close the
+ * file; returns 0 if anything could not be written */
+int binary_close(struct binary_output *output) {
+  int ok;
+
+  output->header.index_offset = output->offset;
+  output->header.stations_offset =
+      output->offset +
+      output->header.night_count * sizeof(struct binary_night);
+  output->header.station_count = output->stations.count;
+  output->header.stations_length = (uint32_t)output->stations.text.length;
+  ok = fwrite(output->index, sizeof(struct binary_night),
+              output->header.night_count,
+              output->file) == output->header.night_count &&
+       fwrite(output->stations.text.text, 1, output->stations.text.length,
+              output->file) == output->stations.text.length &&
+       fseek(output->file, 0, SEEK_SET) == 0 &&
+       fwrite(&output->header, sizeof(struct binary_header), 1,
+              output->file) == 1;
+  ok = fclose(output->file) == 0 && ok;
+  free(output->index);
+  text_buffer_free(&output->stations.text);
+  output->index = NULL;
+  return ok;
+}
+
+/* The night index (--index). Besides the .csv file, a _SQM_Attr3.sqmi file
+ * may be written which says where each day/segment of the .csv file is, so
+ * that a night, or a range of nights, can be read without going through the
+ * whole file (see run_query). Like the binary output, its numbers are in the
+ * byte order of the machine which wrote it. The file holds:
+ *   - a header (struct index_header, 64 bytes), which gives among other
+ *     things the size of the .csv file it goes with, so that an index left
+ *     over from an earlier run is not used (a run without --index removes
+ *     the index of the .csv file it writes, too);
+ *   - one entry per day/segment (struct index_night), in the order of the
+ *     .csv file, with the byte offset and length of its rows, the station
+ *     and the range of NightsSince_1118 of its rows, and the least and
+ *     greatest Msas, SunElev and MoonElev, so that a query can pass over the
+ *     nights which can't have anything it wants;
+ *   - the station (location) labels, each ended by a '\0'.
+ * Ten years of data make a few thousand entries, which are scanned in well
+ * under a millisecond */
+
+#define INDEX_MAGIC "SQMINDX1"
+#define INDEX_VERSION 1
+
+struct index_header {
+  char magic[8]; /* INDEX_MAGIC */
+  uint32_t version;
+  uint32_t byte_order; /* 0x01020304 */
+  uint32_t night_count;
+  uint32_t station_count;
+  uint64_t output_size;     /* of the .csv file */
+  uint64_t nights_offset;   /* of the entries */
+  uint64_t stations_offset; /* of the labels */
+  char reserved[16];        /* zeros */
+};
+
+struct index_night {
+  uint64_t offset; /* of the night's first row in the .csv file */
+  uint64_t length; /* bytes of its rows */
+  uint32_t count;  /* rows */
+  uint32_t station;
+  int32_t first_night, last_night; /* NightsSince_1118 of its rows */
+  float msas_min, msas_max;
+  float sun_min, sun_max;
+  float moon_min, moon_max;
+};
+
+/* a night index being written; all of it is kept until it is closed */
+struct night_index {
+  FILE *file;
+  struct index_header header;
+  struct index_night *nights;
+  int capacity; /* entries allocated for nights */
+  struct station_labels stations;
+};
+
+/* the name of the index of the .csv file output: output with .csv changed
+ * to .sqmi, or with .sqmi added if it doesn't end in .csv; returns 0 if the
+ * name doesn't fit in size */
+int index_name(char *name, size_t size, const char *output) {
+  size_t length = strlen(output);
+
+  if (length > 4 && strcmp(output + length - 4, ".csv") == 0) {
+    length = length - 4;
+  }
+  return snprintf(name, size, "%.*s.sqmi", (int)length, output) < (int)size;
+}
+
+/* open the night index file name; returns 0 if it can't be written */
+int index_open(struct night_index *index, const char *name) {
+  memset(index, 0, sizeof(struct night_index));
+  index->file = fopen(name, "wb");
+  if (index->file == NULL) {
+    return 0;
+  }
+  memcpy(index->header.magic, INDEX_MAGIC, sizeof(index->header.magic));
+  index->header.version = INDEX_VERSION;
+  index->header.byte_order = 0x01020304;
+  return 1;
+}
+
+/* add the night of count samples whose length bytes of rows start at offset
+ * in the .csv file, for the station location; returns 0 if we run out of
+ * memory */
+int index_add_night(struct night_index *index, long long offset,
+                    size_t length, const struct night_buffer *night,
+                    int count, const char *location) {
+  struct index_night *entry, *grown;
+  long long station;
+  int n = (int)index->header.night_count, k;
+
+  if (count <= 0) {
+    return 1;
+  }
+  if (n == index->capacity) {
+    index->capacity = index->capacity > 0 ? index->capacity * 2 : 256;
+    grown = realloc(index->nights,
+                    sizeof(struct index_night) * (size_t)index->capacity);
+    if (grown == NULL) {
+      return 0;
+    }
+    index->nights = grown;
+  }
+  entry = &index->nights[n];
+  memset(entry, 0, sizeof(struct index_night));
+
+  station = station_label(&index->stations, location);
+  if (station < 0) {
+    return 0;
+  }
+  entry->station = (uint32_t)station;
+
+  entry->offset = (uint64_t)offset;
+  entry->length = (uint64_t)length;
+  entry->count = (uint32_t)count;
+  entry->first_night = entry->last_night = night->days[0];
+  entry->msas_min = entry->msas_max = night->dMsas[0];
+  entry->sun_min = entry->sun_max = night->dSunElev[0];
+  entry->moon_min = entry->moon_max = night->dMoonElev[0];
+  for (k = 1; k < count; k++) {
+#define INDEX_RANGE(min, max, value)                                           \
+  if (value < min) {                                                           \
+    min = value;                                                               \
+  } else if (value > max) {                                                    \
+    max = value;                                                               \
+  }
+    INDEX_RANGE(entry->first_night, entry->last_night, night->days[k])
+    INDEX_RANGE(entry->msas_min, entry->msas_max, night->dMsas[k])
+    INDEX_RANGE(entry->sun_min, entry->sun_max, night->dSunElev[k])
+    INDEX_RANGE(entry->moon_min, entry->moon_max, night->dMoonElev[k])
+#undef INDEX_RANGE
+  }
+  index->header.night_count = (uint32_t)n + 1;
+  return 1;
+}
+
+/* write the index of a .csv file of output_size bytes and close it; returns 0
+ * if anything could not be written */
+int index_close(struct night_index *index, long long output_size) {
+  int ok;
+
+  index->header.output_size = (uint64_t)output_size;
+  index->header.station_count = index->stations.count;
+  index->header.nights_offset = sizeof(struct index_header);
+  index->header.stations_offset =
+      index->header.nights_offset +
+      index->header.night_count * sizeof(struct index_night);
+  ok = fwrite(&index->header, sizeof(struct index_header), 1, index->file) ==
+           1 &&
+       fwrite(index->nights, sizeof(struct index_night),
+              index->header.night_count,
+              index->file) == index->header.night_count &&
+       fwrite(index->stations.text.text, 1, index->stations.text.length,
+              index->file) == index->stations.text.length;
+  ok = fclose(index->file) == 0 && ok;
+  free(index->nights);
+  text_buffer_free(&index->stations.text);
+  index->nights = NULL;
+  return ok;
+}
+
+/* Work out the attributes of the count samples of one day/segment of data -
+ * the sun and moon columns of a .dat file, the average Msas, the Residual
+ * Standard Error and the coordinates - append its output records to out, its
+ * binary block to block and its night table row to table, unless they are
+ * NULL, and fill in its summary (all but the gap, which is set beforehand).
+ * Returns 0 if we run out of memory */
+int process_night(struct night_buffer *night, int count,
+                  const struct night_settings *settings,
+                  struct text_buffer *out, struct text_buffer *block,
+                  struct text_buffer *table, struct night_summary *summary) {
+  const char *SQM_Location = settings->SQM_Location;
+  double SQM_Lat = settings->SQM_Lat, SQM_Long = settings->SQM_Long;
+  int half_range = settings->half_range, is_dat = settings->is_dat;
+  long double RSE_mult = settings->RSE_mult, nodata1 = settings->nodata1,
+              nodata2 = settings->nodata2;
+  float msas_Sum, msas_Count;
+  int dHour_Delta = settings->hour_delta, dShift_Hour, days;
+  int date_Year = 0, date_Month = 0, date_Day = 0, date_days = 0;
+  long long local;
+  size_t first, prefix_length, row;
+  char *end;
+  struct prefix_sum *sums = NULL;
+  long double *scale_RSE = NULL, *RSE;
+  const struct station_entry *station;
+  int k, n, ok = 0;
+
+  /* the .dat files have no sun and moon columns, so we calculate them */
+  if (is_dat) {
+    calc_sun_moon_night(night, count, SQM_Lat, SQM_Long);
+  }
+  stage_mark(settings->timer, STAGE_COORDS);
+
+  /* the corrections of the station (--registry) are looked up once for the
+   * night, by the local date on which it starts */
+  if (settings->registry != NULL && count > 0) {
+    station = station_lookup(
+        settings->registry, SQM_Location,
+        days_from_civil(night->dYear[0], night->dMonth[0], night->dDay[0]));
+    if (station == NULL) {
+      log_debug(" The station registry has no entry for %s on "
+                "%04d-%02d-%02d, so its Msas_Corr is Msas\n",
+                SQM_Location, night->dYear[0], night->dMonth[0],
+                night->dDay[0]);
+    }
+    correct_night(night, count, station);
+  }
+
+  /* Calculation of average Msas for the day; */
+  /* loop on the day's data */
+  msas_Sum = 0.0;
+  msas_Count = 0.0;
+  for (k = 0; k < count; k++) {
+
+    /* Sun is lower than 18 degrees below the horizon and the moon is lower
+     * than 10 degrees below the horizon */
+    if (night->dSunElev[k] < -18.0 && night->dMoonElev[k] < -10.0) {
+
+      /* tally sum and count for msas average */
+      msas_Sum = msas_Sum + night->dMsas[k];
+      msas_Count = msas_Count + 1.0;
+    }
+  }
+  /* we will later print out the average value for this day in those records
+   * that contributed to the average, not to all records */
+  /* That is, we will print out the average value for this day for those
+   * records when the sun was less than 18 degree below the horizon*/
+  /* We assign a null value (-1.0) to all points of the sun higher than -18
+   * degrees, and all points lacking any count values */
+
+  for (k = 0; k < count; k++) {
+
+    if (night->dSunElev[k] < -18.0 && night->dMoonElev[k] < -10.0) {
+
+      /* handle case of no values in the msas sum */
+      night->msas_Avg[k] = -1.0;
+      if (msas_Count > 0.0) {
+        night->msas_Avg[k] = msas_Sum / msas_Count;
+      }
+    } else {
+      night->msas_Avg[k] = -1.0;
+    }
+  }
+
+  stage_mark(settings->timer, STAGE_AVERAGE);
+
+  /* Calculate Residual Standard Error values - samples are assumed to be a
+   * constant number of minutes apart; Set half_range at the program command
+   * line to specify the number of samples to consider, and given the spacing
+   * between SQM measurements, the number of minutes in the sample range;
+   * This fits a regression line to each point of data, and with half_range
+   * set to 9 and 5-minute sample spaceing then you get a range from 45
+   * minutes before to 45 minutes after the point, for a total of 90 minutes;
+   * Program calculates the deviation from the straight line, * expressed by
+   * the sum of ((observed - expected)**2 /(expected)).
+   */
+
+  /* calculate the RSE values for the whole day/segment in one pass; samples
+   * without a full window (see sample_windows and time_windows) are set to
+   * nodata1 */
+  if (settings->window_minutes > 0) {
+    time_windows(count, night->minutes_since_3pm, settings->window_minutes,
+                 settings->window_samples, night->window_first,
+                 night->window_last);
+  } else {
+    sample_windows(count, half_range, night->window_first, night->window_last);
+  }
+  if (settings->robust) {
+    calc_rse_night_robust(count, night->window_first, night->window_last,
+                          night->minutes_since_3pm, night->dMsas, night->RSE,
+                          RSE_mult, nodata1, nodata2, night->scratch);
+  } else {
+    calc_rse_night(count, night->window_first, night->window_last,
+                   night->minutes_since_3pm, night->dMsas, night->RSE,
+                   RSE_mult, nodata1, nodata2);
+  }
+
+  /* and at each of the scales of --scales, over one set of prefix sums (see
+   * calc_rse_prefix); the windows of the RSE above are done with, so the
+   * windows of the scales take their place */
+  if (settings->scale_count > 0 && count > 0) {
+    scale_RSE = malloc(sizeof(long double) * (size_t)settings->scale_count *
+                       (size_t)count);
+    if (!settings->robust) {
+      sums = malloc(sizeof(struct prefix_sum) * 5 * (size_t)(count + 1));
+    }
+    if (scale_RSE == NULL || (!settings->robust && sums == NULL)) {
+      goto Done;
+    }
+    if (sums != NULL) {
+      rse_prefix_sums(count, night->minutes_since_3pm, night->dMsas, sums);
+    }
+    for (n = 0; n < settings->scale_count; n++) {
+      RSE = scale_RSE + (size_t)n * (size_t)count;
+      if (settings->window_minutes > 0) {
+        time_windows(count, night->minutes_since_3pm, settings->scales[n],
+                     settings->window_samples, night->window_first,
+                     night->window_last);
+      } else {
+        sample_windows(count, settings->scales[n], night->window_first,
+                       night->window_last);
+      }
+      if (settings->robust) {
+        calc_rse_night_robust(count, night->window_first, night->window_last,
+                              night->minutes_since_3pm, night->dMsas, RSE,
+                              RSE_mult, nodata1, nodata2, night->scratch);
+      } else {
+        calc_rse_prefix(count, night->window_first, night->window_last,
+                        night->minutes_since_3pm, night->dMsas, sums, RSE,
+                        RSE_mult, nodata1, nodata2);
+      }
+    }
+  }
+
+  summary->count = count;
+  summary->dark_count = (int)msas_Count;
+  summary->msas_Avg = msas_Count > 0.0 ? msas_Sum / msas_Count : -1.0;
+  summary->rse_count = 0;
+  summary->nodata1_count = 0;
+  summary->nodata2_count = 0;
+  for (k = 0; k < count; k++) {
+    if (night->RSE[k] == nodata1) {
+      summary->nodata1_count = summary->nodata1_count + 1;
+    } else if (night->RSE[k] == nodata2) {
+      summary->nodata2_count = summary->nodata2_count + 1;
+    } else {
+      summary->rse_count = summary->rse_count + 1;
+    }
+  }
+
+  /* flag the clear and cloudy samples by their RSE */
+  summary->clear_count = -1;
+  if (settings->classify) {
+    classify_night(night, count, settings, summary);
+  }
+  stage_mark(settings->timer, STAGE_RSE);
+
+  /* the right ascension, Galactic Coordinates and J2000 day of every sample
+   */
+  calc_coordinates_night(night, count, settings);
+  stage_mark(settings->timer, STAGE_COORDS);
+
+  /* now print all this day's records to the output file */
+
+  /* every record starts with the location, lat and long, which are only
+   * formatted for the first record and copied from there to the others */
+  first = out->length;
+  if (!text_printf(out, "%s,%12.7lf,%12.7lf,", SQM_Location, SQM_Lat,
+                   SQM_Long)) {
+    goto Done;
+  }
+  prefix_length = out->length - first;
+  out->length = first;
+
+  for (k = 0; k < count; k++) {
+
+    /* with a time zone (--tz), the night is that of the day on which it
+     * starts at 15:00 local standard time */
+    if (settings->tz != NULL) {
+      local = sample_utc_seconds(night, k) + night->standard_offset[k] -
+              15 * 3600;
+      days = (int)((local >= 0 ? local : local - 86399) / 86400) - 17531;
+    } else {
+      /* Calculate a new variable - the number of days since Jan 1, 2018; the
+       * samples of a night fall on just two dates, so it is only worked out
+       * again when the date changes */
+      if (k == 0 || night->dDay[k] != date_Day ||
+          night->dMonth[k] != date_Month || night->dYear[k] != date_Year) {
+        date_Year = night->dYear[k];
+        date_Month = night->dMonth[k];
+        date_Day = night->dDay[k];
+        date_days = get_yday(date_Month, date_Day, date_Year);
+      }
+      days = date_days;
+
+      /* We actually want the number of nights since Jan 1, 2018 - that is we
+       * want to count the evening and night as part of the same "day" -
+       * actually the same "night"; So if the minutes since 15:00 hours is
+       * greater than 540 (i.e. after midnight) we subtract one day from the
+       * "days" value so those times are considered part of the previous day
+       * (i.e."night") */
+      /*
+         Bug fix April 29, 2023 - the previous algorithm, commented out just
+       below, did not work during daylight savings time.
+       * Fixed the problem by first checking to see if the local hour is as
+       expected, give the longitude of the SQM site.
+       * We expect the local hour to be longitude/15 off from the UTC hour,
+       which is the case during non-daylight savings time.
+       * If the local hour is not as expected, then instead of shifting at 540
+       minutes (midnight), we shift at 480 minutes to
+       * provide a consistent "nights since 1118" attribute */
+
+      /*              if(night->minutes_since_3pm[k] >= 540) {
+                         days = days -1;
+                      }
+      */
+      /* new code follows */
+      /* a check shows that this new algortihm is not working - needs to study
+       * this further */
+      /* dHour_Delta, the hours from UTC to standard time, is worked out once
+       * for the file (see standard_hour_delta) */
+      dShift_Hour = night->dUHour[k] + dHour_Delta;
+      if (dShift_Hour == night->dHour[k]) {
+        /* if here, we are in not in Daylight Savings Time */
+        if (night->minutes_since_3pm[k] >= 540) {
+          days = days - 1;
+        }
+      } else {
+        /* if here, we are in Daylight Savings Time */
+        if (night->minutes_since_3pm[k] >= 480) {
+          days = days - 1;
+        }
+      }
+    }
+
+    /* Note, we need to output two numbers for each of hour, minute and
+       seconds. If only one digit is output, Spotfire, and other programs,
+       will take the digit as a ten's value, insted of a one's value*/
+    row = out->length;
+    if (!text_reserve(out, prefix_length + RECORD_MAX)) {
+      goto Done;
+    }
+    memcpy(out->text + row, out->text + first, prefix_length);
+    end = put_record(out->text + row + prefix_length, night, k, days,
+                     settings->classify);
+    if (end != NULL) {
+      *end = '\0';
+      out->length = (size_t)(end - out->text);
+    } else if (!text_printf(
+                   out, RECORD_FORMAT, SQM_Location, SQM_Lat, SQM_Long,
+                   night->dUYear[k], night->dUMonth[k], night->dUDay[k],
+                   night->dUHour[k], night->dUMinute[k],
+                   (int)night->dUSeconds[k], night->dYear[k], night->dMonth[k],
+                   night->dDay[k], night->dHour[k], night->dMinute[k],
+                   (int)night->dSeconds[k], night->dCelsius[k],
+                   night->dVolts[k], night->dMsas[k], night->dStatus[k],
+                   night->dMoonPhase[k], night->dMoonElev[k],
+                   night->dMoonIllum[k], night->dSunElev[k],
+                   night->minutes_since_3pm[k], night->msas_Avg[k], days,
+                   night->right_ascension[k], night->Galactic_Lat[k],
+                   night->Galactic_Long[k], night->J2000_days[k],
+                   night->RSE[k])) {
+      goto Done;
+    } else if (settings->classify) {
+      /* the classification columns take the place of the '\n' */
+      out->length = out->length - 1;
+      if (!text_printf(out, CLEAR_FORMAT, night->clear[k],
+                       night->msas_Avg_clear[k])) {
+        goto Done;
+      }
+    }
+
+    /* and so do the RSE columns of the scales */
+    if (scale_RSE != NULL) {
+      if (!text_reserve(out, (size_t)settings->scale_count * 24)) {
+        goto Done;
+      }
+      out->length = out->length - 1;
+      end = out->text + out->length;
+      *end = ',';
+      end = end + 1;
+      for (n = 0; end != NULL && n < settings->scale_count; n++) {
+        end = put_fixed_long(end, scale_RSE[(size_t)n * count + k], 6, 0,
+                             n + 1 < settings->scale_count ? ',' : '\n');
+      }
+      if (end != NULL) {
+        *end = '\0';
+        out->length = (size_t)(end - out->text);
+      }
+      for (n = 0; end == NULL && n < settings->scale_count; n++) {
+        if (!text_printf(out, ",%Lf", scale_RSE[(size_t)n * count + k])) {
+          goto Done;
+        }
+      }
+      if (end == NULL && !text_printf(out, "\n")) {
+        goto Done;
+      }
+    }
+
+    /* and so does Msas_Corr (--registry) */
+    if (settings->registry != NULL) {
+      if (!text_reserve(out, 24)) {
+        goto Done;
+      }
+      out->length = out->length - 1;
+      end = out->text + out->length;
+      *end = ',';
+      end = put_fixed(end + 1, night->dMsas_Corr[k], 2, 0, '\n');
+      if (end != NULL) {
+        *end = '\0';
+        out->length = (size_t)(end - out->text);
+      } else if (!text_printf(out, ",%.2f\n", night->dMsas_Corr[k])) {
+        goto Done;
+      }
+    }
+    log_trace("%s", out->text + row);
+    night->days[k] = days;
+  }
+
+  if (block != NULL && count > 0 && !binary_block(night, count, block)) {
+    goto Done;
+  }
+  if (table != NULL && count > 0 &&
+      !night_table_row(night, count, settings, summary, table)) {
+    goto Done;
+  }
+  stage_mark(settings->timer, STAGE_WRITE);
+  ok = 1;
+
+Done:
+  free(sums);
+  free(scale_RSE);
+  return ok;
+}
+
+/* one input file to be processed, with the position of its SQM and the
+ * half_range, and what became of it */
+struct sqm_job {
+  const char *NameIn;  /* "-" for stdin */
+  const char *NameOut; /* "-" for stdout, NULL for NameIn_SQM_Attr3.csv */
+  int has_position; /* 0 to take the lat and long from a .dat header */
+  double lat, lon;
+  int half_range;
+  int threads;     /* to process the file on, 1 to read it sequentially */
+  int binary;      /* also write a _SQM_Attr3.sqmb binary output file */
+  int incremental; /* only process what was added since the last run */
+  int classify;    /* flag clear and cloudy samples (see classify_night) */
+  double clear_RSE_max;
+  int clear_run;
+  int night_table; /* also write a _SQM_Nights.csv table, a row per night */
+  int index;       /* also write a _SQM_Attr3.sqmi night index */
+  int robust;      /* fit the RSE windows robustly */
+  int window_minutes; /* RSE windows of this many minutes either side */
+  int window_samples;
+  int scale_count; /* the extra RSE columns of --scales */
+  int scales[MAX_RSE_SCALES];
+  const char *tz_name; /* the time zone, "header" for that of a .dat file */
+  const struct station_registry *registry; /* --registry, or NULL */
+  int timed;    /* time the stages (see struct stage_timer) */
+  int progress; /* seconds between progress lines, 0 for none */
+  long records; /* the rest is filled in by process_file */
+  int nights;
+  int failed;
+  long rejected;           /* lines which could not be read */
+  long gaps;               /* gaps which ended a day/segment */
+  long nodata1, nodata2;   /* samples given those RSE values */
+  long long bytes_read;    /* of the input */
+  long long bytes_written; /* to the output files */
+  double seconds;          /* taken by the file */
+  struct stage_timer stages;
+};
+
+/* with --progress, a line on how job is getting on, no more often than every
+ * job->progress seconds; *last is when the last line was written */
+void log_progress(const struct sqm_job *job, const struct timespec *started,
+                  struct timespec *last) {
+  double seconds;
+
+  if (job->progress <= 0 || seconds_since(last) < job->progress) {
+    return;
+  }
+  clock_gettime(CLOCK_MONOTONIC, last);
+  seconds = seconds_since(started);
+  log_message(" %s: %ld records, %d nights, %.1f MB written in %.0f seconds, "
+              "%.0f records per second\n",
+              job->NameIn, job->records, job->nights,
+              job->bytes_written / 1.0e6, seconds,
+              seconds > 0.0 ? job->records / seconds : 0.0);
+}
+
+/* Intra-file parallelism. The days/segments of a file are independent once we
+ * know where each one starts, so a long file can be spread over several
+ * threads in three steps:
+ *   1) the lines of the (memory-mapped) file are split into one chunk per
+ *      thread and the chunks are parsed at the same time, each into a night
+ *      buffer of its own, which are then joined into one for the whole file;
+ *   2) a quick pass over the parsed samples finds the gaps and the 15:00
+ *      boundaries, following exactly the rules of the ReadAnother/LastDay
+ *      loop in process_file, including the Start flag;
+ *   3) the segments are handed out to the threads, which put the output of
+ *      each segment in a text buffer of its own, and the calling thread writes
+ *      the buffers to the output file in the original order.
+ * All of the file is held in memory at once, so this is only done when asked
+ * for (--threads) */
+
+/* a line which could not be read: its number within its chunk, and how many
+ * fields could be */
+struct skipped_line {
+  long line;
+  int fields;
+};
+
+/* at most this many unreadable lines of a chunk are reported one by one */
+#define MAX_SKIPPED_LINES 1000
+
+/* the lines begin..begin+size of a file, and the samples parsed from them */
+struct parse_chunk {
+  const char *begin;
+  size_t size;
+  int is_dat, record_fields;
+  const struct dat_header *header;
+  int hour_delta;
+  const struct time_zone *tz;
+  int tz_cursor;
+  struct night_buffer night;
+  int count;           /* number of samples in night */
+  long lines;          /* number of lines in the chunk */
+  long skipped;        /* number of lines which could not be read */
+  struct skipped_line *skipped_lines; /* the first max_skipped of them */
+  const char *location; /* the location label of the first sample */
+  size_t location_length;
+  int mixed_locations; /* the location label changes within the chunk */
+  int failed;          /* ran out of memory */
+};
+
+void *parse_chunk_worker(void *arg) {
+  struct parse_chunk *chunk = arg;
+  struct sqm_reader reader;
+  const char *line, *location;
+  size_t line_length, location_length;
+  int m, ret;
+
+  /* a reader over just the lines of this chunk */
+  memset(&reader, 0, sizeof(reader));
+  reader.fd = -1;
+  reader.mapped = 1;
+  reader.at_eof = 1;
+  reader.data = (char *)chunk->begin;
+  reader.size = chunk->size;
+
+  m = 0;
+  for (;;) {
+    if (!night_buffer_reserve(&chunk->night, m + 1, m)) {
+      chunk->failed = 1;
+      break;
+    }
+
+    /* skip any blank lines, and comment lines in a .dat file */
+    do {
+      line = reader_next_line(&reader, &line_length);
+      while (line != NULL && line_length > 0 &&
+             (line[line_length - 1] == ' ' || line[line_length - 1] == '\t')) {
+        line_length = line_length - 1;
+      }
+    } while (line != NULL &&
+             (line_length == 0 || (chunk->is_dat && line[0] == '#')));
+    if (line == NULL) {
+      break;
+    }
+
+    if (chunk->is_dat) {
+      ret = parse_dat_record(line, line_length, &chunk->night, m,
+                             chunk->header);
+    } else {
+      ret = parse_csv_record(line, line_length, &chunk->night, m, &location,
+                             &location_length);
+    }
+    if (ret < chunk->record_fields) {
+      /* remember the line so that it can be reported with its line number in
+       * the whole file once all the chunks are parsed */
+      if (chunk->skipped == 0) {
+        chunk->skipped_lines =
+            malloc(sizeof(struct skipped_line) * MAX_SKIPPED_LINES);
+      }
+      if (chunk->skipped_lines != NULL && chunk->skipped < MAX_SKIPPED_LINES) {
+        chunk->skipped_lines[chunk->skipped].line = reader.line;
+        chunk->skipped_lines[chunk->skipped].fields = ret;
+      }
+      chunk->skipped = chunk->skipped + 1;
+      continue;
+    }
+
+    if (!chunk->is_dat) {
+      if (m == 0) {
+        chunk->location = location;
+        chunk->location_length = location_length;
+      } else if (location_length != chunk->location_length ||
+                 memcmp(location, chunk->location, location_length) != 0) {
+        chunk->mixed_locations = 1;
+      }
+    }
+
+    calc_minutes_since_3pm(&chunk->night, m, chunk->hour_delta, chunk->tz,
+                           &chunk->tz_cursor);
+    m = m + 1;
+  }
+  chunk->count = m;
+  chunk->lines = reader.line;
+  return NULL;
+}
+
+/* copy count samples of from, starting with its first, into the slots at..
+ * of to */
+void night_buffer_move(struct night_buffer *to, int at,
+                       const struct night_buffer *from, int count) {
+#define NIGHT_COLUMN(type, name)                                               \
+  memcpy(to->name + at, from->name, sizeof(type) * (size_t)count);
+  NIGHT_COLUMNS
+#undef NIGHT_COLUMN
+}
+
+/* make view a night buffer which starts at slot first of night */
+void night_buffer_view(struct night_buffer *view,
+                       const struct night_buffer *night, int first) {
+  view->capacity = night->capacity - first;
+  view->arena = NULL;
+#define NIGHT_COLUMN(type, name) view->name = night->name + first;
+  NIGHT_COLUMNS
+#undef NIGHT_COLUMN
+}
+
+/* one day/segment of the file: samples first..first+count-1 */
+struct night_segment {
+  int first, count;
+  struct text_buffer out;
+  struct text_buffer block; /* for the binary output file */
+  struct text_buffer table; /* for the night table */
+  struct night_summary summary;
+  int done;   /* out is ready to be written */
+  int failed; /* ran out of memory */
+};
+
+/* the segments to be processed, shared by the threads */
+struct segment_queue {
+  struct night_buffer *night;
+  const struct night_settings *settings;
+  struct binary_output *binary; /* NULL if there is no binary output */
+  int tabulate;                 /* there is a night table */
+  struct night_segment *segments;
+  int count;
+  int next;    /* the next segment to hand out */
+  int written; /* the number of segments written out so far */
+  int window;  /* how far the threads may get ahead of the writer */
+  struct stage_timer stages; /* the stages timed by the threads, added up */
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+};
+
+/* process segment n with settings, which are those of the queue but for the
+ * timer, as each thread times its own stages */
+void process_segment(struct segment_queue *queue, int n,
+                     const struct night_settings *settings) {
+  struct night_segment *segment = &queue->segments[n];
+  struct night_buffer view;
+
+  night_buffer_view(&view, queue->night, segment->first);
+  stage_start(settings->timer);
+  segment->failed = !process_night(
+      &view, segment->count, settings, &segment->out,
+      queue->binary != NULL ? &segment->block : NULL,
+      queue->tabulate ? &segment->table : NULL, &segment->summary);
+}
+
+void *segment_worker(void *arg) {
+  struct segment_queue *queue = arg;
+  struct night_settings settings = *queue->settings;
+  struct stage_timer timer = {0};
+  int n;
+
+  if (settings.timer != NULL) {
+    settings.timer = &timer;
+  }
+
+  for (;;) {
+    /* don't get too far ahead of the writer, so that only a few segments of
+     * output are held in memory */
+    pthread_mutex_lock(&queue->lock);
+    while (queue->next < queue->count &&
+           queue->next >= queue->written + queue->window) {
+      pthread_cond_wait(&queue->changed, &queue->lock);
+    }
+    n = queue->next;
+    queue->next = queue->next + 1;
+    if (n >= queue->count) {
+      stage_add(&queue->stages, &timer);
+      pthread_mutex_unlock(&queue->lock);
+      return NULL;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    process_segment(queue, n, &settings);
+
+    pthread_mutex_lock(&queue->lock);
+    queue->segments[n].done = 1;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+  }
+}
+
+/* add the segment first..first+number-1, which was ended by a gap of gap
+ * minutes (0 if it wasn't), to the list, unless it is empty; returns 0 if we
+ * run out of memory */
+int add_segment(struct night_segment **segments, int *count, int *capacity,
+                int first, int number, int gap) {
+  struct night_segment *grown;
+
+  if (number <= 0) {
+    return 1;
+  }
+  if (*count == *capacity) {
+    *capacity = *capacity > 0 ? *capacity * 2 : 256;
+    grown =
+        realloc(*segments, sizeof(struct night_segment) * (size_t)*capacity);
+    if (grown == NULL) {
+      return 0;
+    }
+    *segments = grown;
+  }
+  memset(&(*segments)[*count], 0, sizeof(struct night_segment));
+  (*segments)[*count].first = first;
+  (*segments)[*count].count = number;
+  (*segments)[*count].summary.gap = gap;
+  *count = *count + 1;
+  return 1;
+}
+
+/* Process the rest of the file read by reader (which must be memory-mapped)
+ * on threads threads and write it to fdataout, and to binary, fnights and
+ * index unless they are NULL. Returns 0, having done nothing, if the location
+ * label changes within a .csv file, in which case the file has to be
+ * processed sequentially; otherwise returns 1, with job->failed set if
+ * anything went wrong */
+int process_file_parallel(struct sqm_reader *reader, int threads,
+                          struct sqm_job *job, int is_dat, int record_fields,
+                          const struct dat_header *header,
+                          char *SQM_Location, int timediff_max,
+                          const struct night_settings *settings,
+                          FILE *fdataout, struct binary_output *binary,
+                          FILE *fnights, struct night_index *index) {
+  struct parse_chunk *chunks;
+  struct night_buffer night = {0};
+  struct night_segment *segments = NULL;
+  struct segment_queue queue;
+  pthread_t *workers;
+  struct night_buffer view;
+  struct timespec started, progress_last;
+  const char *data, *split;
+  size_t size, begin, end, length;
+  long long offset;
+  long skipped, lines, k;
+  int n, total, running, count, capacity, first, m, Start, ok, gap;
+
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  progress_last = started;
+  stage_start(settings->timer);
+  data = reader->data + reader->pos;
+  size = reader->size - reader->pos;
+  chunks = calloc((size_t)threads, sizeof(struct parse_chunk));
+  workers = malloc(sizeof(pthread_t) * (size_t)threads);
+  if (chunks == NULL || workers == NULL) {
+    free(chunks);
+    free(workers);
+    return 0;
+  }
+
+  /* 1) split the lines into chunks of about the same size and parse them */
+  begin = 0;
+  for (n = 0; n < threads; n++) {
+    end = size / (size_t)threads * (size_t)(n + 1);
+    if (end < begin) {
+      end = begin;
+    }
+    if (n == threads - 1) {
+      end = size;
+    }
+    if (end > begin && end < size) {
+      /* move the end of the chunk to just after a line ending */
+      split = memchr(data + end - 1, '\n', size - (end - 1));
+      end = split != NULL ? (size_t)(split - data) + 1 : size;
+    }
+    chunks[n].begin = data + begin;
+    chunks[n].size = end - begin;
+    chunks[n].is_dat = is_dat;
+    chunks[n].record_fields = record_fields;
+    chunks[n].header = header;
+    chunks[n].hour_delta = settings->hour_delta;
+    chunks[n].tz = settings->tz;
+    begin = end;
+  }
+  running = 0;
+  while (running < threads && pthread_create(&workers[running], NULL,
+                                             parse_chunk_worker,
+                                             &chunks[running]) == 0) {
+    running = running + 1;
+  }
+  for (n = running; n < threads; n++) {
+    parse_chunk_worker(&chunks[n]);
+  }
+  for (n = 0; n < running; n++) {
+    pthread_join(workers[n], NULL);
+  }
+
+  /* join the chunks into one night buffer for the whole file */
+  ok = 1;
+  total = 0;
+  skipped = 0;
+  first = -1; /* the first chunk with any samples */
+  for (n = 0; n < threads; n++) {
+    ok = ok && !chunks[n].failed;
+    total = total + chunks[n].count;
+    skipped = skipped + chunks[n].skipped;
+    if (chunks[n].count > 0 && !is_dat) {
+      if (first < 0) {
+        first = n;
+      } else if (chunks[n].location_length != chunks[first].location_length ||
+                 memcmp(chunks[n].location, chunks[first].location,
+                        chunks[n].location_length) != 0) {
+        chunks[n].mixed_locations = 1;
+      }
+    }
+    if (chunks[n].mixed_locations) {
+      /* the output records of a day take the location label of the record
+       * read last, so leave it to the sequential loop */
+      for (n = 0; n < threads; n++) {
+        night_buffer_free(&chunks[n].night);
+        free(chunks[n].skipped_lines);
+      }
+      free(chunks);
+      free(workers);
+      return 0;
+    }
+  }
+  if (first >= 0) {
+    if (chunks[first].location_length > 255) {
+      chunks[first].location_length = 255;
+    }
+    memcpy(SQM_Location, chunks[first].location,
+           chunks[first].location_length);
+    SQM_Location[chunks[first].location_length] = '\0';
+  }
+  ok = ok && night_buffer_reserve(&night, total > 0 ? total : 1, 0);
+  total = 0;
+  lines = reader->line; /* the header lines */
+  for (n = 0; n < threads; n++) {
+    if (ok) {
+      night_buffer_move(&night, total, &chunks[n].night, chunks[n].count);
+      total = total + chunks[n].count;
+    }
+    night_buffer_free(&chunks[n].night);
+
+    /* report the lines which could not be read, as the sequential loop does */
+    for (k = 0; k < chunks[n].skipped && chunks[n].skipped_lines != NULL &&
+                k < MAX_SKIPPED_LINES;
+         k++) {
+      log_info("Skipping line %ld of %s: only the first %d of %d fields could "
+               "be read\n",
+               lines + chunks[n].skipped_lines[k].line, job->NameIn,
+               chunks[n].skipped_lines[k].fields, record_fields);
+    }
+    if (chunks[n].skipped > k) {
+      log_info("Skipping %ld more lines of %s which could not be read\n",
+               chunks[n].skipped - k, job->NameIn);
+    }
+    free(chunks[n].skipped_lines);
+    lines = lines + chunks[n].lines;
+  }
+  free(chunks);
+  job->rejected = job->rejected + skipped;
+  stage_mark(settings->timer, STAGE_PARSE);
+
+  /* 2) find the days/segments: this is the ReadAnother/LastDay loop of
+   * process_file with m counted from the start of the file, so that the
+   * sample carried over to the start of the next day is simply the first
+   * sample of the next segment */
+  count = 0;
+  capacity = 0;
+  first = 0;
+  Start = 0;
+  for (m = 0; m < total && ok; m++) {
+    gap = m > first ? time_gap(&night, m) : 0;
+    if (gap > timediff_max) {
+      if (night.dHour[m] < 15) {
+        Start = 3;
+      }
+      ok = add_segment(&segments, &count, &capacity, first, m - first, gap);
+      first = m;
+      if (Start != 3) {
+        Start = 2;
+      }
+      continue;
+    }
+    if (Start == 2 && night.dHour[m] > 15) {
+      Start = 0;
+    }
+    if (Start == 3 && night.dHour[m] == 15) {
+      Start = 0;
+    }
+    if (night.dHour[m] == 15 && Start == 0) {
+      ok = add_segment(&segments, &count, &capacity, first, m - first, 0);
+      first = m;
+      Start = 2;
+    }
+  }
+  ok = ok &&
+       add_segment(&segments, &count, &capacity, first, total - first, 0);
+  for (n = 0; n < count; n++) {
+    job->gaps = job->gaps + (segments[n].summary.gap > 0);
+  }
+  stage_mark(settings->timer, STAGE_SEGMENT);
+
+  /* 3) process the segments on the threads and write them out in order */
+  if (ok) {
+    queue.night = &night;
+    queue.settings = settings;
+    queue.binary = binary;
+    queue.tabulate = fnights != NULL;
+    queue.segments = segments;
+    queue.count = count;
+    queue.next = 0;
+    queue.written = 0;
+    queue.window = 4 * threads;
+    memset(&queue.stages, 0, sizeof(queue.stages));
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.changed, NULL);
+
+    running = 0;
+    while (running < threads &&
+           pthread_create(&workers[running], NULL, segment_worker, &queue) ==
+               0) {
+      running = running + 1;
+    }
+
+    for (n = 0; n < count; n++) {
+      if (running == 0) {
+        /* no threads to be had, so do the work here */
+        process_segment(&queue, n, settings);
+      } else {
+        pthread_mutex_lock(&queue.lock);
+        while (!segments[n].done) {
+          pthread_cond_wait(&queue.changed, &queue.lock);
+        }
+        pthread_mutex_unlock(&queue.lock);
+        stage_start(settings->timer);
+      }
+
+      offset = (long long)ftell(fdataout);
+      length = segments[n].out.length;
+      if (segments[n].failed ||
+          fwrite(segments[n].out.text, 1, segments[n].out.length, fdataout) !=
+              segments[n].out.length ||
+          (fnights != NULL &&
+           fwrite(segments[n].table.text, 1, segments[n].table.length,
+                  fnights) != segments[n].table.length)) {
+        ok = 0;
+      }
+      job->bytes_written =
+          job->bytes_written +
+          (long long)(segments[n].out.length + segments[n].table.length +
+                      segments[n].block.length);
+      text_buffer_free(&segments[n].out);
+      text_buffer_free(&segments[n].table);
+      job->records = job->records + segments[n].count;
+      job->nights = job->nights + 1;
+      job->nodata1 = job->nodata1 + segments[n].summary.nodata1_count;
+      job->nodata2 = job->nodata2 + segments[n].summary.nodata2_count;
+      if (!segments[n].failed) {
+        night_buffer_view(&view, &night, segments[n].first);
+        if (binary != NULL &&
+            !binary_write_night(binary, &segments[n].block, &view,
+                                segments[n].count, &segments[n].summary,
+                                SQM_Location)) {
+          ok = 0;
+        }
+        if (index != NULL &&
+            !index_add_night(index, offset, length, &view, segments[n].count,
+                             SQM_Location)) {
+          ok = 0;
+        }
+        log_night_summary(&view, &segments[n].summary, job->NameIn);
+      }
+      text_buffer_free(&segments[n].block);
+      stage_mark(settings->timer, STAGE_WRITE);
+      log_progress(job, &started, &progress_last);
+
+      pthread_mutex_lock(&queue.lock);
+      queue.written = n + 1;
+      pthread_cond_broadcast(&queue.changed);
+      pthread_mutex_unlock(&queue.lock);
+    }
+
+    for (n = 0; n < running; n++) {
+      pthread_join(workers[n], NULL);
+    }
+    if (settings->timer != NULL) {
+      stage_add(settings->timer, &queue.stages);
+    }
+    pthread_mutex_destroy(&queue.lock);
+    pthread_cond_destroy(&queue.changed);
+  }
+
+  log_info("Processed %d days/segments of %s on %d threads; skipped %ld lines "
+           "which could not be read\n",
+           count, job->NameIn, threads, skipped);
+  if (!ok) {
+    log_error("Ran out of memory, or failed to write the Output Data File\n");
+    job->failed = 1;
+  }
+  free(segments);
+  free(workers);
+  night_buffer_free(&night);
+  return 1;
+}
+
+/* Incremental mode (--incremental). A logger only ever appends to its file,
+ * and the days/segments before the last one of the file are complete: the
+ * samples added later can only change the last one. So after processing a
+ * file we write a checkpoint (_SQM_Attr3.ckpt) saying where the last
+ * day/segment starts in the input and in the output, and the state of the
+ * ReadAnother/LastDay loop at that point. The next run cuts the output back
+ * to the start of that day/segment and carries on reading from there, which
+ * gives exactly the output of a full run. The checkpoint is only used if the
+ * input still holds the same bytes from that point on (checked with a hash),
+ * the output file is the one written with it, and the position and
+ * half_range are the same; otherwise the file is processed in full */
+struct checkpoint {
+  long long input_size;          /* of the input when this was written */
+  unsigned long long input_hash; /* of the input from offset on */
+  long long offset;              /* of the last day/segment in the input */
+  long line;                     /* number of the input line before it */
+  int Start;                     /* the Start flag at its start */
+  int carried;                   /* its first sample was carried over */
+  long long output_offset;       /* of the last day/segment in the output */
+  long long output_size;         /* of the output when this was written */
+  int is_dat, half_range;
+  double lat, lon;
+  int classify, clear_run; /* the classification settings */
+  double clear_RSE_max;
+  int robust, window_minutes, window_samples; /* the RSE settings */
+  char tz[64];                                 /* the time zone, or - */
+  char scales[64]; /* of --scales (see scales_text), or - */
+  unsigned long long registry; /* the hash of the registry, 0 for none */
+};
+
+/* the time zone as it is kept in a checkpoint: its name, or - for none */
+void checkpoint_tz(char *text, size_t size, const char *tz_name) {
+  snprintf(text, size, "%s", tz_name != NULL ? tz_name : "-");
+}
+
+/* read the checkpoint file name; returns 0 if there isn't one we can read */
+int checkpoint_read(const char *name, struct checkpoint *checkpoint) {
+  FILE *file = fopen(name, "r");
+  int version = 0, n;
+
+  if (file == NULL) {
+    return 0;
+  }
+  n = fscanf(file,
+             " SQM_Attr3 checkpoint %d input_size %lld input_hash %llx "
+             "offset %lld line %ld Start %d carried %d output_offset %lld "
+             "output_size %lld is_dat %d half_range %d lat %lf long %lf "
+             "classify %d clear_RSE_max %lf clear_run %d robust %d "
+             "window_minutes %d window_samples %d tz %63s scales %63s "
+             "registry %llx",
+             &version, &checkpoint->input_size, &checkpoint->input_hash,
+             &checkpoint->offset, &checkpoint->line, &checkpoint->Start,
+             &checkpoint->carried, &checkpoint->output_offset,
+             &checkpoint->output_size, &checkpoint->is_dat,
+             &checkpoint->half_range, &checkpoint->lat, &checkpoint->lon,
+             &checkpoint->classify, &checkpoint->clear_RSE_max,
+             &checkpoint->clear_run, &checkpoint->robust,
+             &checkpoint->window_minutes, &checkpoint->window_samples,
+             checkpoint->tz, checkpoint->scales, &checkpoint->registry);
+  fclose(file);
+  return n == 22 && version == 7;
+}
+
+/* write the checkpoint file name, by way of a temporary file so that a
+ * checkpoint is never left half written; returns 0 if it could not be
+ * written */
+int checkpoint_write(const char *name, const struct checkpoint *checkpoint) {
+  char temporary[4096 + 8];
+  FILE *file;
+  int ok;
+
+  snprintf(temporary, sizeof(temporary), "%s.tmp", name);
+  file = fopen(temporary, "w");
+  if (file == NULL) {
+    return 0;
+  }
+  ok = fprintf(file,
+               "SQM_Attr3 checkpoint 7\ninput_size %lld\ninput_hash %llx\n"
+               "offset %lld\nline %ld\nStart %d\ncarried %d\n"
+               "output_offset %lld\noutput_size %lld\nis_dat %d\n"
+               "half_range %d\nlat %.17g\nlong %.17g\nclassify %d\n"
+               "clear_RSE_max %.17g\nclear_run %d\nrobust %d\n"
+               "window_minutes %d\nwindow_samples %d\ntz %s\nscales %s\n"
+               "registry %llx\n",
+               checkpoint->input_size, checkpoint->input_hash,
+               checkpoint->offset, checkpoint->line, checkpoint->Start,
+               checkpoint->carried, checkpoint->output_offset,
+               checkpoint->output_size, checkpoint->is_dat,
+               checkpoint->half_range, checkpoint->lat, checkpoint->lon,
+               checkpoint->classify, checkpoint->clear_RSE_max,
+               checkpoint->clear_run, checkpoint->robust,
+               checkpoint->window_minutes, checkpoint->window_samples,
+               checkpoint->tz, checkpoint->scales, checkpoint->registry) > 0;
+  ok = fclose(file) == 0 && ok;
+  if (!ok || rename(temporary, name) != 0) {
+    remove(temporary);
+    return 0;
+  }
+  return 1;
+}
+
+/* can the checkpoint be used to carry on with the input file read by reader
+ * and the output file NameOut, for this position, half_range and time zone
+ * and the RSE, classification and registry settings of job? */
+int checkpoint_usable(const struct checkpoint *checkpoint,
+                      const struct sqm_reader *reader, const char *NameOut,
+                      const struct sqm_job *job, int is_dat, int half_range,
+                      double lat, double lon, const char *tz_name) {
+  struct stat st;
+  char tz[sizeof(checkpoint->tz)], scales[sizeof(checkpoint->scales)];
+
+  checkpoint_tz(tz, sizeof(tz), tz_name);
+  scales_text(scales, sizeof(scales), job->scale_count, job->scales);
+  return reader->mapped && checkpoint->is_dat == is_dat &&
+         strcmp(checkpoint->tz, tz) == 0 &&
+         strcmp(checkpoint->scales, scales) == 0 &&
+         checkpoint->registry ==
+             (job->registry != NULL ? job->registry->hash : 0) &&
+         checkpoint->half_range == half_range && checkpoint->lat == lat &&
+         checkpoint->lon == lon && checkpoint->robust == job->robust &&
+         checkpoint->window_minutes == job->window_minutes &&
+         (job->window_minutes <= 0 ||
+          checkpoint->window_samples == job->window_samples) &&
+         checkpoint->classify == job->classify &&
+         (!job->classify ||
+          (checkpoint->clear_RSE_max == job->clear_RSE_max &&
+           checkpoint->clear_run == job->clear_run)) &&
+         checkpoint->offset >= (long long)reader->pos &&
+         checkpoint->offset <= checkpoint->input_size &&
+         checkpoint->input_size <= (long long)reader->size &&
+         hash_bytes(reader->data + checkpoint->offset,
+                    (size_t)(checkpoint->input_size - checkpoint->offset)) ==
+             checkpoint->input_hash &&
+         stat(NameOut, &st) == 0 &&
+         (long long)st.st_size == checkpoint->output_size &&
+         checkpoint->output_offset <= checkpoint->output_size;
+}
+
+/* process one input file into its _SQM_Attr3.csv output file; returns 0 if
+ * the file could not be processed */
+int process_file(struct sqm_job *job) {
+  int i = 0, j = 0, m = 0;
+  struct night_buffer night = {0};
+  struct text_buffer out = {0}, block = {0}, table = {0};
+  struct night_settings settings;
+  struct night_summary summary = {0};
+  struct binary_output binary_output;
+  struct binary_output *binary = NULL;
+  FILE *fnights = NULL;
+  struct night_index night_index;
+  struct night_index *index = NULL;
+  long long row_offset;
+  size_t row_length;
+  struct time_zone time_zone = {0};
+  const char *tz_name = job->tz_name;
+  int tz_cursor = 0;
+  struct checkpoint checkpoint, last;
+  struct timespec started, progress_last;
+  const char *NameIn = job->NameIn;
+  const struct compression *compression, *out_compression = NULL;
+  int base_length; /* of NameIn without the suffix of its compression */
+  char NameOut[4096];
+  char NameCheckpoint[4096];
+  char NameIndex[4096 + 8];
+  int resume = 0, carried = 0, to_stdout;
+  long long output_size = 0;
+  char SQM_Location[256];
+  size_t SQM_Location_length = 0;
+  struct sqm_reader reader;
+  const char *line, *location;
+  size_t line_length, location_length;
+  struct dat_header header;
+  const struct station_entry *station = NULL;
+  int is_dat, record_fields;
+  int nfile, length, ret, Start, Last;
+  double SQM_Lat, SQM_Long;
+  int timediff;
+  float remainder;
+  double pi;
+
+  /* NGP is North Galactic Pole, NCP is North Celestial Pole */
+  double RightAscension_NGP, Dec_NGP, Galactic_Long_NCP;
+  long double N;
+  int half_range, timediff_max;
+  long double nodata1, nodata2;
+  long double RSE_mult;
+
+  /* set up a multiplier for the RSE values and no-data output values */
+  /* we output the RSE values multiplied by this constant to give more
+   * manageable values */
+  RSE_mult = 1000.;
+  nodata1 = 999. * RSE_mult;
+  nodata2 = 888. * RSE_mult;
+
+  /* specify the maxiumum number of minutes allowed between SQM samples, prior
+   * to marking a data gap */
+  timediff_max = 16.;
+
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  progress_last = started;
+  log_info(" The input csv filename is: %s\n", NameIn);
+
+  /* the binary output file is named after the input file */
+  if (job->binary && strcmp(NameIn, "-") == 0) {
+    log_error("\n The Binary Output Data File is named after the input file, "
+              "so it can't be written when reading stdin \n");
+    job->failed = 1;
+    return 0;
+  }
+  if (job->night_table && strcmp(NameIn, "-") == 0) {
+    log_error("\n The night table is named after the input file, so it can't "
+              "be written when reading stdin \n");
+    job->failed = 1;
+    return 0;
+  }
+
+  /* Open the input file */
+
+  /* printf("\n About to open the Input Data File");       */
+
+  if (!reader_open(&reader, NameIn)) {
+    log_error("\n Failed to open the Data File \n");
+    job->failed = 1;
+    return 0;
+  }
+  /* printf("\n Opened the Input Data File \n");       */
+
+  /* Read the first header record; a UDM .dat file is recognised by it, and we
+   * then read the rest of its header; for a .csv file we throw it away */
+  SQM_Location[0] = '\0';
+  line = reader_next_line(&reader, &line_length);
+  is_dat = line != NULL && line_length >= strlen(DAT_SIGNATURE) &&
+           memcmp(line, DAT_SIGNATURE, strlen(DAT_SIGNATURE)) == 0;
+  record_fields = 21;
+  if (is_dat) {
+    read_dat_header(&reader, &header);
+    record_fields = 6;
+    strcpy(SQM_Location, header.location);
+    SQM_Location_length = strlen(SQM_Location);
+    log_info(" The input is a UDM .dat file for location %s, timezone %s\n",
+             SQM_Location, header.timezone);
+    if (header.has_cover_offset) {
+      log_info(" The SQM cover offset value %s is taken out of the Msas "
+               "values\n",
+               header.cover_offset);
+    }
+  }
+
+  half_range = job->half_range;
+  if (is_dat && !job->has_position && job->registry != NULL) {
+    station = station_position(job->registry, SQM_Location);
+  }
+  if (job->has_position) {
+    SQM_Lat = job->lat;
+    SQM_Long = job->lon;
+  } else if (station != NULL) {
+    /* the registry knows better than the header */
+    log_info(" The position of the SQM is taken from the station registry\n");
+    SQM_Lat = station->lat;
+    SQM_Long = station->lon;
+  } else {
+    if (!is_dat || !header.has_position) {
+      log_error(" The input file does not give the position of the SQM, so the "
+                "lat and long must be on the command line\n");
+      reader_close(&reader);
+      job->failed = 1;
+      return 0;
+    }
+    SQM_Lat = header.lat;
+    SQM_Long = header.lon;
+  }
+  log_info(" The latitude of the SQM is: %lf\n", SQM_Lat);
+  log_info(" The longitude of the SQM is: %lf\n", SQM_Long);
+  log_info(" The Half Range is: %d\n", half_range);
+
+  /* the time zone, if one is given */
+  if (tz_name != NULL && strcmp(tz_name, "header") == 0) {
+    tz_name = is_dat && header.timezone[0] != '\0' ? header.timezone : NULL;
+    if (tz_name == NULL) {
+      log_error(" The input file does not give its time zone, so it must be "
+                "given with --tz\n");
+      reader_close(&reader);
+      job->failed = 1;
+      return 0;
+    }
+  }
+  if (tz_name != NULL) {
+    if (!time_zone_load(&time_zone, tz_name)) {
+      log_error(" %s is neither a zoneinfo time zone nor a POSIX TZ string\n",
+                tz_name);
+      reader_close(&reader);
+      job->failed = 1;
+      return 0;
+    }
+    log_info(" Local standard time and the nights are worked out for the time "
+             "zone %s, which has %d changes of UTC offset\n",
+             tz_name, time_zone.count - 1);
+  }
+
+  /* Open an output file to hold the output data */
+  /* tack on "SQM_attr" before the .csv */
+
+  /* the records of stdin go to stdout unless told otherwise */
+  if (job->NameOut == NULL && strcmp(NameIn, "-") == 0) {
+    job->NameOut = "-";
+  }
+  /* the output files of a compressed input file are named after it as it
+   * would be uncompressed - data.csv.gz gives data.csv_SQM_Attr3.csv.gz - and
+   * its output is compressed the same way */
+  compression = strcmp(NameIn, "-") != 0 ? file_compression(NameIn) : NULL;
+  base_length = (int)(strlen(NameIn) -
+                      (compression != NULL ? strlen(compression->suffix) : 0));
+  if (snprintf(NameOut, sizeof(NameOut), "%.*s%s%s",
+               job->NameOut != NULL ? (int)strlen(job->NameOut) : base_length,
+               job->NameOut != NULL ? job->NameOut : NameIn,
+               job->NameOut != NULL ? "" : "_SQM_Attr3.csv",
+               job->NameOut == NULL && compression != NULL
+                   ? compression->suffix
+                   : "") >= (int)sizeof(NameOut)) {
+    log_error("\n The Output Data Filename is too long \n");
+    reader_close(&reader);
+    job->failed = 1;
+    return 0;
+  }
+
+  to_stdout = strcmp(NameOut, "-") == 0;
+  if (!to_stdout) {
+    out_compression = file_compression(NameOut);
+  }
+
+  /* the night index gives byte offsets into the .csv file, so it is checked
+   * for before anything is written; an index left by an earlier run would no
+   * longer go with the output, so it is removed */
+  if (job->index && (to_stdout || out_compression != NULL)) {
+    log_error("\n The night index gives where the nights are in the Output "
+              "Data File, so it can't go with standard output or a "
+              "compressed file \n");
+    reader_close(&reader);
+    job->failed = 1;
+    return 0;
+  }
+  if (!to_stdout && out_compression == NULL) {
+    if (!index_name(NameIndex, sizeof(NameIndex), NameOut)) {
+      log_error("\n The Night Index Filename is too long \n");
+      reader_close(&reader);
+      job->failed = 1;
+      return 0;
+    }
+    remove(NameIndex);
+  }
+  log_info("\n The Output Data Filename is %s \n",
+           to_stdout ? "the standard output" : NameOut);
+
+  /* in incremental mode, carry on from the checkpoint of the last run if
+   * there is one that we can use; otherwise a checkpoint left by an earlier
+   * run no longer goes with the output, so it is removed */
+  snprintf(NameCheckpoint, sizeof(NameCheckpoint), "%.*s_SQM_Attr3.ckpt",
+           base_length, NameIn);
+  if (!job->incremental) {
+    if (strcmp(NameIn, "-") != 0) {
+      remove(NameCheckpoint);
+    }
+  } else if (!reader.mapped || to_stdout || out_compression != NULL) {
+    log_info(" Only an uncompressed regular file can be processed "
+             "incrementally, into an uncompressed regular file, so all of it "
+             "is processed\n");
+  } else if (job->binary) {
+    log_info(" The binary output file is always written in full, so all of "
+             "the input is processed\n");
+  } else if (job->night_table) {
+    log_info(" The night table is always written in full, so all of the input "
+             "is processed\n");
+  } else if (job->index) {
+    log_info(" The night index is always written in full, so all of the input "
+             "is processed\n");
+  } else if (checkpoint_read(NameCheckpoint, &checkpoint)) {
+    resume = checkpoint_usable(&checkpoint, &reader, NameOut, job, is_dat,
+                               half_range, SQM_Lat, SQM_Long, tz_name);
+    if (!resume) {
+      log_info(" The checkpoint %s does not match the input and output files, "
+               "so all of the input is processed\n",
+               NameCheckpoint);
+    }
+  }
+
+  /* when carrying on, the output of the last day/segment is cut off, to be
+   * written again with the samples added since */
+  FILE *fdataout = NULL;
+  if (resume) {
+    fdataout = fopen(NameOut, "r+");
+    if (fdataout != NULL &&
+        (ftruncate(fileno(fdataout), (off_t)checkpoint.output_offset) != 0 ||
+         fseek(fdataout, 0, SEEK_END) != 0)) {
+      fclose(fdataout);
+      fdataout = NULL;
+    }
+  } else if (to_stdout) {
+    fdataout = stdout;
+  } else if (out_compression != NULL) {
+    fdataout = compression_open(out_compression->compress, NameOut, "w");
+  } else {
+    fdataout = fopen(NameOut, "w");
+  }
+  if (fdataout == NULL) {
+    log_error("\n Failed to open the Output Data File \n");
+    reader_close(&reader);
+    job->failed = 1;
+    return 0;
+  }
+
+  /* printf("\n Opened the Output Data File \n");       */
+
+  /* half_range is the number of samples (usually 5 minutes apart) to include
+   * before and after the current point at which the Residual Standard Error of
+   * regression calculation is performed; the full width of the interval in
+   * terms of number of points to consider in the calculation is (2*half_range +
+   * 1) so that a half_range of 6 incorporates a total range of 60 minutes; note
+   * that we don't increment by one in the minutes calculation for the middle
+   * point in the time range because it is already taken into account half_range
+   * of 9 evaluates to a 90 minute range
+   */
+  N = (long double)((2 * half_range) + 1.);
+
+  log_info(" \n");
+  if (job->window_minutes > 0) {
+    log_info(" The Residual Error calculation operates over the samples within "
+             "%d minutes either side of each sample, a range of %d minutes, "
+             "whatever the sample spacing, as long as there are at least %d "
+             "of them; the half_range parameter is not used.\n",
+             job->window_minutes, job->window_minutes * 2,
+             job->window_samples > 3 ? job->window_samples : 3);
+  } else {
+    log_info(" The half_range parameter is set to: %d\n", half_range);
+    log_info(" This means that the Residual Error calculation operates over %d "
+             "samples\n",
+             (int)N);
+    log_info(" In other words, if the sample spacing is 1 minute, then the "
+             "range is %d minutes.\n",
+             (int)half_range * 2 * 1);
+    log_info("                 if the sample spacing is 5 minutes, then the "
+             "range is %d minutes.\n",
+             (int)half_range * 2 * 5);
+    log_info(" Or              if the sample spacing is 15 minutes, then the "
+             "range is %d minutes.\n",
+             (int)half_range * 2 * 15);
+  }
+  log_info(" \n");
+  log_info(" \n");
+  log_info(" Residual Standard Error values that we output are multiplied by "
+           "%d to achieve larger values.\n",
+           (int)RSE_mult);
+  if (job->robust) {
+    log_info(" The regression lines are fitted robustly, and the RSE is the "
+             "scale of their median absolute residual\n");
+  }
+  if (job->scale_count > 0) {
+    char scales[64];
+
+    scales_text(scales, sizeof(scales), job->scale_count, job->scales);
+    log_info(" The RSE is also worked out with %s of %s, in a column for "
+             "each\n",
+             job->window_minutes > 0 ? "windows in minutes" : "half_ranges",
+             scales);
+  }
+  log_info(" \n");
+  log_info(" We allow gaps of %d minutes between SQM samples prior to marking "
+           "a data gap.\n",
+           timediff_max);
+  log_info(" \n");
+
+  /* Write a header record to the output file */
+
+  if (!resume) {
+    length = fprintf(
+        fdataout,
+        "Location,Lat,Long,UTC_Date,UTC_Time,Local_Date,Local_Time,Celsius,"
+        "Volts,Msas,Status,MoonPhase,MoonElev,MoonIllum,SunElev,"
+        "MinSince3pmStdTime,Msas_Avg,NightsSince_1118,RightAscensionHr,"
+        "Galactic_Lat,Galactic_Long,J2000days,ResidStdErr%s",
+        job->classify ? ",Clear,Msas_Avg_Clear" : "");
+    job->bytes_written = job->bytes_written + (length > 0 ? length : 0);
+    /* ResidStdErr_6 for a half_range of 6, ResidStdErr_30min for a window
+     * of 30 minutes */
+    for (i = 0; i < job->scale_count; i++) {
+      length = fprintf(fdataout, ",ResidStdErr_%d%s", job->scales[i],
+                       job->window_minutes > 0 ? "min" : "");
+      job->bytes_written = job->bytes_written + (length > 0 ? length : 0);
+    }
+    length = fprintf(fdataout, "%s\n",
+                     job->registry != NULL ? ",Msas_Corr" : "");
+    job->bytes_written = job->bytes_written + (length > 0 ? length : 0);
+  }
+
+  /* set up some constant values used later to calculate the Galactic
+   * Coordinates of the normal at the SQM location */
+  /* These are from the Wikipedia Celestial coordinate system  */
+  pi = 3.14159265359;
+
+  /* convert these constants from degrees to radians */
+
+  RightAscension_NGP = 192.85948 * (pi) / 180.;
+  log_debug("RightAscension_NGP=%lf \n", RightAscension_NGP);
+
+  Dec_NGP = 27.12825 * (pi) / 180.;
+  log_debug("Dec_NGP=%lf \n", Dec_NGP);
+
+  Galactic_Long_NCP = 122.93192 * (pi) / 180.;
+  log_debug("Galactic_Long_NCP=%lf \n", Galactic_Long_NCP);
+
+  settings.SQM_Location = SQM_Location;
+  settings.SQM_Lat = SQM_Lat;
+  settings.SQM_Long = SQM_Long;
+  settings.hour_delta = standard_hour_delta(SQM_Long);
+  settings.tz = tz_name != NULL ? &time_zone : NULL;
+  settings.half_range = half_range;
+  settings.is_dat = is_dat;
+  settings.RSE_mult = RSE_mult;
+  settings.nodata1 = nodata1;
+  settings.nodata2 = nodata2;
+  settings.pi = pi;
+  settings.RightAscension_NGP = RightAscension_NGP;
+  settings.Dec_NGP = Dec_NGP;
+  settings.Galactic_Long_NCP = Galactic_Long_NCP;
+  settings.classify = job->classify;
+  settings.clear_RSE_max = job->clear_RSE_max;
+  settings.clear_run = job->clear_run;
+  settings.robust = job->robust;
+  settings.window_minutes = job->window_minutes;
+  settings.window_samples = job->window_samples;
+  settings.registry = job->registry;
+  settings.scale_count = job->scale_count;
+  memcpy(settings.scales, job->scales, sizeof(settings.scales));
+  settings.timer = job->timed ? &job->stages : NULL;
+
+  /* the binary output file, if asked for, goes next to the .csv one */
+  if (job->binary) {
+    snprintf(NameOut, sizeof(NameOut), "%.*s_SQM_Attr3.sqmb", base_length,
+             NameIn);
+    log_info(" The Binary Output Data Filename is %s \n", NameOut);
+    if (strlen(NameOut) != (size_t)base_length + strlen("_SQM_Attr3.sqmb") ||
+        !binary_open(&binary_output, NameOut, &settings)) {
+      log_error("\n Failed to open the Binary Output Data File \n");
+      job->failed = 1;
+      goto Termination;
+    }
+    binary = &binary_output;
+  }
+
+  /* and so does the night table */
+  if (job->night_table) {
+    snprintf(NameOut, sizeof(NameOut), "%.*s_SQM_Nights.csv", base_length,
+             NameIn);
+    log_info(" The Night Table Filename is %s \n", NameOut);
+    if (strlen(NameOut) != (size_t)base_length + strlen("_SQM_Nights.csv") ||
+        (fnights = fopen(NameOut, "w")) == NULL) {
+      log_error("\n Failed to open the Night Table File \n");
+      job->failed = 1;
+      goto Termination;
+    }
+    fprintf(fnights, NIGHT_TABLE_HEADER "%s\n",
+            job->classify ? ",Clear_Samples,Clear_Fraction,Msas_Avg_Clear"
+                          : "");
+  }
+
+  /* and the night index, which gives byte offsets into the .csv file */
+  if (job->index) {
+    if (!index_open(&night_index, NameIndex)) {
+      log_error("\n Failed to open the Night Index File \n");
+      job->failed = 1;
+      goto Termination;
+    }
+    log_info(" The Night Index Filename is %s \n", NameIndex);
+    index = &night_index;
+  }
+
+  /* a long file may be spread over several threads, unless we are to keep a
+   * checkpoint */
+  if (job->threads > 1 && reader.mapped && !job->incremental &&
+      process_file_parallel(&reader, job->threads, job, is_dat, record_fields,
+                            &header, SQM_Location, timediff_max, &settings,
+                            fdataout, binary, fnights, index)) {
+    goto Termination;
+  }
+
+  stage_start(settings.timer);
+
+  /* Read the data file */
+  /* initiate the record counter */
+  m = -1;
+
+  /* initiate the flag on 15 hundred hour */
+  Start = 0;
+
+  /* where the first day/segment starts, for the checkpoint; when carrying on
+   * from a checkpoint, it is where we carry on from */
+  last.offset = (long long)reader.pos;
+  last.line = reader.line;
+  last.Start = Start;
+  last.carried = 0;
+  last.output_offset = (long long)ftell(fdataout);
+  if (resume) {
+    last = checkpoint;
+    reader.pos = (size_t)checkpoint.offset;
+    reader.line = checkpoint.line;
+    Start = checkpoint.Start;
+    carried = checkpoint.carried;
+    log_info(" Carrying on from line %ld of %s, where the last day/segment of "
+             "the last run started\n",
+             reader.line + 1, NameIn);
+  }
+
+/* increment the counter */
+ReadAnother:
+  stage_mark(settings.timer, STAGE_SEGMENT);
+  m = m + 1;
+  /* printf("m=%d \n", m); */
+  /* make room for this sample, keeping the samples of the day so far */
+  if (!night_buffer_reserve(&night, m + 1, m)) {
+    log_error("Ran out of memory holding %d samples for this day.\n", m + 1);
+    log_error("Premature end of processing! \n");
+    job->failed = 1;
+    goto Termination;
+  }
+
+  /* skip any blank lines, and comment lines in a .dat file */
+  do {
+    line = reader_next_line(&reader, &line_length);
+    while (line != NULL && line_length > 0 &&
+           (line[line_length - 1] == ' ' || line[line_length - 1] == '\t')) {
+      line_length = line_length - 1;
+    }
+  } while (line != NULL && (line_length == 0 || (is_dat && line[0] == '#')));
+
+  /* if we reach the end of the input file, proceed to write out the data of the
+   * last day before terminating */
+  if (line == NULL) {
+    ret = EOF;
+    goto LastDay;
+  }
+
+  if (is_dat) {
+    ret = parse_dat_record(line, line_length, &night, m, &header);
+  } else {
+    ret = parse_csv_record(line, line_length, &night, m, &location,
+                           &location_length);
+  }
+  stage_mark(settings.timer, STAGE_PARSE);
+  log_trace("record returned %d fields  m=%d \n", ret, m);
+  if (ret < record_fields) {
+    /* if here, the data record was short of values and therefore considered
+     * bad. Report it, skip this point and read another */
+    log_info("Skipping line %ld of %s: only the first %d of %d fields could be "
+             "read\n",
+             reader.line, NameIn, ret, record_fields);
+    job->rejected = job->rejected + 1;
+    m = m - 1;
+    goto ReadAnother;
+  }
+
+  /* keep a copy of the location label, which only needs updating if it
+   * changes */
+  if (!is_dat && (location_length != SQM_Location_length ||
+                  memcmp(location, SQM_Location, location_length) != 0)) {
+    if (location_length > sizeof(SQM_Location) - 1) {
+      location_length = sizeof(SQM_Location) - 1;
+    }
+    memcpy(SQM_Location, location, location_length);
+    SQM_Location[location_length] = '\0';
+    SQM_Location_length = location_length;
+  }
+
+  /*  Calculate the number of minutes since Local time 3PM for the time
+   * associated with this SQM record */
+  calc_minutes_since_3pm(&night, m, settings.hour_delta, settings.tz,
+                         &tz_cursor);
+
+  /* when carrying on from a checkpoint with a sample which was carried over
+   * from the day before, that sample has been dealt with already */
+  if (carried) {
+    carried = 0;
+    goto ReadAnother;
+  }
+
+  /* check whether we have reached a gap in the input data time - i.e. is this
+   * data point more than the specified maximum gap length in minutes beyond the
+   * last data point? */
+  if (m > 0) {
+    timediff = time_gap(&night, m);
+    if (timediff > timediff_max) {
+      /* if here, we have found a time gap in the data - consider the data so
+       * far for this day to be all that there is */
+      log_debug(
+          "Found a %d minute gap in the data just after %d-%d-%d %d:%d:%d\n",
+          timediff, night.dYear[m - 1], night.dMonth[m - 1], night.dDay[m - 1],
+          night.dHour[m - 1], night.dMinute[m - 1], (int)night.dSeconds[m - 1]);
+      /* handle the case of a patch of data after a data gap during the daytime
+       * and prior to 15:00.  */
+      if (night.dHour[m] < 15) {
+        /* set Start flag to 3, which we check later to loop appropriately */
+        Start = 3;
+      }
+      summary.gap = timediff;
+      job->gaps = job->gaps + 1;
+      /* so jump into the loop which calculates the second derivatives, etc and
+       * writes out the data to the output file for the data prior to this data
+       * gap */
+      goto LastDay;
+    }
+  }
+
+  /* reset the Start flag if we are already past the first day of data and if we
+   * have gone beyond the 15 hundred hour */
+  if (Start == 2) {
+    if (night.dHour[m] > 15) {
+      Start = 0;
+    }
+  }
+
+  /* reset the Start flag if we are already past the first day of data and if we
+   * have reached 15 hundred hour */
+  /* for the case of a partial day due to a data gap prior to 15:00 */
+  if (Start == 3) {
+    if (night.dHour[m] == 15) {
+      Start = 0;
+    }
+  }
+
+  /* We copy data for each day into memory, beginning at 15:00 hours and going
+   * all evening, night, morning to the next afternoon */
+  /* We use a flag called Start to handle reading all the other samples acquired
+   * at the beginning of the day, samples which were acquired when the hour was
+   * still 15. */
+
+  /* Check to see if we reached 15:00 hours on this day; we assume that the data
+   * are ordered in time sequence */
+  if (night.dHour[m] == 15 && Start == 0) {
+  /* the last sample of the previous day was m-1, so we know that the previous
+   * day has values in the arrays from 0 to m-1 */
+  LastDay:
+    stage_mark(settings.timer, STAGE_SEGMENT);
+    Last = m - 1;
+
+    /* work out the attributes of this day's samples and write them to the
+     * output file */
+    if (!process_night(&night, Last + 1, &settings, &out,
+                       binary != NULL ? &block : NULL,
+                       fnights != NULL ? &table : NULL, &summary)) {
+      log_error("Ran out of memory writing out %d samples for this day.\n",
+                Last + 1);
+      log_error("Premature end of processing! \n");
+      job->failed = 1;
+      goto Termination;
+    }
+    row_offset = (long long)ftell(fdataout);
+    row_length = out.length;
+    if (out.length > 0 &&
+        fwrite(out.text, 1, out.length, fdataout) != out.length) {
+      log_error("Failed to write to the Output Data File \n");
+      job->failed = 1;
+      goto Termination;
+    }
+    job->bytes_written =
+        job->bytes_written + (long long)(out.length + block.length +
+                                         table.length);
+    out.length = 0;
+
+    /* on stdout, each day is passed on down the pipe as soon as it is done */
+    if (to_stdout && fflush(fdataout) != 0) {
+      log_error("Failed to write to the standard output \n");
+      job->failed = 1;
+      goto Termination;
+    }
+    if (binary != NULL &&
+        !binary_write_night(binary, &block, &night, Last + 1, &summary,
+                            SQM_Location)) {
+      log_error("Failed to write to the Binary Output Data File \n");
+      job->failed = 1;
+      goto Termination;
+    }
+    block.length = 0;
+    if (fnights != NULL && table.length > 0 &&
+        fwrite(table.text, 1, table.length, fnights) != table.length) {
+      log_error("Failed to write to the Night Table File \n");
+      job->failed = 1;
+      goto Termination;
+    }
+    table.length = 0;
+    if (index != NULL &&
+        !index_add_night(index, row_offset, row_length, &night, Last + 1,
+                         SQM_Location)) {
+      log_error("Ran out of memory for the Night Index \n");
+      job->failed = 1;
+      goto Termination;
+    }
+    stage_mark(settings.timer, STAGE_WRITE);
+    if (Last >= 0) {
+      job->records = job->records + Last + 1;
+      job->nights = job->nights + 1;
+      job->nodata1 = job->nodata1 + summary.nodata1_count;
+      job->nodata2 = job->nodata2 + summary.nodata2_count;
+      log_night_summary(&night, &summary, NameIn);
+      log_progress(job, &started, &progress_last);
+    }
+    summary.gap = 0;
+
+    /* if we are at the EOF, we have already written out the last day's data, so
+     * terminate */
+    if (ret == EOF) {
+      goto Termination;
+    }
+
+    /* if here, we have written out all of the day's attributes, so keep the
+     * very last record and proceed to read the next record */
+    night_buffer_copy(&night, 0, m);
+
+    /* m is incremented above, so set it to zero here; this avoids writing over
+     * the data we just stored at location zero */
+    m = 0;
+
+    /* the next day/segment starts with this sample; remember where, for the
+     * checkpoint */
+    last.offset = (long long)(line - reader.data);
+    last.line = reader.line - 1;
+    last.Start = Start == 3 ? 3 : 2;
+    last.carried = 1;
+    last.output_offset = (long long)ftell(fdataout);
+
+    if (Start == 3) {
+      /* if here, we have a case of a partial day of data after a data gap and
+       * prior to 15:00 in the day */
+      goto ReadAnother;
+    } else {
+
+      /* set the flag to direct all the next samples acquired in the "15"
+       * hundred hour into a new day */
+      Start = 2;
+    }
+    goto ReadAnother;
+  }
+  goto ReadAnother;
+
+/* if here, we have reached the end of the input file */
+Termination:
+  log_info(" Reached the End of File");
+  job->bytes_read = reader.mapped ? (long long)reader.size -
+                                        (resume ? checkpoint.offset : 0)
+                                  : reader.total;
+  if (job->incremental && reader.mapped && !job->failed) {
+    last.input_size = (long long)reader.size;
+    last.input_hash = hash_bytes(reader.data + last.offset,
+                                 reader.size - (size_t)last.offset);
+    output_size = (long long)ftell(fdataout);
+  }
+  if (index != NULL && !job->failed &&
+      !index_close(index, (long long)ftell(fdataout))) {
+    log_error("\n Failed to write the Night Index File \n");
+    job->failed = 1;
+  } else if (index != NULL && job->failed) {
+    fclose(index->file);
+    free(index->nights);
+    text_buffer_free(&index->stations.text);
+    remove(NameIndex);
+  }
+  if (!reader_close(&reader)) {
+    log_error("\n The Data File could not be read to the end, or could not be "
+              "decompressed \n");
+    job->failed = 1;
+  }
+  if ((to_stdout            ? fflush(fdataout)
+       : out_compression != NULL ? pclose(fdataout)
+                                 : fclose(fdataout)) != 0) {
+    job->failed = 1;
+  }
+
+  /* keep the checkpoint for the next run */
+  if (job->incremental && reader.mapped && !job->failed) {
+    last.output_size = output_size;
+    last.is_dat = is_dat;
+    last.half_range = half_range;
+    last.lat = SQM_Lat;
+    last.lon = SQM_Long;
+    last.classify = job->classify;
+    last.clear_RSE_max = job->clear_RSE_max;
+    last.clear_run = job->clear_run;
+    last.robust = job->robust;
+    last.window_minutes = job->window_minutes;
+    last.window_samples = job->window_samples;
+    checkpoint_tz(last.tz, sizeof(last.tz), tz_name);
+    scales_text(last.scales, sizeof(last.scales), job->scale_count,
+                job->scales);
+    last.registry = job->registry != NULL ? job->registry->hash : 0;
+    if (!checkpoint_write(NameCheckpoint, &last)) {
+      log_error("\n Failed to write the checkpoint %s \n", NameCheckpoint);
+      job->failed = 1;
+    }
+  }
+  if (binary != NULL && !binary_close(binary)) {
+    log_error("\n Failed to write the Binary Output Data File \n");
+    job->failed = 1;
+  }
+  if (fnights != NULL && fclose(fnights) != 0) {
+    log_error("\n Failed to write the Night Table File \n");
+    job->failed = 1;
+  }
+  night_buffer_free(&night);
+  text_buffer_free(&out);
+  text_buffer_free(&block);
+  text_buffer_free(&table);
+  time_zone_free(&time_zone);
+  job->seconds = seconds_since(&started);
+  return !job->failed;
+}
+
+/* Batch mode: the files listed in a manifest are independent of each other,
+ * so they are handed out one at a time to a pool of worker threads, each of
+ * which writes its own output file */
+struct batch_queue {
+  struct sqm_job *jobs;
+  int count;
+  int next; /* the next job to hand out */
+  pthread_mutex_t lock;
+};
+
+void *batch_worker(void *arg) {
+  struct batch_queue *queue = arg;
+  int n;
+
+  for (;;) {
+    pthread_mutex_lock(&queue->lock);
+    n = queue->next;
+    queue->next = queue->next + 1;
+    pthread_mutex_unlock(&queue->lock);
+    if (n >= queue->count) {
+      return NULL;
+    }
+    process_file(&queue->jobs[n]);
+  }
+}
+
+/* read the manifest: one input file per line, then either the lat, long and
+ * half_range or just the half_range, separated by commas; blank lines and
+ * lines starting with # are skipped. A line which is none of these is
+ * reported and counted in *bad, as a file which could not be processed.
+ * Returns the number of jobs, or -1 */
+int read_manifest(const char *name, struct sqm_job **jobs, int *bad) {
+  struct sqm_reader reader;
+  const char *line, *field[5];
+  size_t length, field_length[5];
+  int count, capacity, nfields, ok, i;
+  struct sqm_job job, *grown;
+  char *job_name;
+
+  *jobs = NULL;
+  *bad = 0;
+  if (!reader_open(&reader, name)) {
+    log_error(" Failed to open the manifest %s\n", name);
+    return -1;
+  }
+
+  count = 0;
+  capacity = 0;
+  while ((line = reader_next_line(&reader, &length)) != NULL) {
+    trim_blanks(&line, &length);
+    if (length == 0 || line[0] == '#') {
+      continue;
+    }
+
+    /* split the line at the commas; a fifth field means too many */
+    nfields = split_fields(line, length, field, field_length, 5);
+    for (i = 0; i < nfields; i++) {
+      trim_blanks(&field[i], &field_length[i]);
+    }
+    memset(&job, 0, sizeof(job));
+    job.threads = 1;
+    ok = field_length[0] > 0 && (nfields == 2 || nfields == 4);
+    if (ok && nfields == 4) {
+      job.has_position = 1;
+      ok = convert_double(field[1], field_length[1], &job.lat) &&
+           convert_double(field[2], field_length[2], &job.lon);
+    }
+    if (ok) {
+      ok = convert_int(field[nfields - 1], field_length[nfields - 1],
+                       &job.half_range) &&
+           job.half_range >= 0;
+    }
+    if (!ok) {
+      log_error(" Skipping line %ld of the manifest %s: expected a file name "
+                "followed by the lat, long and half_range, or by the "
+                "half_range, separated by commas\n",
+                reader.line, name);
+      *bad = *bad + 1;
+      continue;
+    }
+
+    if (count == capacity) {
+      capacity = capacity > 0 ? capacity * 2 : 64;
+      grown = realloc(*jobs, sizeof(struct sqm_job) * (size_t)capacity);
+      if (grown == NULL) {
+        break;
+      }
+      *jobs = grown;
+    }
+    job_name = malloc(field_length[0] + 1);
+    if (job_name == NULL) {
+      break;
+    }
+    memcpy(job_name, field[0], field_length[0]);
+    job_name[field_length[0]] = '\0';
+    job.NameIn = job_name;
+    (*jobs)[count] = job;
+    count = count + 1;
+  }
+  ok = reader_close(&reader);
+
+  if (line != NULL || !ok) {
+    if (line != NULL) {
+      log_error(" Ran out of memory reading the manifest %s\n", name);
+    } else {
+      log_error(" Failed to read the manifest %s\n", name);
+    }
+    while (count > 0) {
+      count = count - 1;
+      free((char *)(*jobs)[count].NameIn);
+    }
+    free(*jobs);
+    *jobs = NULL;
+    return -1;
+  }
+  return count;
+}
+
+/* write text to file as a JSON string, quotes and all */
+void json_string(FILE *file, const char *text) {
+  const unsigned char *c;
+
+  fputc('"', file);
+  for (c = (const unsigned char *)text; *c != '\0'; c++) {
+    if (*c == '"' || *c == '\\') {
+      fprintf(file, "\\%c", *c);
+    } else if (*c < 0x20) {
+      fprintf(file, "\\u%04x", *c);
+    } else {
+      fputc(*c, file);
+    }
+  }
+  fputc('"', file);
+}
+
+/* write the counters and stage timings of a job to file as a JSON object */
+void json_counters(FILE *file, const struct sqm_job *job, double seconds,
+                   const char *indent) {
+  int k;
+
+  fprintf(file,
+          "%s\"records_read\": %ld,\n%s\"records_rejected\": %ld,\n"
+          "%s\"records_written\": %ld,\n%s\"nights\": %d,\n"
+          "%s\"gaps\": %ld,\n%s\"rse_nodata1\": %ld,\n"
+          "%s\"rse_nodata2\": %ld,\n%s\"bytes_read\": %lld,\n"
+          "%s\"bytes_written\": %lld,\n%s\"seconds\": %.6f,\n"
+          "%s\"records_per_second\": %.0f,\n%s\"stages\": {",
+          indent, job->records + job->rejected, indent, job->rejected, indent,
+          job->records, indent, job->nights, indent, job->gaps, indent,
+          job->nodata1, indent, job->nodata2, indent, job->bytes_read, indent,
+          job->bytes_written, indent, seconds, indent,
+          seconds > 0.0 ? job->records / seconds : 0.0, indent);
+  for (k = 0; k < STAGE_COUNT; k++) {
+    fprintf(file, "%s\"%s\": %.6f", k > 0 ? ", " : "", stage_names[k],
+            job->stages.seconds[k]);
+  }
+  fprintf(file, "}");
+}
+
+/* The run report (--report name.json): what was done to each of the count
+ * jobs - the records read, rejected and written, the nights, the gaps which
+ * ended a day/segment, the RSE values of nodata1 and nodata2, the bytes read
+ * and written and the time taken by each stage - and the totals over all of
+ * them, which took seconds, so that a run can be checked and compared with
+ * another by a program; returns 0 if the report could not be written */
+int write_report(const char *name, const struct sqm_job *jobs, int count,
+                 double seconds) {
+  struct sqm_job total;
+  FILE *file;
+  int n, failures = 0;
+
+  memset(&total, 0, sizeof(total));
+  for (n = 0; n < count; n++) {
+    total.records = total.records + jobs[n].records;
+    total.nights = total.nights + jobs[n].nights;
+    total.rejected = total.rejected + jobs[n].rejected;
+    total.gaps = total.gaps + jobs[n].gaps;
+    total.nodata1 = total.nodata1 + jobs[n].nodata1;
+    total.nodata2 = total.nodata2 + jobs[n].nodata2;
+    total.bytes_read = total.bytes_read + jobs[n].bytes_read;
+    total.bytes_written = total.bytes_written + jobs[n].bytes_written;
+    stage_add(&total.stages, &jobs[n].stages);
+    failures = failures + (jobs[n].failed != 0);
+  }
+
+  file = fopen(name, "w");
+  if (file == NULL) {
+    log_error(" Failed to open the report file %s\n", name);
+    return 0;
+  }
+  fprintf(file, "{\n  \"files\": %d,\n  \"failures\": %d,\n", count,
+          failures);
+  json_counters(file, &total, seconds, "  ");
+  fprintf(file, ",\n  \"jobs\": [");
+  for (n = 0; n < count; n++) {
+    fprintf(file, "%s\n    {\n      \"file\": ", n > 0 ? "," : "");
+    json_string(file, jobs[n].NameIn);
+    fprintf(file, ",\n      \"failed\": %s,\n",
+            jobs[n].failed ? "true" : "false");
+    json_counters(file, &jobs[n], jobs[n].seconds, "      ");
+    fprintf(file, "\n    }");
+  }
+  fprintf(file, "%s]\n}\n", count > 0 ? "\n  " : "");
+  if (fclose(file) != 0) {
+    log_error(" Failed to write the report file %s\n", name);
+    return 0;
+  }
+  return 1;
+}
+
+/* process every file of the manifest on threads threads (0 for one per
+ * processor), with the binary, incremental and classification settings of
+ * options, then print a summary, and write a report to report unless it is
+ * NULL; returns 0 if any file failed */
+int run_batch(const char *manifest, int threads,
+              const struct sqm_job *options, const char *report) {
+  struct batch_queue queue;
+  pthread_t *workers;
+  struct timespec started, finished;
+  double seconds;
+  long records;
+  int nights, failures, bad, n, running;
+
+  queue.count = read_manifest(manifest, &queue.jobs, &bad);
+  if (queue.count < 0) {
+    return 0;
+  }
+  for (n = 0; n < queue.count; n++) {
+    queue.jobs[n].binary = options->binary;
+    queue.jobs[n].incremental = options->incremental;
+    queue.jobs[n].classify = options->classify;
+    queue.jobs[n].clear_RSE_max = options->clear_RSE_max;
+    queue.jobs[n].clear_run = options->clear_run;
+    queue.jobs[n].night_table = options->night_table;
+    queue.jobs[n].index = options->index;
+    queue.jobs[n].robust = options->robust;
+    queue.jobs[n].window_minutes = options->window_minutes;
+    queue.jobs[n].window_samples = options->window_samples;
+    queue.jobs[n].tz_name = options->tz_name;
+    queue.jobs[n].registry = options->registry;
+    queue.jobs[n].scale_count = options->scale_count;
+    memcpy(queue.jobs[n].scales, options->scales, sizeof(options->scales));
+    queue.jobs[n].timed = report != NULL;
+    queue.jobs[n].progress = options->progress;
+  }
+  queue.next = 0;
+  pthread_mutex_init(&queue.lock, NULL);
+
+  if (threads <= 0) {
+    threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (threads > queue.count) {
+    threads = queue.count;
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  workers = malloc(sizeof(pthread_t) * (size_t)threads);
+  running = 0;
+  if (workers != NULL) {
+    while (running < threads &&
+           pthread_create(&workers[running], NULL, batch_worker, &queue) ==
+               0) {
+      running = running + 1;
+    }
+  }
+  if (running == 0) {
+    /* no threads to be had, so work through the files on this one */
+    batch_worker(&queue);
+  }
+  for (n = 0; n < running; n++) {
+    pthread_join(workers[n], NULL);
   }
+  clock_gettime(CLOCK_MONOTONIC, &finished);
+  free(workers);
+  pthread_mutex_destroy(&queue.lock);
 
-  /* assignment to an integer will cause truncation of the remainder in the
-   * following statement, as desired */
-  dHour_Delta = abs(SQM_Long) / 15. * dPosNeg;
-  dShift_Hour = dUHour[m] + dHour_Delta;
+  seconds = (finished.tv_sec - started.tv_sec) +
+            (finished.tv_nsec - started.tv_nsec) / 1.0e9;
+  records = 0;
+  nights = 0;
+  /* the lines of the manifest which could not be read count as failures */
+  failures = bad;
+  for (n = 0; n < queue.count; n++) {
+    records = records + queue.jobs[n].records;
+    nights = nights + queue.jobs[n].nights;
+    if (queue.jobs[n].failed) {
+      log_error(" Failed to process %s\n", queue.jobs[n].NameIn);
+      failures = failures + 1;
+    }
+  }
+  printf(" Processed %d files on %d threads in %.2f seconds: %ld records "
+         "(%.0f records per second), %d nights, %d failures\n",
+         queue.count, running > 0 ? running : 1, seconds, records,
+         seconds > 0.0 ? records / seconds : 0.0, nights, failures);
+  if (report != NULL &&
+      !write_report(report, queue.jobs, queue.count, seconds)) {
+    failures = failures + 1;
+  }
 
-  printf(" dPosNeg= %d\n", dPosNeg);
-  printf(" dHour_Delta= %d\n", dHour_Delta);
-  printf(" dShift_Hour= %d\n", dShift_Hour);
+  for (n = 0; n < queue.count; n++) {
+    free((char *)queue.jobs[n].NameIn);
+  }
+  free(queue.jobs);
+  return failures == 0;
+}
 
-  if (dShift_Hour > 14) {
-    minutes_since_3pm[m] =
-        (dShift_Hour - 15) * 60 + dUMinute[m] + (int)(dUSeconds[m] / 60. + 0.5);
-  } else {
-    minutes_since_3pm[m] =
-        540 + dShift_Hour * 60 + dUMinute[m] + (int)(dUSeconds[m] / 60. + 0.5);
+/* Benchmark of the RSE calculations (--bench-rse half_range): the least
+ * squares and robust RSE of bench_nights synthetic nights of 1-minute samples
+ * - a smooth sky with 0.01 magnitude steps of noise, passing clouds on one
+ * night in three, and a bright spike (a satellite or headlight) about one
+ * sample in 200 - are timed, and the spread of the RSE values of the clear
+ * nights shows how much the spikes disturb each */
+int bench_rse(int half_range) {
+  const int bench_nights = 500, samples = 600;
+  int *minutes = malloc(sizeof(int) * (size_t)samples);
+  float *dMsas = malloc(sizeof(float) * (size_t)samples);
+  long double *RSE = malloc(sizeof(long double) * (size_t)samples);
+  double *scratch = malloc(sizeof(double) * (size_t)samples);
+  int *window = malloc(sizeof(int) * 2 * (size_t)samples);
+  double *clear[2], seconds[2], noise;
+  int count[2] = {0, 0}, night, k, method;
+  unsigned long long state = 88172645463325252ULL;
+  struct timespec started, finished;
+
+  clear[0] = malloc(sizeof(double) * (size_t)bench_nights * samples);
+  clear[1] = malloc(sizeof(double) * (size_t)bench_nights * samples);
+  if (minutes == NULL || dMsas == NULL || RSE == NULL || scratch == NULL ||
+      window == NULL || clear[0] == NULL || clear[1] == NULL ||
+      half_range < 1 || 2 * half_range + 1 > samples) {
+    log_error(" The benchmark needs a half_range from 1 to %d, and memory\n",
+              (samples - 1) / 2);
+    return 0;
+  }
+  sample_windows(samples, half_range, window, window + samples);
+  seconds[0] = seconds[1] = 0.0;
+  for (night = 0; night < bench_nights; night++) {
+    for (k = 0; k < samples; k++) {
+      /* xorshift64 */
+      state ^= state << 13;
+      state ^= state >> 7;
+      state ^= state << 17;
+      noise = (double)(state % 1000) / 1000.0 - 0.5;
+      minutes[k] = 300 + k;
+      dMsas[k] = (float)(roundf((float)(2100.0 + 40.0 * sin(k / 95.0) +
+                                        2.0 * noise)) /
+                         100.0f);
+      if (night % 3 == 2 && (k / 60) % 2 == 1) {
+        dMsas[k] = dMsas[k] - (float)(0.8 * fabs(sin(k / 7.0)) + 0.3 * noise);
+      }
+      if (state % 200 == 0) {
+        dMsas[k] = dMsas[k] - 3.0f;
+      }
+    }
+    for (method = 0; method < 2; method++) {
+      clock_gettime(CLOCK_MONOTONIC, &started);
+      if (method == 0) {
+        calc_rse_night(samples, window, window + samples, minutes, dMsas, RSE,
+                       1000., 999000., 888000.);
+      } else {
+        calc_rse_night_robust(samples, window, window + samples, minutes,
+                              dMsas, RSE, 1000., 999000., 888000., scratch);
+      }
+      clock_gettime(CLOCK_MONOTONIC, &finished);
+      seconds[method] = seconds[method] + (finished.tv_sec - started.tv_sec) +
+                        (finished.tv_nsec - started.tv_nsec) / 1.0e9;
+      for (k = half_range; night % 3 != 2 && k < samples - half_range; k++) {
+        clear[method][count[method]++] = (double)RSE[k];
+      }
+    }
   }
 
-  /* check whether we have reached a gap in the input data time - i.e. is this
-   * data point more than the specified maximum gap length in minutes beyond the
-   * last data point? */
-  if (m > 0) {
-    /* calculate the number of minutes associated with the current data point
-     * time, and compare with the previous point */
-    /* handle the special case of crossing the midnight boundary */
-    if (dDay[m] == dDay[m - 1]) {
+  printf(" RSE of %d nights of %d 1-minute samples, half_range %d\n",
+         bench_nights, samples, half_range);
+  for (method = 0; method < 2; method++) {
+    qsort(clear[method], (size_t)count[method], sizeof(double),
+          compare_doubles);
+    printf(" %-13s %7.3f seconds (%9.0f samples per second), RSE of the "
+           "clear nights: median %8.3f, 90th percentile %8.3f\n",
+           method == 0 ? "least squares" : "robust", seconds[method],
+           seconds[method] > 0.0 ? bench_nights * samples / seconds[method]
+                                 : 0.0,
+           percentile(clear[method], count[method], 0.5),
+           percentile(clear[method], count[method], 0.9));
+  }
+  free(minutes);
+  free(dMsas);
+  free(RSE);
+  free(scratch);
+  free(window);
+  free(clear[0]);
+  free(clear[1]);
+  return 1;
+}
 
-      /* if here, this new point is on the same day */
-      num_minutesA = (int)(dHour[m] * 60. + dMinute[m]);
-    } else {
+/* Synthetic SQM data (--generate and --bench). Each station gets a file of
+ * records in the edited UDM .csv format, a sample every cadence seconds for
+ * a number of years from Jan 1 of first_year. The sun and moon columns come
+ * from the built-in ephemeris, so the moon goes through its cycles; the local
+ * time follows the US daylight saving time rules of the time zone of the
+ * longitude; and the Msas is that of a dark sky - brighter at the
+ * light-polluted stations - lit up by twilight and the moon, with 0.01
+ * magnitude steps of noise, clouds on some nights (which brighten a
+ * light-polluted sky and darken a dark one) and gaps of an hour to three days
+ * when the logger was off */
+#define SYNTHETIC_HEADER                                                       \
+  "Location,UTC_Date,UTC_Time,Local_Date,Local_Time,Celsius,Volts,Msas,"       \
+  "Status,MoonPhase,MoonElev,MoonIllum,SunElev\n"
+
+struct synthetic_spec {
+  int cadence; /* seconds between samples, 10 to 900 */
+  int stations;
+  int years;
+  int first_year;
+  unsigned long long seed;
+};
+
+/* xorshift64: the next pseudo-random number of *state, in [0, 1) */
+double next_random(unsigned long long *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return (double)(*state >> 11) / 9007199254740992.0;
+}
+
+/* the position, time zone and dark sky Msas of synthetic station n; the
+ * stations are spread over the US, from dark sites to suburbs */
+void synthetic_station(int n, double *lat, double *lon, double *dark,
+                       char *tz_rule, size_t size) {
+  *lat = 25.0 + 6.7 * (n % 5);
+  *lon = -75.0 - fmod(n * 13.7, 45.0);
+  *dark = 21.6 - 0.35 * (n % 6);
+  snprintf(tz_rule, size, "XST%dXDT", -standard_hour_delta(*lon));
+}
+
+/* write the synthetic data of station n of spec to the file name, adding the
+ * number of records to *records; returns 0 if it can't */
+int generate_station(const struct synthetic_spec *spec, int n,
+                     const char *name, long *records) {
+  struct night_buffer night = {0};
+  struct text_buffer out = {0};
+  struct time_zone tz;
+  char tz_rule[64], location[32];
+  double lat, lon, dark, flux, msas, cloudiness = 0.0, cloud, period = 1.0,
+                                     phase = 0.0;
+  long long t, local, day_start, gap_start = 0, gap_end = 0;
+  int first_day, last_day, day, count, k, cursor = 0, ok = 1;
+  unsigned long long state =
+      spec->seed + (unsigned long long)(n + 1) * 0x9E3779B97F4A7C15ULL;
+  FILE *file;
+
+  synthetic_station(n, &lat, &lon, &dark, tz_rule, sizeof(tz_rule));
+  snprintf(location, sizeof(location), "Synthetic_Station_%d", n + 1);
+  if (!time_zone_load(&tz, tz_rule)) {
+    return 0;
+  }
+  file = fopen(name, "w");
+  if (file == NULL) {
+    time_zone_free(&tz);
+    return 0;
+  }
+  fputs(SYNTHETIC_HEADER, file);
+
+  first_day = days_from_civil(spec->first_year, 1, 1);
+  last_day = days_from_civil(spec->first_year + spec->years, 1, 1);
+  t = (long long)first_day * 86400 + (n * 7) % spec->cadence;
+  for (day = first_day; ok && day < last_day; day++) {
+    day_start = (long long)day * 86400;
+
+    /* the weather of the night that starts this UTC day (in the evening in
+     * the US): clear, partly cloudy or overcast, with clouds that come and
+     * go over 20 to 90 minutes */
+    cloudiness = next_random(&state);
+    cloudiness = cloudiness < 0.55 ? 0.0 : cloudiness < 0.8 ? 0.5 : 1.0;
+    period = (20.0 + 70.0 * next_random(&state)) * 60.0 / (2.0 * 3.14159265);
+    phase = 6.2831853 * next_random(&state);
 
-      /* if here, we have crossed the midnight boundary */
-      num_minutesA = (int)(24. * 60. + dMinute[m]);
+    /* now and then the logger is off for an hour to three days */
+    if (next_random(&state) < 1.0 / 45.0) {
+      gap_start = day_start + (long long)(86400 * next_random(&state));
+      gap_end = gap_start + 3600 + (long long)(255600 * next_random(&state));
     }
 
-    num_minutesB = (int)(dHour[m - 1] * 60. + dMinute[m - 1]);
-    timediff = num_minutesA - num_minutesB;
-    /* make sure timediff is positive */
-    if (timediff < 0) {
-      timediff = timediff * -1;
+    count = 0;
+    for (; t < day_start + 86400; t = t + spec->cadence) {
+      if (t >= gap_start && t < gap_end) {
+        continue;
+      }
+      if (!night_buffer_reserve(&night, count + 1, count)) {
+        ok = 0;
+        break;
+      }
+      civil_from_days(day, &night.dUYear[count], &night.dUMonth[count],
+                      &night.dUDay[count]);
+      night.dUHour[count] = (int)(t - day_start) / 3600;
+      night.dUMinute[count] = (int)(t - day_start) / 60 % 60;
+      night.dUSeconds[count] = (float)((t - day_start) % 60);
+      local = t + tz.offset[time_zone_find(&tz, t, &cursor)];
+      civil_from_days((int)(local / 86400), &night.dYear[count],
+                      &night.dMonth[count], &night.dDay[count]);
+      night.dHour[count] = (int)(local % 86400) / 3600;
+      night.dMinute[count] = (int)(local % 86400) / 60 % 60;
+      night.dSeconds[count] = (float)(local % 60);
+      night.dCelsius[count] =
+          (float)(15.0 - 10.0 * cos(6.2831853 * (day % 365 - 15) / 365.0) -
+                  4.0 * cos(6.2831853 * (local % 86400) / 86400.0));
+      night.dVolts[count] = next_random(&state) < 0.1 ? 5.05f : 5.06f;
+      night.dStatus[count] = 0;
+      count = count + 1;
     }
+    calc_sun_moon_night(&night, count, lat, lon);
 
-    if (timediff > timediff_max) {
-      /* if here, we have found a time gap in the data - consider the data so
-       * far for this day to be all that there is */
-      printf("Found a %d minute gap in the data just after %d-%d-%d %d:%d:%d\n",
-             timediff, dYear[m - 1], dMonth[m - 1], dDay[m - 1], dHour[m - 1],
-             dMinute[m - 1], (int)dSeconds[m - 1]);
-      /* handle the case of a patch of data after a data gap during the daytime
-       * and prior to 15:00.  */
-      if (dHour[m] < 15) {
-        /* set Start flag to 3, which we check later to loop appropriately */
-        Start = 3;
+    out.length = 0;
+    for (k = 0; ok && k < count; k++) {
+      flux = 1.0;
+      if (night.dSunElev[k] > -18.0) {
+        flux = flux + pow(10.0, 0.4 * (night.dSunElev[k] + 18.0));
       }
-      /* so jump into the loop which calculates the second derivatives, etc and
-       * writes out the data to the output file for the data prior to this data
-       * gap */
-      goto LastDay;
+      if (night.dMoonElev[k] > 0.0) {
+        flux = flux + 0.3 * night.dMoonIllum[k] *
+                          sin(night.dMoonElev[k] * 3.14159265 / 180.0);
+      }
+      local = sample_utc_seconds(&night, k);
+      cloud = cloudiness * (0.5 + 0.5 * sin(local / period + phase));
+      msas = dark - 2.5 * log10(flux) + cloud * (dark > 21.0 ? 0.6 : -1.2) +
+             (0.02 + 0.3 * cloud) * (next_random(&state) - 0.5);
+      msas = msas < 0.0 ? 0.0 : msas;
+      ok = text_printf(
+          &out,
+          "%s,%04d,%02d,%02d,%02d,%02d,%02d,%04d,%02d,%02d,%02d,%02d,%02d,"
+          "%.1f,%.2f,%.2f,%d,%.1f,%.3f,%.1f,%.3f\n",
+          location, night.dUYear[k], night.dUMonth[k], night.dUDay[k],
+          night.dUHour[k], night.dUMinute[k], (int)night.dUSeconds[k],
+          night.dYear[k], night.dMonth[k], night.dDay[k], night.dHour[k],
+          night.dMinute[k], (int)night.dSeconds[k], night.dCelsius[k],
+          night.dVolts[k], msas, night.dStatus[k], night.dMoonPhase[k],
+          night.dMoonElev[k], night.dMoonIllum[k], night.dSunElev[k]);
     }
+    if (ok && out.length > 0 &&
+        fwrite(out.text, 1, out.length, file) != out.length) {
+      ok = 0;
+    }
+    *records = *records + count;
   }
 
-  /* reset the Start flag if we are already past the first day of data and if we
-   * have gone beyond the 15 hundred hour */
-  if (Start == 2) {
-    if (dHour[m] > 15) {
-      Start = 0;
-    }
+  if (fclose(file) != 0) {
+    ok = 0;
   }
+  night_buffer_free(&night);
+  text_buffer_free(&out);
+  time_zone_free(&tz);
+  return ok;
+}
 
-  /* reset the Start flag if we are already past the first day of data and if we
-   * have reached 15 hundred hour */
-  /* for the case of a partial day due to a data gap prior to 15:00 */
-  if (Start == 3) {
-    if (dHour[m] == 15) {
-      Start = 0;
+/* the name of the synthetic data file of station n */
+void synthetic_name(char *name, size_t size, const char *prefix, int n) {
+  snprintf(name, size, "%s_%d.csv", prefix, n + 1);
+}
+
+/* write the synthetic data files of spec, prefix_1.csv and so on (see
+ * struct synthetic_spec), adding up their records in *records */
+int generate_synthetic(const char *prefix, const struct synthetic_spec *spec,
+                       long *records) {
+  char name[4096];
+  int n;
+
+  *records = 0;
+  for (n = 0; n < spec->stations; n++) {
+    synthetic_name(name, sizeof(name), prefix, n);
+    if (!generate_station(spec, n, name, records)) {
+      log_error(" Failed to write the synthetic data file %s\n", name);
+      return 0;
     }
   }
+  return 1;
+}
 
-  /* We copy data for each day into memory, beginning at 15:00 hours and going
-   * all evening, night, morning to the next afternoon */
-  /* We use a flag called Start to handle reading all the other samples acquired
-   * at the beginning of the day, samples which were acquired when the hour was
-   * still 15. */
-
-  /* Check to see if we reached 15:00 hours on this day; we assume that the data
-   * are ordered in time sequence */
-  if (dHour[m] == 15 && Start == 0) {
-  /* the last sample of the previous day was m-1, so we know that the previous
-   * day has values in the arrays from 0 to m-1 */
-  LastDay:
-    Last = m - 1;
+/* The benchmark (--bench prefix): the synthetic data of spec is generated
+ * and each station file is processed sequentially with the options of the
+ * command line, timing the stages (see struct stage_timer); the throughput
+ * of each stage is printed, and if history is not NULL a line of results is
+ * added to that .csv file, to follow the speed from one version to the next.
+ * The files are removed afterwards */
+int run_bench(const char *prefix, const struct synthetic_spec *spec,
+              const struct sqm_job *options, const char *history) {
+  struct stage_timer timer = {0};
+  struct sqm_job job;
+  struct timespec started;
+  struct stat st;
+  char name[4096], output[4128], when[32], settings[128];
+  double generate_seconds, total = 0.0, staged = 0.0, dark;
+  long records, processed = 0;
+  long long bytes = 0;
+  int n, k, ok = 1;
+  time_t now;
+  FILE *file;
 
-    /* Calculation of average Msas for the day; */
-    /* loop on the day's data */
-    msas_Sum = 0.0;
-    msas_Count = 0.0;
-    for (k = 0; k < Last + 1; k++) {
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  if (!generate_synthetic(prefix, spec, &records)) {
+    return 0;
+  }
+  generate_seconds = seconds_since(&started);
 
-      /* Sun is lower than 18 degrees below the horizon and the moon is lower
-       * than 10 degrees below the horizon */
-      if (dSunElev[k] < -18.0 && dMoonElev[k] < -10.0) {
+  for (n = 0; ok && n < spec->stations; n++) {
+    job = *options;
+    synthetic_name(name, sizeof(name), prefix, n);
+    synthetic_station(n, &job.lat, &job.lon, &dark, output, sizeof(output));
+    job.NameIn = name;
+    job.NameOut = NULL;
+    job.has_position = 1;
+    job.threads = 1;
+    job.incremental = 0;
+    job.timed = 1;
+    job.progress = 0;
+    memset(&job.stages, 0, sizeof(job.stages));
+    if (stat(name, &st) == 0) {
+      bytes = bytes + st.st_size;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    ok = process_file(&job);
+    total = total + seconds_since(&started);
+    processed = processed + job.records;
+    stage_add(&timer, &job.stages);
 
-        /* tally sum and count for msas average */
-        msas_Sum = msas_Sum + dMsas[k];
-        msas_Count = msas_Count + 1.0;
-      }
+    remove(name);
+    snprintf(output, sizeof(output), "%s_SQM_Attr3.csv", name);
+    remove(output);
+    snprintf(output, sizeof(output), "%s_SQM_Attr3.sqmb", name);
+    remove(output);
+    snprintf(output, sizeof(output), "%s_SQM_Nights.csv", name);
+    remove(output);
+  }
+  if (!ok) {
+    for (n = 0; n < spec->stations; n++) {
+      synthetic_name(name, sizeof(name), prefix, n);
+      remove(name);
     }
-    /* we will later print out the average value for this day in those records
-     * that contributed to the average, not to all records */
-    /* That is, we will print out the average value for this day for those
-     * records when the sun was less than 18 degree below the horizon*/
-    /* We assign a null value (-1.0) to all points of the sun higher than -18
-     * degrees, and all points lacking any count values */
+    return 0;
+  }
+
+  printf(" %d synthetic station%s, %d year%s from %d at a %d second cadence: "
+         "%ld records (%.1f MB) generated in %.2f seconds\n",
+         spec->stations, spec->stations == 1 ? "" : "s", spec->years,
+         spec->years == 1 ? "" : "s", spec->first_year, spec->cadence,
+         records, bytes / 1.0e6, generate_seconds);
+  printf(" %-8s %9s %18s %7s\n", "stage", "seconds", "records per second",
+         "share");
+  for (k = 0; k < STAGE_COUNT; k++) {
+    staged = staged + timer.seconds[k];
+    printf(" %-8s %9.3f %18.0f %6.1f%%\n", stage_names[k], timer.seconds[k],
+           timer.seconds[k] > 0.0 ? processed / timer.seconds[k] : 0.0,
+           total > 0.0 ? 100.0 * timer.seconds[k] / total : 0.0);
+  }
+  printf(" %-8s %9.3f %18s %6.1f%%\n", "other", total - staged, "",
+         total > 0.0 ? 100.0 * (total - staged) / total : 0.0);
+  printf(" %-8s %9.3f %18.0f   (%.1f MB per second)\n", "total", total,
+         total > 0.0 ? processed / total : 0.0,
+         total > 0.0 ? bytes / 1.0e6 / total : 0.0);
+
+  if (history == NULL) {
+    return 1;
+  }
+  now = time(NULL);
+  strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+  snprintf(settings, sizeof(settings), "%s%s%s%s",
+           options->robust ? " robust" : "",
+           options->window_minutes > 0 ? " window" : "",
+           options->classify ? " classify" : "",
+           options->tz_name != NULL ? " tz" : "");
+  file = fopen(history, "a");
+  if (file == NULL) {
+    log_error(" Failed to open the benchmark history file %s\n", history);
+    return 0;
+  }
+  if (ftell(file) == 0) {
+    fprintf(file, "Time,Cadence,Stations,Years,Half_Range,Options,Records,"
+                  "Parse,Segment,Average,RSE,Coords,Write,Total,"
+                  "Records_Per_Second\n");
+  }
+  fprintf(file, "%s,%d,%d,%d,%d,%s,%ld,", when, spec->cadence, spec->stations,
+          spec->years, options->half_range,
+          settings[0] != '\0' ? settings + 1 : "-", processed);
+  for (k = 0; k < STAGE_COUNT; k++) {
+    fprintf(file, "%.4f,", timer.seconds[k]);
+  }
+  fprintf(file, "%.4f,%.0f\n", total, total > 0.0 ? processed / total : 0.0);
+  if (fclose(file) != 0) {
+    log_error(" Failed to write the benchmark history file %s\n", history);
+    return 0;
+  }
+  return 1;
+}
 
-    for (k = 0; k < Last + 1; k++) {
+/* The golden output check (--golden 20240306_131818__sun-moon-mw-clouds.csv).
+ * The sample output file which comes with the program was written by an
+ * earlier version of it; its first 15 columns give back the input records,
+ * which are processed again with a half_range of GOLDEN_HALF_RANGE. The
+ * columns which have not changed since - all but Msas_Avg,
+ * NightsSince_1118 and ResidStdErr - must be those of the sample, and all of
+ * the output must hash (see hash_bytes) to GOLDEN_HASH, so that a change to
+ * the speed of the program can't change its results without being noticed.
+ * When the results are meant to change, GOLDEN_HASH is changed with them.
+ * The built-in ephemeris, which the .csv input doesn't use, is checked
+ * against the sun and moon columns of the sample too (see golden_ephemeris) */
+#define GOLDEN_HALF_RANGE 9
+#define GOLDEN_RECORDS 12464L
+#define GOLDEN_HASH 0xa664218db93a5210ULL
 
-      if (dSunElev[k] < -18.0 && dMoonElev[k] < -10.0) {
+/* the largest differences allowed between the sun and moon columns of the
+ * sample, worked out by UDM, and those of calc_sun_moon_night; the sample
+ * has MoonPhase and MoonIllum to 0.1 and the elevations to 0.001 */
+#define GOLDEN_MOON_PHASE 0.1
+#define GOLDEN_MOON_ELEV 0.05
+#define GOLDEN_MOON_ILLUM 0.1
+#define GOLDEN_SUN_ELEV 0.01
 
-        /* handle case of no values in the msas sum */
-        msas_Avg[k] = -1.0;
-        if (msas_Count > 0.0) {
-          msas_Avg[k] = msas_Sum / msas_Count;
-        }
-      } else {
-        msas_Avg[k] = -1.0;
+/* work out the sun and moon columns of the count samples of night again with
+ * calc_sun_moon_night and keep the largest differences from those read from
+ * the sample in max_diff; returns 0 if we run out of memory */
+int golden_sun_moon(struct night_buffer *night, int count, double lat,
+                    double lon, double *max_diff) {
+  float *columns[4], *udm;
+  double diff;
+  int j, k;
+
+  udm = malloc(sizeof(float) * 4 * (size_t)(count > 0 ? count : 1));
+  if (udm == NULL) {
+    return 0;
+  }
+  columns[0] = night->dMoonPhase;
+  columns[1] = night->dMoonElev;
+  columns[2] = night->dMoonIllum;
+  columns[3] = night->dSunElev;
+  for (j = 0; j < 4; j++) {
+    memcpy(udm + (size_t)j * count, columns[j], sizeof(float) * count);
+  }
+  calc_sun_moon_night(night, count, lat, lon);
+  for (j = 0; j < 4; j++) {
+    for (k = 0; k < count; k++) {
+      diff = fabs(columns[j][k] - udm[(size_t)j * count + k]);
+      if (j == 0 && diff > 180.) {
+        diff = 360. - diff; /* the phase goes from 180 to -180 */
+      }
+      if (diff > max_diff[j]) {
+        max_diff[j] = diff;
       }
     }
+  }
+  free(udm);
+  return 1;
+}
 
-    /* Calculate Residual Standard Error values - samples are assumed to be a
-     * constant number of minutes apart; Set half_range at the program command
-     * line to specify the number of samples to consider, and given the spacing
-     * between SQM measurements, the number of minutes in the sample range;
-     * This fits a regression line to each point of data, and with half_range
-     * set to 9 and 5-minute sample spaceing then you get a range from 45
-     * minutes before to 45 minutes after the point, for a total of 90 minutes;
-     * Program calculates the deviation from the straight line, * expressed by
-     * the sum of ((observed - expected)**2 /(expected)).
-     */
+/* check the built-in ephemeris against the MoonPhase, MoonElev, MoonIllum and
+ * SunElev columns of the sample, a night (NightsSince_1118 of the sample) at
+ * a time, as process_night does; returns 0 if any of them differs by more
+ * than GOLDEN_MOON_PHASE etc. */
+int golden_ephemeris(const char *sample, double lat, double lon) {
+  static const char *names[4] = {"MoonPhase", "MoonElev", "MoonIllum",
+                                 "SunElev"};
+  static const double allowed[4] = {GOLDEN_MOON_PHASE, GOLDEN_MOON_ELEV,
+                                    GOLDEN_MOON_ILLUM, GOLDEN_SUN_ELEV};
+  struct sqm_reader reader;
+  struct night_buffer night = {0};
+  const char *line, *fields[23];
+  size_t length, lengths[23];
+  double max_diff[4] = {0.};
+  int year, month, day, hour, minute, second, days, count = 0, j, ok = 1;
 
-    /* initialize SS and RSE array values to zero */
-    /* use kk to track array elements of array */
-    for (kk = 0; kk < 1500; kk++) {
-      SS[kk] = 0.0;
+  if (!reader_open(&reader, sample)) {
+    log_error(" Failed to open the sample file %s\n", sample);
+    return 0;
+  }
+  reader_next_line(&reader, &length);
+  do {
+    line = reader_next_line(&reader, &length);
+    if (line != NULL &&
+        (split_fields(line, length, fields, lengths, 23) < 18 ||
+         lengths[3] != 10 || lengths[4] != 8 ||
+         !convert_int(fields[3], 4, &year) ||
+         !convert_int(fields[3] + 5, 2, &month) ||
+         !convert_int(fields[3] + 8, 2, &day) ||
+         !convert_int(fields[4], 2, &hour) ||
+         !convert_int(fields[4] + 3, 2, &minute) ||
+         !convert_int(fields[4] + 6, 2, &second) ||
+         !convert_int(fields[17], lengths[17], &days))) {
+      continue;
     }
-    for (kk = 0; kk < 1500; kk++) {
-      RSE[kk] = 0.0;
+    if (count > 0 && (line == NULL || days != night.days[0])) {
+      ok = ok && golden_sun_moon(&night, count, lat, lon, max_diff);
+      count = 0;
     }
-
-    /* set the first half_range of RSE values a giant value ; ditto for the last
-     * half_range values */
-    for (kk = 0; kk < half_range; kk++) {
-      RSE[kk] = nodata1;
+    if (line == NULL || !ok) {
+      break;
     }
-    for (kk = Last + 1 - half_range; kk < m; kk++) {
-      RSE[kk] = nodata1;
+    if (!night_buffer_reserve(&night, count + 1, count)) {
+      ok = 0;
+      break;
     }
+    night.dUYear[count] = year;
+    night.dUMonth[count] = month;
+    night.dUDay[count] = day;
+    night.dUHour[count] = hour;
+    night.dUMinute[count] = minute;
+    night.dUSeconds[count] = (float)second;
+    night.days[count] = days;
+    if (!convert_float(fields[11], lengths[11], &night.dMoonPhase[count]) ||
+        !convert_float(fields[12], lengths[12], &night.dMoonElev[count]) ||
+        !convert_float(fields[13], lengths[13], &night.dMoonIllum[count]) ||
+        !convert_float(fields[14], lengths[14], &night.dSunElev[count])) {
+      continue;
+    }
+    count = count + 1;
+  } while (line != NULL);
+  night_buffer_free(&night);
+  if (!reader_close(&reader)) {
+    log_error(" Failed to read the sample file %s\n", sample);
+    return 0;
+  }
+  if (!ok) {
+    log_error(" Ran out of memory checking the ephemeris\n");
+    return 0;
+  }
 
-    /* set up the degrees of freedom; we estimate two parameters, the linear
-     * regression slope and y-intercept */
-    DOF = (long double)((half_range * 2) + 1 - 2);
+  printf(" the built-in ephemeris differs from the sample by at most");
+  for (j = 0; j < 4; j++) {
+    printf(" %s %.4f", names[j], max_diff[j]);
+  }
+  printf("\n");
+  for (j = 0; j < 4; j++) {
+    if (max_diff[j] > allowed[j]) {
+      printf(" %s should be within %g of the sample\n", names[j],
+             allowed[j]);
+      ok = 0;
+    }
+  }
+  return ok;
+}
 
-    /* loop on the sample point about which we calculate the statistic */
+int golden_check(const char *sample) {
+  /* the columns of the sample that the output must still match */
+  static const int kept[] = {0,  1,  2,  3,  4,  5,  6,  7,  8,  9,
+                             10, 11, 12, 13, 14, 15, 18, 19, 20, 21};
+  const int nkept = (int)(sizeof(kept) / sizeof(kept[0]));
+  struct sqm_reader reader, output;
+  struct text_buffer in = {0};
+  struct sqm_job job = {0};
+  const char *line, *out_line, *fields[23], *out_fields[23];
+  size_t length, out_length, lengths[23], out_lengths[23];
+  char name[64], NameOut[128];
+  long records = 0, differing[23] = {0};
+  unsigned long long hash = 0;
+  int fd, k, n, ok = 1;
+  FILE *file;
 
-    /* first check to see if we have enough points in the current day to
-     * calculate a valid standard error statistic */
-    /* N is the number of point in the range of the standard error calculation
-     */
-    if (m < N) {
-      printf("We only have %d data points for this day/segment and can't "
-             "calculate a valid standard error. \n",
-             m);
-    } else {
-      for (kk = half_range; kk < Last + 1 - half_range; kk++) {
-        /* initialize sums */
-        sum_x = 0.0;
-        sum_y = 0.0;
-        sum_xy = 0.0;
-        sum_x2 = 0.0;
-        sum_y2 = 0.0;
-        RSE[kk] = 0.0;
-        SS[kk] = 0.0;
-
-        /* loop across the 2*half_range +1 values and tabulate statistics */
-        for (k = kk - half_range; k < kk + half_range + 1; k++) {
-          sum_x = sum_x + (long double)minutes_since_3pm[k];
-          sum_y = sum_y + (long double)dMsas[k];
-          sum_xy = sum_xy +
-                   (long double)minutes_since_3pm[k] * (long double)dMsas[k];
-          sum_x2 = sum_x2 + (long double)minutes_since_3pm[k] *
-                                (long double)minutes_since_3pm[k];
-          sum_y2 = sum_y2 + (long double)dMsas[k] * (long double)dMsas[k];
-          /* printf("k= %d   sum_x=%Lf  sum_y=%Lf \n", k, sum_x, sum_y); */
-        }
-        /* calculate means */
-        mean_x = sum_x / N;
-        mean_y = sum_y / N;
-        mean_xy = sum_xy / N;
-        mean_x2 = sum_x2 / N;
-        /* calculate the slope and Y-intercept of the regression line */
-        slope = (mean_xy - (mean_x * mean_y)) / (mean_x2 - (mean_x * mean_x));
-        yintercept = ((mean_x2 * mean_y) - (mean_xy * mean_x)) /
-                     (mean_x2 - (mean_x * mean_x));
-        rcorr =
-            (sum_xy - sum_x * sum_y / N) / sqrt((sum_x2 - (sum_x * sum_x) / N) *
-                                                (sum_y2 - (sum_y * sum_y) / N));
-        rsqrd = rcorr * rcorr;
-        /* printf("kk = %d   slope=%Lf  yintercept=%Lf \n", kk, slope,
-         * yintercept); */
-
-        /* Evaluate the regression line at all points of this interval of data
-         * to get the expected values (on the regression line) and use the
-         * observed and expected values in the Residual Standard Error (RSE)
-         * calculation
-         */
-        for (k = kk - half_range; k < kk + half_range + 1; k++) {
-          Expected[k] = slope * (long double)minutes_since_3pm[k] + yintercept;
-          Observed[k] = (long double)dMsas[k];
-          SS[kk] = SS[kk] +
-                   ((Observed[k] - Expected[k]) * (Observed[k] - Expected[k]));
+  if (!reader_open(&reader, sample)) {
+    log_error(" Failed to open the sample file %s\n", sample);
+    return 0;
+  }
+
+  /* give the records back the form of the input */
+  reader_next_line(&reader, &length);
+  while (ok && (line = reader_next_line(&reader, &length)) != NULL) {
+    if (split_fields(line, length, fields, lengths, 23) < 15) {
+      continue;
+    }
+    if (job.has_position == 0) {
+      job.has_position = convert_double(fields[1], lengths[1], &job.lat) &&
+                         convert_double(fields[2], lengths[2], &job.lon);
+    }
+    ok = text_printf(&in, "%.*s", (int)lengths[0], fields[0]);
+    for (n = 3; ok && n < 15; n++) {
+      ok = text_printf(&in, ",%.*s", (int)lengths[n], fields[n]);
+      for (k = (int)(in.length - lengths[n]); n < 7 && k < (int)in.length;
+           k++) {
+        if (in.text[k] == '-' || in.text[k] == ':') {
+          in.text[k] = ',';
         }
+      }
+    }
+    ok = ok && text_printf(&in, "\n");
+  }
+  if (!reader_close(&reader)) {
+    log_error(" Failed to read the sample file %s\n", sample);
+    text_buffer_free(&in);
+    return 0;
+  }
+  if (!ok || !job.has_position) {
+    log_error(" The sample file %s has no records with a position\n", sample);
+    text_buffer_free(&in);
+    return 0;
+  }
 
-        /* note that we use sqrtl here, which takes a long double argument */
-        RSE[kk] = (sqrtl(SS[kk] / DOF)) * RSE_mult;
+  snprintf(name, sizeof(name), "%s/sqm_golden_XXXXXX",
+           getenv("TMPDIR") != NULL && strlen(getenv("TMPDIR")) < 40
+               ? getenv("TMPDIR")
+               : "/tmp");
+  fd = mkstemp(name);
+  file = fd >= 0 ? fdopen(fd, "w") : NULL;
+  if (file == NULL ||
+      fputs(SYNTHETIC_HEADER, file) < 0 ||
+      fwrite(in.text, 1, in.length, file) != in.length ||
+      fclose(file) != 0) {
+    log_error(" Failed to write the input records of the sample to %s\n",
+              name);
+    text_buffer_free(&in);
+    return 0;
+  }
+  text_buffer_free(&in);
 
-        /* fix up for any negative values because Expected is negative */
-        if (RSE[kk] < 0.0) {
-          RSE[kk] = RSE[kk] * -1.0;
-        }
+  job.NameIn = name;
+  job.half_range = GOLDEN_HALF_RANGE;
+  job.threads = 1;
+  job.clear_run = 3;
+  job.window_samples = 5;
+  snprintf(NameOut, sizeof(NameOut), "%s_SQM_Attr3.csv", name);
+  ok = process_file(&job);
+  remove(name);
 
-        /* fix up for any "not a number" for the case of divide by zero above */
-        if (isnan(RSE[kk])) {
-          RSE[kk] = nodata2;
+  /* compare the output with the sample, record by record */
+  if (ok && reader_open(&reader, sample)) {
+    if (reader_open(&output, NameOut)) {
+      if (output.mapped) {
+        hash = hash_bytes(output.data, output.size);
+      }
+      reader_next_line(&reader, &length);
+      reader_next_line(&output, &out_length);
+      while ((line = reader_next_line(&reader, &length)) != NULL &&
+             (out_line = reader_next_line(&output, &out_length)) != NULL) {
+        split_fields(line, length, fields, lengths, 23);
+        if (split_fields(out_line, out_length, out_fields, out_lengths, 23) <
+            23) {
+          ok = 0;
+          break;
         }
-
-        printf("kk = %d  RSE=%Lf\n", kk, RSE[kk]);
+        for (k = 0; k < nkept; k++) {
+          n = kept[k];
+          if (lengths[n] != out_lengths[n] ||
+              memcmp(fields[n], out_fields[n], lengths[n]) != 0) {
+            differing[n] = differing[n] + 1;
+            ok = 0;
+          }
+        }
+        records = records + 1;
       }
+      reader_close(&output);
     }
+    reader_close(&reader);
+  }
+  remove(NameOut);
 
-    /* now print all this day's records to the output file */
+  printf(" %ld records of %s processed again with a half_range of %d\n",
+         records, sample, GOLDEN_HALF_RANGE);
+  for (k = 0; k < nkept; k++) {
+    if (differing[kept[k]] > 0) {
+      printf(" column %d differs from the sample in %ld records\n",
+             kept[k] + 1, differing[kept[k]]);
+    }
+  }
+  if (records != GOLDEN_RECORDS) {
+    printf(" there should be %ld records\n", GOLDEN_RECORDS);
+    ok = 0;
+  }
+  if (hash != GOLDEN_HASH) {
+    printf(" the output hashes to %016llx instead of %016llx: the results "
+           "have changed\n",
+           hash, GOLDEN_HASH);
+    ok = 0;
+  }
+  ok = golden_ephemeris(sample, job.lat, job.lon) && ok;
+  printf(" golden output check %s\n", ok ? "passed" : "FAILED");
+  return ok;
+}
 
-    for (k = 0; k < Last + 1; k++) {
+/* A query of the night index (--query data.csv_SQM_Attr3.csv): the rows of
+ * the .csv file from the nights first to last (NightsSince_1118), of the
+ * station location unless it is NULL, and if dark is set only those with the
+ * sun more than 18 and the moon more than 10 degrees below the horizon (the
+ * samples of Msas_Avg), are written to stdout after its header line. Only
+ * the nights which the index says may have such rows are read, each with one
+ * pread, and a night which can only have such rows is copied without looking
+ * at them. Returns 0 if the index is missing or damaged, or is not that of
+ * the .csv file as it is now */
+int run_query(const char *csv, const char *location, int first, int last,
+              int dark) {
+  struct sqm_reader reader;
+  const struct index_header *header;
+  const struct index_night *nights, *entry;
+  const char *labels, *line, *end, *newline, *fields[18];
+  size_t lengths[18], capacity = 0;
+  char name[4096 + 8], *rows = NULL, *grown;
+  struct timespec started;
+  struct stat st;
+  ssize_t got;
+  uint32_t n, station = 0, count = 0;
+  long matched = 0, read_nights = 0;
+  int fd = -1, night, ok;
+  float sun, moon;
 
-      /* Calculate a new variable - the number of days since Jan 1, 2018 */
-      int days = get_yday(dMonth[k], dDay[k], dYear[k]);
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  if (!index_name(name, sizeof(name), csv) || !reader_open(&reader, name)) {
+    log_error(" Failed to open the night index of %s; it is written with "
+              "--index\n",
+              csv);
+    return 0;
+  }
+  header = (const struct index_header *)reader.data;
+  ok = reader.mapped && reader.size >= sizeof(struct index_header) &&
+       memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) == 0 &&
+       header->version == INDEX_VERSION && header->byte_order == 0x01020304 &&
+       header->nights_offset == sizeof(struct index_header) &&
+       header->stations_offset ==
+           header->nights_offset +
+               (uint64_t)header->night_count * sizeof(struct index_night) &&
+       header->stations_offset <= reader.size &&
+       (header->stations_offset == reader.size ||
+        reader.data[reader.size - 1] == '\0');
+  if (!ok) {
+    log_error(" %s is not a night index this program can read\n", name);
+    reader_close(&reader);
+    return 0;
+  }
+  fd = open(csv, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0 ||
+      (uint64_t)st.st_size != header->output_size) {
+    log_error(" %s is not the file that %s was written for; it has to be "
+              "made again with --index\n",
+              csv, name);
+    if (fd >= 0) {
+      close(fd);
+    }
+    reader_close(&reader);
+    return 0;
+  }
+  nights = (const struct index_night *)(reader.data + header->nights_offset);
+  labels = reader.data + header->stations_offset;
 
-      /* We actually want the number of nights since Jan 1, 2018 - that is we
-       * want to count the evening and night as part of the same "day" -
-       * actually the same "night"; So if the minutes since 15:00 hours is
-       * greater than 540 (i.e. after midnight) we subtract one day from the
-       * "days" value so those times are considered part of the previous day
-       * (i.e."night") */
-      /*
-         Bug fix April 29, 2023 - the previous algorithm, commented out just
-       below, did not work during daylight savings time.
-       * Fixed the problem by first checking to see if the local hour is as
-       expected, give the longitude of the SQM site.
-       * We expect the local hour to be longitude/15 off from the UTC hour,
-       which is the case during non-daylight savings time.
-       * If the local hour is not as expected, then instead of shifting at 540
-       minutes (midnight), we shift at 480 minutes to
-       * provide a consistent "nights since 1118" attribute */
+  /* the number of the station, if one is asked for */
+  if (location != NULL) {
+    for (line = labels; line < reader.data + reader.size &&
+                        strcmp(line, location) != 0;
+         line = line + strlen(line) + 1) {
+      station = station + 1;
+    }
+    if (line >= reader.data + reader.size) {
+      log_error(" There is no station %s in %s\n", location, csv);
+      close(fd);
+      reader_close(&reader);
+      return 0;
+    }
+  }
 
-      /*              if(minutes_since_3pm[k] >= 540) {
-                         days = days -1;
-                      }
-      */
-      /* new code follows */
-      /* a check shows that this new algortihm is not working - needs to study
-       * this further */
-      dPosNeg = 1;
-      if (SQM_Long < 0.0) {
-        dPosNeg = -1;
+  /* the header line of the .csv file comes before the first night */
+  capacity = 4096;
+  rows = malloc(capacity);
+  got = rows != NULL ? pread(fd, rows, capacity, 0) : -1;
+  newline = got > 0 ? memchr(rows, '\n', (size_t)got) : NULL;
+  ok = newline != NULL &&
+       fwrite(rows, 1, (size_t)(newline - rows) + 1, stdout) ==
+           (size_t)(newline - rows) + 1;
+
+  for (n = 0; ok && n < header->night_count; n++) {
+    entry = &nights[n];
+    if ((location != NULL && entry->station != station) ||
+        entry->last_night < first || entry->first_night > last ||
+        (dark && (entry->sun_min >= -18.0f || entry->moon_min >= -10.0f))) {
+      continue;
+    }
+    if (entry->length > capacity) {
+      grown = realloc(rows, (size_t)entry->length);
+      if (grown == NULL) {
+        ok = 0;
+        break;
       }
+      rows = grown;
+      capacity = (size_t)entry->length;
+    }
+    got = pread(fd, rows, (size_t)entry->length, (off_t)entry->offset);
+    if (got != (ssize_t)entry->length) {
+      ok = 0;
+      break;
+    }
+    read_nights = read_nights + 1;
 
-      /* assignment to an integer will cause truncation of the remainder in the
-       * following statement, as desired */
-      dHour_Delta = abs(SQM_Long) / 15. * dPosNeg;
-      dShift_Hour = dUHour[k] + dHour_Delta;
-      if (dShift_Hour == dHour[k]) {
-        /* if here, we are in not in Daylight Savings Time */
-        if (minutes_since_3pm[k] >= 540) {
-          days = days - 1;
-        }
-      } else {
-        /* if here, we are in Daylight Savings Time */
-        if (minutes_since_3pm[k] >= 480) {
-          days = days - 1;
-        }
+    /* every row of the night is wanted */
+    if (entry->first_night >= first && entry->last_night <= last &&
+        (!dark || (entry->sun_max < -18.0f && entry->moon_max < -10.0f))) {
+      ok = fwrite(rows, 1, (size_t)entry->length, stdout) == entry->length;
+      matched = matched + entry->count;
+      continue;
+    }
+
+    /* otherwise go by NightsSince_1118, SunElev and MoonElev */
+    end = rows + entry->length;
+    for (line = rows; ok && line < end; line = newline + 1) {
+      newline = memchr(line, '\n', (size_t)(end - line));
+      if (newline == NULL) {
+        newline = end;
       }
+      if (split_fields(line, (size_t)(newline - line), fields, lengths, 18) <
+              18 ||
+          !convert_int(fields[17], lengths[17], &night) ||
+          !convert_float(fields[14], lengths[14], &sun) ||
+          !convert_float(fields[12], lengths[12], &moon)) {
+        continue;
+      }
+      if (night >= first && night <= last &&
+          (!dark || (sun < -18.0f && moon < -10.0f))) {
+        ok = fwrite(line, 1, (size_t)(newline - line), stdout) ==
+                 (size_t)(newline - line) &&
+             putchar('\n') != EOF;
+        matched = matched + 1;
+      }
+    }
+  }
+  count = header->night_count;
+  free(rows);
+  close(fd);
+  reader_close(&reader);
+  if (fflush(stdout) != 0) {
+    ok = 0;
+  }
+  log_info(" %ld rows from %ld of the %u days/segments of %s in %.3f ms\n",
+           matched, read_nights, count, csv,
+           seconds_since(&started) * 1000.0);
+  if (!ok) {
+    log_error(" Failed to read %s or to write the rows\n", csv);
+  }
+  return ok;
+}
+
+int main(int argc, char *argv[]) {
+  struct sqm_job job = {0};
+  const char *manifest = NULL;
+  char *args[6]; /* the program name and the parameters, without options */
+  const char *bench = NULL, *generate = NULL, *history = NULL, *golden = NULL;
+  const char *report = NULL, *registry_name = NULL;
+  const char *query = NULL, *query_location = NULL;
+  int query_first = INT_MIN, query_last = INT_MAX, query_dark = 0;
+  struct station_registry registry;
+  struct synthetic_spec spec = {60, 1, 1, 2019, 88172645463325252ULL};
+  int nargs, threads, level, n, bench_half_range = 0;
+
+  /* Run this program by specifying the program name, followed by three
+   * parameters: 1) A file of SQM data which has already been processed as a csv
+   * with sun and moon data */
+  /*                      2) The latitude of the SQM location in fractions and
+   *                      3) The longitude of the SQM location in fractions and
+   * so the command line should look like this:
+   *                             ./addSQMattributes inputfilename.csv 43.7916667
+   * -120.23422 */
+  /* The input may instead be a raw UDM .dat file, whose header gives the
+   * latitude and longitude, in which case they may be left off the command
+   * line:
+   *                             ./addSQMattributes inputfilename.dat 9 */
+  /* Many files are processed at once, on as many threads as the machine has
+   * processors unless told otherwise, with a manifest file which lists one
+   * input file per line, followed by the lat, long and half_range or, for a
+   * .dat file with a position in its header, by just the half_range:
+   *                             ./addSQMattributes --batch manifest.txt
+   *                             ./addSQMattributes --batch manifest.txt
+   * --threads 4 */
+  /* A single long file may also be spread over several threads (0 for one per
+   * processor), which holds all of it in memory at once:
+   *                             ./addSQMattributes inputfilename.csv 43.7916667
+   * -120.23422 9 --threads 8 */
+  /* The amount of output on the screen is set with --log quiet, info (the
+   * default for a single file), debug or trace (the default for a batch is
+   * quiet). With --binary a _SQM_Attr3.sqmb file of typed columns (see
+   * struct binary_header) is written as well as the .csv file. With
+   * --incremental only what was added to the input since the last run is
+   * processed (see struct checkpoint). The options may go anywhere on the
+   * command line */
+  /* The input file may be - for stdin, in which case the output records go to
+   * stdout (and the messages to stderr), a day at a time as soon as each day
+   * is complete, so the program can sit in a pipe:
+   *                             zstd -dc inputfilename.csv.zst |
+   *                             ./addSQMattributes - 43.7916667 -120.23422 9 |
+   *                             loader */
+  /* The output may be given another name, or - for stdout, with
+   * --output outputfilename.csv */
+  /* With --classify 30 each record gets two more columns: Clear, which is 1
+   * if the sample is clear (its RSE is 30 or less, in a run of at least 3
+   * such samples, or as many as given with --clear-run), 0 if it is cloudy
+   * and -1 if it has no RSE, and Msas_Avg_Clear, the Msas_Avg of just the
+   * clear samples (see classify_night) */
+  /* With --nights a _SQM_Nights.csv table is written as well, with one row of
+   * statistics per night (see NIGHT_TABLE_HEADER) */
+  /* With --robust the RSE windows are fitted so that a spike does not
+   * disturb them (see calc_rse_night_robust), at 10 to 45 times the cost of
+   * the least squares RSE; --bench-rse 30 times the least squares and robust
+   * RSE on synthetic 1-minute data */
+  /* With --window 45 the RSE is taken over the samples within 45 minutes
+   * either side of each sample instead of half_range samples either side,
+   * as long as there are at least 5 of them, or as many as given with
+   * --window-samples (see time_windows); the half_range is then not used */
+  /* With --tz America/Chicago (or a POSIX TZ string such as CST6CDT, or
+   * header for the Local timezone of a .dat file) MinSince3pmStdTime and
+   * NightsSince_1118 go by that time zone instead of the longitude (see
+   * struct time_zone) */
+  /* With --scales 3,6,9 each record also gets the RSE with a half_range of 3,
+   * 6 and 9 (or with --window, windows of 3, 6 and 9 minutes either side) in
+   * columns ResidStdErr_3 and so on, in one pass over the data (see
+   * calc_rse_prefix) */
+  /* --bench synthetic times the stages of the program on synthetic data
+   * (see struct synthetic_spec), 1 year of 1-minute samples from 1 station
+   * unless given --cadence, --years and --stations, with the options and
+   * half_range (9 unless given) of the command line, and with
+   * --bench-history bench.csv adds its results to that file; --generate
+   * synthetic just writes the data. --golden
+   * 20240306_131818__sun-moon-mw-clouds.csv checks that the results are those
+   * of the sample output file which comes with the program (see
+   * golden_check) */
+  /* With --registry stations.csv each record also gets Msas_Corr, its Msas
+   * corrected by the offset and temperature coefficient of the station in
+   * force that night, and a .dat file without a position on the command line
+   * takes it from there (see struct station_registry) */
+  /* An input file named data.csv.gz or data.csv.zst is decompressed as it
+   * is read, and its output written compressed the same way to
+   * data.csv_SQM_Attr3.csv.gz; an --output name ending in .gz or .zst is
+   * compressed too */
+  /* With --index a _SQM_Attr3.sqmi night index is written as well (see
+   * struct index_header); --query data.csv_SQM_Attr3.csv then writes the
+   * rows of the nights given with --night 2011 or --night 2011-2040 (all of
+   * them if not given), of the station given with --location (all of them if
+   * not), and with --dark only the dark ones, reading no more of the file
+   * than it has to (see run_query) */
+  /* --report run.json writes the records read, rejected and written, the
+   * gaps, the RSE nodata values, the bytes and the time of each stage of the
+   * run and of each file to run.json (see write_report); --progress 10
+   * reports how a file is getting on every 10 seconds */
 
-      /* calculate right ascension for the SQM_Location */
-      right_ascension =
-          get_right_ascension(dUYear[k], dUMonth[k], dUDay[k], dUHour[k],
-                              dUMinute[k], (int)dUSeconds[k], SQM_Long);
-      printf(" right_ascension=%10.6lf\n", right_ascension);
-
-      /* convert right_ascension (SQM_RA) from hours to radians */
-      SQM_RA = (right_ascension * 15.) * (pi / 180.);
-
-      /* the Declination of the SQM is its Latitude, convert it from decimal
-       * degrees to radians */
-      SQM_Dec = SQM_Lat * (pi / 180.);
-
-      /* the following Equations are from Wikipedia on Celestial Coordinate
-       * Systems */
-      /* we previously set up these constants:    RightAscension_NGP,  Dec_NGP,
-       * Galactic_Long_NCP */
-
-      Galactic_Lat =
-          asin(sin(SQM_Dec) * sin(Dec_NGP) +
-               cos(SQM_Dec) * cos(Dec_NGP) * cos(SQM_RA - RightAscension_NGP));
-      /*              Galactic_Long =  Galactic_Long_NCP - ( asin( (cos(SQM_Dec)
-       * * sin(SQM_RA-RightAscension_NGP)/cos(Galactic_Lat)) ) ); */
-      YY = cos(SQM_Dec) * sin(SQM_RA - RightAscension_NGP);
-      XX = (sin(SQM_Dec) * cos(Dec_NGP)) -
-           (cos(SQM_Dec) * sin(Dec_NGP) * cos(SQM_RA - RightAscension_NGP));
-      Galactic_Long = Galactic_Long_NCP - atan2(YY, XX);
-
-      /* convert Galactic_Lat and Galactic_Long from radians to degrees */
-      Galactic_Lat = Galactic_Lat * (180. / pi);
-      Galactic_Long = Galactic_Long * (180. / pi);
-
-      /* Make sure that Galactic_Long is a positive number */
-      if (Galactic_Long < 0.0) {
-        Galactic_Long = 360. + Galactic_Long;
-      }
-
-      /*  get the J2000 day value */
-      J2000_days = get_J2000(dUYear[k], dUMonth[k], dUDay[k], dUHour[k],
-                             dUMinute[k], (int)dUSeconds[k]);
-
-      printf("%s,%12.7lf,%12.7lf,%04d-%02d-%02d,%02d:%02d:%02d,%04d-%02d-%02d,%"
-             "02d:%02d:%02d,%.1f,%.2f,%.2f,%1d,%.1f,%.3f,%.1f,%.3f,%04d,%f,%"
-             "04d,%12.7lf,%12.7lf,%10.5lf,%lf,%Lf\n",
-             SQM_Location, SQM_Lat, SQM_Long, dUYear[k], dUMonth[k], dUDay[k],
-             dUHour[k], dUMinute[k], (int)dUSeconds[k], dYear[k], dMonth[k],
-             dDay[k], dHour[k], dMinute[k], (int)dSeconds[k], dCelsius[k],
-             dVolts[k], dMsas[k], dStatus[k], dMoonPhase[k], dMoonElev[k],
-             dMoonIllum[k], dSunElev[k], minutes_since_3pm[k], msas_Avg[k],
-             days, right_ascension, Galactic_Lat, Galactic_Long, J2000_days,
-             RSE[k]);
-
-      /* Note, we need to output two numbers for each of hour, minute and
-         seconds. If only one digit is output, Spotfire, and other programs,
-         will take the digit as a ten's value, insted of a one's value*/
-      fprintf(fdataout,
-              "%s,%12.7lf,%12.7lf,%04d-%02d-%02d,%02d:%02d:%02d,%04d-%02d-%02d,"
-              "%02d:%02d:%02d,%.1f,%.2f,%.2f,%1d,%.1f,%.3f,%.1f,%.3f,%04d,%f,%"
-              "04d,%12.7lf,%12.7lf,%10.5lf,%lf,%Lf\n",
-              SQM_Location, SQM_Lat, SQM_Long, dUYear[k], dUMonth[k], dUDay[k],
-              dUHour[k], dUMinute[k], (int)dUSeconds[k], dYear[k], dMonth[k],
-              dDay[k], dHour[k], dMinute[k], (int)dSeconds[k], dCelsius[k],
-              dVolts[k], dMsas[k], dStatus[k], dMoonPhase[k], dMoonElev[k],
-              dMoonIllum[k], dSunElev[k], minutes_since_3pm[k], msas_Avg[k],
-              days, right_ascension, Galactic_Lat, Galactic_Long, J2000_days,
-              RSE[k]);
+  threads = -1;
+  level = -1;
+  job.clear_run = 3;
+  job.window_samples = 5;
+  nargs = 0;
+  for (n = 0; n < argc; n++) {
+    if (n + 1 < argc && strcmp(argv[n], "--batch") == 0) {
+      n = n + 1;
+      manifest = argv[n];
+    } else if (n + 1 < argc && strcmp(argv[n], "--threads") == 0) {
+      n = n + 1;
+      sscanf(argv[n], "%d", &threads);
+    } else if (n + 1 < argc && strcmp(argv[n], "--classify") == 0) {
+      n = n + 1;
+      job.classify = sscanf(argv[n], "%lf", &job.clear_RSE_max) == 1;
+      if (!job.classify) {
+        log_error(" --classify needs the largest RSE of a clear sample\n");
+        return -1;
+      }
+    } else if (n + 1 < argc && strcmp(argv[n], "--clear-run") == 0) {
+      n = n + 1;
+      sscanf(argv[n], "%d", &job.clear_run);
+    } else if (n + 1 < argc && strcmp(argv[n], "--window") == 0) {
+      n = n + 1;
+      sscanf(argv[n], "%d", &job.window_minutes);
+    } else if (n + 1 < argc && strcmp(argv[n], "--scales") == 0) {
+      n = n + 1;
+      job.scale_count = parse_scales(argv[n], job.scales);
+      if (job.scale_count < 0) {
+        log_error(" --scales needs a list of up to %d half_ranges (or with "
+                  "--window, minutes) such as 3,6,9\n",
+                  MAX_RSE_SCALES);
+        return -1;
+      }
+    } else if (n + 1 < argc && strcmp(argv[n], "--tz") == 0) {
+      n = n + 1;
+      job.tz_name = argv[n];
+    } else if (n + 1 < argc && strcmp(argv[n], "--registry") == 0) {
+      n = n + 1;
+      registry_name = argv[n];
+    } else if (n + 1 < argc && strcmp(argv[n], "--window-samples") == 0) {
+      n = n + 1;
+      sscanf(argv[n], "%d", &job.window_samples);
+    } else if (n + 1 < argc && strcmp(argv[n], "--bench-rse") == 0) {
+      n = n + 1;
+      sscanf(argv[n], "%d", &bench_half_range);
+    } else if (n + 1 < argc && strcmp(argv[n], "--bench") == 0) {
+      n = n + 1;
+      bench = argv[n];
+    } else if (n + 1 < argc && strcmp(argv[n], "--generate") == 0) {
+      n = n + 1;
+      generate = argv[n];
+    } else if (n + 1 < argc && strcmp(argv[n], "--cadence") == 0) {
+      n = n + 1;
+      sscanf(argv[n], "%d", &spec.cadence);
+    } else if (n + 1 < argc && strcmp(argv[n], "--stations") == 0) {
+      n = n + 1;
+      sscanf(argv[n], "%d", &spec.stations);
+    } else if (n + 1 < argc && strcmp(argv[n], "--years") == 0) {
+      n = n + 1;
+      sscanf(argv[n], "%d", &spec.years);
+    } else if (n + 1 < argc && strcmp(argv[n], "--bench-history") == 0) {
+      n = n + 1;
+      history = argv[n];
+    } else if (n + 1 < argc && strcmp(argv[n], "--golden") == 0) {
+      n = n + 1;
+      golden = argv[n];
+    } else if (n + 1 < argc && strcmp(argv[n], "--report") == 0) {
+      n = n + 1;
+      report = argv[n];
+    } else if (n + 1 < argc && strcmp(argv[n], "--progress") == 0) {
+      n = n + 1;
+      sscanf(argv[n], "%d", &job.progress);
+    } else if (n + 1 < argc && strcmp(argv[n], "--output") == 0) {
+      n = n + 1;
+      job.NameOut = argv[n];
+    } else if (n + 1 < argc && strcmp(argv[n], "--log") == 0) {
+      n = n + 1;
+      level = parse_log_level(argv[n]);
+      if (level < 0) {
+        log_error(" The log level must be quiet, info, debug or trace\n");
+        return -1;
+      }
+    } else if (strcmp(argv[n], "--binary") == 0) {
+      job.binary = 1;
+    } else if (strcmp(argv[n], "--incremental") == 0) {
+      job.incremental = 1;
+    } else if (strcmp(argv[n], "--nights") == 0) {
+      job.night_table = 1;
+    } else if (strcmp(argv[n], "--index") == 0) {
+      job.index = 1;
+    } else if (n + 1 < argc && strcmp(argv[n], "--query") == 0) {
+      n = n + 1;
+      query = argv[n];
+    } else if (n + 1 < argc && strcmp(argv[n], "--location") == 0) {
+      n = n + 1;
+      query_location = argv[n];
+    } else if (n + 1 < argc && strcmp(argv[n], "--night") == 0) {
+      n = n + 1;
+      if (sscanf(argv[n], "%d-%d", &query_first, &query_last) == 1) {
+        query_last = query_first;
+      }
+    } else if (strcmp(argv[n], "--dark") == 0) {
+      query_dark = 1;
+    } else if (strcmp(argv[n], "--robust") == 0) {
+      job.robust = 1;
+    } else if (nargs < 6) {
+      args[nargs] = argv[n];
+      nargs = nargs + 1;
     }
+  }
 
-    /* if we are at the EOF, we have already written out the last day's data, so
-     * terminate */
-    if (ret == EOF) {
-      goto Termination;
+  if (bench_half_range > 0) {
+    return bench_rse(bench_half_range) ? 0 : 1;
+  }
+  if (registry_name != NULL) {
+    if (!station_registry_load(&registry, registry_name)) {
+      return -1;
     }
+    job.registry = &registry;
+  }
 
-    /* if here, we have written out all of the day's attributes, so keep the
-     * very last record and proceed to read the next record */
-    dUYear[0] = dUYear[m];
-    dUMonth[0] = dUMonth[m];
-    dUDay[0] = dUDay[m];
-    dUHour[0] = dUHour[m];
-    dUMinute[0] = dUMinute[m];
-    dUSeconds[0] = dUSeconds[m];
-    dYear[0] = dYear[m];
-    dMonth[0] = dMonth[m];
-    dDay[0] = dDay[m];
-    dHour[0] = dHour[m];
-    dMinute[0] = dMinute[m];
-    dSeconds[0] = dSeconds[m];
-    dCelsius[0] = dCelsius[m];
-    dVolts[0] = dVolts[m];
-    dMsas[0] = dMsas[m];
-    dStatus[0] = dStatus[m];
-    dMoonPhase[0] = dMoonPhase[m];
-    dMoonElev[0] = dMoonElev[m];
-    dMoonIllum[0] = dMoonIllum[m];
-    dSunElev[0] = dSunElev[m];
-    minutes_since_3pm[0] = minutes_since_3pm[m];
-    RSE[0] = RSE[m] / RSE_mult;
+  /* the benchmark, its synthetic data and the golden output check report
+   * nothing but their results unless asked to */
+  if (bench != NULL || generate != NULL || golden != NULL) {
+    log_level = level >= 0 ? level : LOG_QUIET;
+    if (spec.cadence < 10 || spec.cadence > 900 || spec.stations < 1 ||
+        spec.years < 1) {
+      log_error(" The synthetic data needs a --cadence of 10 to 900 seconds, "
+                "and at least one of --stations and --years\n");
+      return -1;
+    }
+  }
+  if (golden != NULL) {
+    return golden_check(golden) ? 0 : 1;
+  }
 
-    /* m is incremented above, so set it to zero here; this avoids writing over
-     * the data we just stored at location zero */
-    m = 0;
+  /* the rows of a query go to stdout, so anything else goes to stderr */
+  if (query != NULL) {
+    log_level = level >= 0 ? level : LOG_QUIET;
+    log_to_stderr = 1;
+    return run_query(query, query_location, query_first, query_last,
+                     query_dark)
+               ? 0
+               : 1;
+  }
+  if (generate != NULL) {
+    long records;
 
-    if (Start == 3) {
-      /* if here, we have a case of a partial day of data after a data gap and
-       * prior to 15:00 in the day */
-      goto ReadAnother;
-    } else {
+    if (!generate_synthetic(generate, &spec, &records)) {
+      return 1;
+    }
+    printf(" %ld synthetic records written to %s_1.csv to %s_%d.csv\n",
+           records, generate, generate, spec.stations);
+    return 0;
+  }
+  if (bench != NULL) {
+    job.half_range = 9;
+    if (nargs == 2) {
+      sscanf(args[1], "%d", &job.half_range);
+    }
+    return run_bench(bench, &spec, &job, history) ? 0 : 1;
+  }
 
-      /* set the flag to direct all the next samples acquired in the "15"
-       * hundred hour into a new day */
-      Start = 2;
+  if (manifest != NULL) {
+    log_level = level >= 0 ? level : LOG_QUIET;
+    if (nargs != 1 || job.NameOut != NULL) {
+      log_error(" The batch command line should look something like this: "
+                "./addSQMattributes --batch manifest.txt --threads 4\n");
+      return -1;
     }
-    goto ReadAnother;
+    return run_batch(manifest, threads > 0 ? threads : 0, &job, report) ? 0
+                                                                       : 1;
   }
-  goto ReadAnother;
 
-/* if here, we have reached the EOF on fscanf */
-Termination:
-  printf(" Reached the End of File");
-  fclose(fdata);
-  fclose(fdataout);
+  if (level >= 0) {
+    log_level = level;
+  }
+
+  /* when the records go to stdout, everything else goes to stderr */
+  if (job.NameOut != NULL ? strcmp(job.NameOut, "-") == 0
+                          : nargs > 1 && strcmp(args[1], "-") == 0) {
+    log_to_stderr = 1;
+  }
+  log_info("We are running Program %s\n", argv[0]);
+
+  if (nargs != 3 && nargs != 5) {
+    log_error(" You need to supply four parameters, the name of an input .csv "
+              "file, the lat and long of the SQM and the Half Range for "
+              "Chi-Squared Calc \n");
+    log_error(" The command line should look something like this: "
+              "./addSQMattributes inputfilename.csv 43.7916667 -120.23422 9\n");
+    log_error(" For a UDM .dat file the lat and long may be left off: "
+              "./addSQMattributes inputfilename.dat 9\n");
+    log_error(" To process the files listed in a manifest: "
+              "./addSQMattributes --batch manifest.txt\n");
+    log_error(" To spread a long file over several threads add --threads 8, "
+              "to choose how much is reported add --log "
+              "quiet|info|debug|trace, to write a binary output file as well "
+              "add --binary, and to only process what was added since the "
+              "last run add --incremental\n");
+    log_error(" To read stdin give - as the input file; the records then go "
+              "to stdout, or to the file given with --output\n");
+    log_error(" Input and output files whose names end in .gz or .zst are "
+              "decompressed and compressed with gzip or zstd as they are read "
+              "and written\n");
+    log_error(" To flag the clear samples, those with an RSE of at most 30 "
+              "in runs of at least 3, add --classify 30 --clear-run 3\n");
+    log_error(" To write a table with a row of statistics per night as well "
+              "add --nights\n");
+    log_error(" To fit the RSE windows robustly, so that a spike does not "
+              "disturb them, add --robust (the RSE then takes 10 to 45 times "
+              "as long, more the wider the window; --bench-rse half_range "
+              "measures it)\n");
+    log_error(" To take the RSE over the samples within 45 minutes either "
+              "side of each sample, whatever the cadence, instead of "
+              "half_range samples, add --window 45 (and --window-samples 5 for "
+              "the fewest samples a window may have)\n");
+    log_error(" To work out local standard time and the nights by a time zone "
+              "instead of the longitude add --tz America/Chicago, a POSIX TZ "
+              "string such as --tz CST6CDT, or --tz header for the time zone "
+              "in a .dat file\n");
+    log_error(" To add an RSE column for each of several half_ranges (or "
+              "with --window, minutes) at the cost of one, add --scales "
+              "3,6,9\n");
+    log_error(" To time the program on synthetic data: ./addSQMattributes "
+              "--bench synthetic 9 --cadence 60 --stations 1 --years 1 "
+              "--bench-history bench.csv, and to check that its results have "
+              "not changed: ./addSQMattributes --golden "
+              "20240306_131818__sun-moon-mw-clouds.csv\n");
+    log_error(" To add an Msas_Corr column with the offsets and temperature "
+              "coefficients of the stations in a registry file add "
+              "--registry stations.csv\n");
+    log_error(" To write a night index as well add --index, and to read "
+              "nights with it: ./addSQMattributes --query "
+              "inputfilename.csv_SQM_Attr3.csv --night 2011-2040 --location "
+              "The_Freeman_Center --dark\n");
+    log_error(" To write the counts and stage timings of the run to a JSON "
+              "file add --report run.json, and to report progress every 10 "
+              "seconds add --progress 10\n");
+    return -1;
+  }
+
+  job.NameIn = args[1];
+  job.threads = threads;
+  if (threads < 0) {
+    job.threads = 1;
+  } else if (threads == 0) {
+    job.threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (nargs == 5) {
+    /* printf(" The latitude of the SQM on reading is: %s\n", argv[2]); */
+    sscanf(args[2], "%lf", &job.lat);
+
+    /* printf(" The longitude of the SQM on reading is: %s\n", argv[3]); */
+    sscanf(args[3], "%lf", &job.lon);
+
+    /* printf(" The Half Range value on reading is: %d\n", argv[4]); */
+    sscanf(args[4], "%d", &job.half_range);
+    job.has_position = 1;
+  } else {
+    sscanf(args[2], "%d", &job.half_range);
+  }
+  job.timed = report != NULL;
+
+  if (!process_file(&job)) {
+    if (report != NULL) {
+      write_report(report, &job, 1, job.seconds);
+    }
+    return -1;
+  }
+  if (report != NULL && !write_report(report, &job, 1, job.seconds)) {
+    return -1;
+  }
+  return 0;
 }